@@ -0,0 +1,210 @@
+#include "precomp.h"
+
+void BlasPool::Allocator::Init( uint _size )
+{
+	free.clear( );
+	if ( _size > 0 ) free[0] = _size;
+}
+int BlasPool::Allocator::Alloc( uint _size )
+{
+	if ( _size == 0 ) return 0;
+	for ( auto it = free.begin( ); it != free.end( ); it++ )
+	{
+		if ( it->second < _size ) continue;
+		uint offset = it->first, left = it->second - _size;
+		free.erase( it );
+		if ( left > 0 ) free[offset + _size] = left;
+		return (int)offset;
+	}
+	return -1;
+}
+void BlasPool::Allocator::Free( uint _offset, uint _size )
+{
+	if ( _size == 0 ) return;
+	auto next = free.lower_bound( _offset );
+	if ( next != free.end( ) && _offset + _size == next->first ) _size += next->second, next = free.erase( next );
+	if ( next != free.begin( ) )
+	{
+		auto prev = std::prev( next );
+		if ( prev->first + prev->second == _offset ) { prev->second += _size; return; }
+	}
+	free[_offset] = _size;
+}
+
+void BlasPool::Init( Scene& _scene, bool _bvh4 )
+{
+	const std::vector<BVHNode2>& nodes = _scene.bvh2->bvhNodes;
+	bvh4_ = _bvh4;
+	nodeSize_ = _bvh4 ? sizeof( BVHNode4 ) : sizeof( BVHNode2 );
+	nodes_ = _bvh4 ? (const uchar*)_scene.bvh4->Nodes( ).data( ) : (const uchar*)nodes.data( );
+	idx_ = _scene.bvh2->primIdx.data( );
+	// BuildBLAS appends, so the nodes of a BLAS run from its root up to the next root; its indices
+	// are the ones its leaves refer to
+	std::vector<uint> roots;
+	for ( const BVHInstance& instance : _scene.blasNodes ) roots.push_back( instance.bvhIdx );
+	std::sort( roots.begin( ), roots.end( ) );
+	roots.erase( std::unique( roots.begin( ), roots.end( ) ), roots.end( ) );
+	blases = (int)roots.size( );
+	size_t totalNodes = 0, totalIdx = 0;
+	uint maxNodes = 0, maxIdx = 0;
+	for ( int i = 0; i < blases; i++ )
+	{
+		Blas blas = {};
+		blas.firstNode = roots[i];
+		blas.nodes = ( i + 1 < blases ? roots[i + 1] : (uint)nodes.size( ) ) - roots[i];
+		uint first = UINT_MAX, last = 0;
+		for ( uint n = blas.firstNode; n < blas.firstNode + blas.nodes; n++ )
+			if ( nodes[n].count > 0 ) first = std::min( first, nodes[n].first ), last = std::max( last, nodes[n].first + nodes[n].count );
+		blas.firstIdx = first == UINT_MAX ? 0 : first;
+		blas.idxCount = last - blas.firstIdx;
+		blas_.push_back( blas );
+		totalNodes += blas.nodes, totalIdx += blas.idxCount;
+		maxNodes = std::max( maxNodes, blas.nodes ), maxIdx = std::max( maxIdx, blas.idxCount );
+	}
+	instances = _scene.blasNodes;
+	for ( BVHInstance& instance : instances )
+		instance.bvhIdx = (uint)( std::lower_bound( roots.begin( ), roots.end( ), instance.bvhIdx ) - roots.begin( ) );
+	// the budget is split over the pools as the scene splits its bytes, and either pool holds at
+	// least the largest BLAS, within what the device can allocate at once
+	cl_ulong maxAlloc = 0;
+	clGetDeviceInfo( Kernel::GetDevice( ), CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof( maxAlloc ), &maxAlloc, 0 );
+	maxAlloc = std::min( maxAlloc, (cl_ulong)UINT_MAX );
+	double totalBytes = (double)totalNodes * nodeSize_ + (double)totalIdx * sizeof( uint );
+	double share = std::min( 1.0, ( (double)BLAS_POOL_MB * 1024 * 1024 ) / std::max( 1.0, totalBytes ) );
+	auto poolSize = [&]( size_t total, uint largest, size_t elementSize ) {
+		size_t size = std::max( (size_t)largest, (size_t)ceil( total * share ) );
+		return (uint)std::max( (size_t)1, std::min( { size, total, (size_t)( maxAlloc / elementSize ) } ) );
+	};
+	uint poolNodes = poolSize( totalNodes, maxNodes, nodeSize_ ), poolIdx = poolSize( totalIdx, maxIdx, sizeof( uint ) );
+	allResident_ = poolNodes >= totalNodes && poolIdx >= totalIdx;
+	nodeAlloc_.Init( poolNodes ), idxAlloc_.Init( poolIdx );
+	roots_.assign( std::max( blases, 1 ), BLAS_ABSENT );
+	lru_.Init( blases, BLAS_FEEDBACK_USED );
+	feedbackBuffer = lru_.feedbackBuffer;
+	// in scene order while they fit, the rest when the rays ask for them
+	std::vector<uchar> nodePool( (size_t)poolNodes * nodeSize_ );
+	std::vector<uint> idxPool( poolIdx );
+	int missing = 0;
+	for ( int i = 0; i < blases; i++ )
+	{
+		Blas& blas = blas_[i];
+		if ( blas.nodes > poolNodes || blas.idxCount > poolIdx ) roots_[i] = BLAS_MISSING, missing++;
+		else if ( Place( i, -1 ) ) Copy( blas, nodePool.data( ) + blas.poolNode * nodeSize_, idxPool.data( ) + blas.poolIdx );
+	}
+	if ( missing > 0 ) printf( "W/BlasPool: %i BLASes do not fit in the pools and will be missing\n", missing );
+	poolBytes = nodePool.size( ) + idxPool.size( ) * sizeof( uint );
+	nodeBuffer = new Buffer( (uint)nodePool.size( ), nodePool.data( ) );
+	nodeBuffer->CopyToDevice( );
+	nodeBuffer->hostBuffer = 0;
+	idxBuffer = new Buffer( sizeof( uint ) * poolIdx, idxPool.data( ) );
+	idxBuffer->CopyToDevice( );
+	idxBuffer->hostBuffer = 0;
+	rootBuffer = new Buffer( sizeof( int ) * (uint)roots_.size( ), roots_.data( ) );
+	rootBuffer->CopyToDevice( );
+	printf( "BLAS pool: %i BLASes, %u nodes, %u indices (%.0fMB), %i resident\n", blases, poolNodes, poolIdx, poolBytes / ( 1024.f * 1024 ), resident );
+}
+bool BlasPool::Place( int _blas, int _slot )
+{
+	Blas& blas = blas_[_blas];
+	while ( true )
+	{
+		int node = nodeAlloc_.Alloc( blas.nodes ), idx = node < 0 ? -1 : idxAlloc_.Alloc( blas.idxCount );
+		if ( idx >= 0 )
+		{
+			blas.poolNode = (uint)node, blas.poolIdx = (uint)idx;
+			// the root is the first node of the range
+			roots_[_blas] = node;
+			resident++;
+			lru_.Touch( _blas );
+			return true;
+		}
+		if ( node >= 0 ) nodeAlloc_.Free( node, blas.nodes );
+		// the BLASes the frame used stay, and so do the ones placed for it
+		int victim = _slot < 0 ? -1 : lru_.Victim( );
+		if ( victim < 0 ) return false;
+		Evict( victim, _slot );
+	}
+}
+void BlasPool::Evict( int _blas, int _slot )
+{
+	const Blas& blas = blas_[_blas];
+	nodeAlloc_.Free( blas.poolNode, blas.nodes );
+	idxAlloc_.Free( blas.poolIdx, blas.idxCount );
+	roots_[_blas] = BLAS_ABSENT;
+	lru_.SetEntry( _slot, _blas, BLAS_ABSENT );
+	lru_.Unlink( _blas );
+	resident--;
+}
+void BlasPool::Copy( const Blas& _blas, uchar* _nodes, uint* _idx ) const
+{
+	memcpy( _nodes, nodes_ + _blas.firstNode * nodeSize_, _blas.nodes * nodeSize_ );
+	if ( _idx ) memcpy( _idx, idx_ + _blas.firstIdx, _blas.idxCount * sizeof( uint ) );
+	// interior nodes point at nodes, leaves at indices; both moved
+	int nodeShift = (int)_blas.poolNode - (int)_blas.firstNode, idxShift = (int)_blas.poolIdx - (int)_blas.firstIdx;
+	if ( bvh4_ )
+	{
+		BVHNode4* node = (BVHNode4*)_nodes;
+		for ( uint n = 0; n < _blas.nodes; n++ ) for ( int i = 0; i < 4; i++ )
+			if ( node[n].first[i] != INVALID ) node[n].first[i] += node[n].count[i] > 0 ? idxShift : nodeShift;
+	}
+	else
+	{
+		BVHNode2* node = (BVHNode2*)_nodes;
+		for ( uint n = 0; n < _blas.nodes; n++ ) node[n].first += node[n].count > 0 ? idxShift : nodeShift;
+	}
+}
+void BlasPool::Update( int _slot )
+{
+	loaded = 0;
+	if ( allResident_ ) return;
+	const uint* feedback = lru_.BeginFrame( _slot );
+	int requests = std::min( (int)feedback[0], BLAS_MAX_REQUESTS );
+	// places first, so the staging memory is sized before any write points into it
+	std::vector<int> loads;
+	size_t bytes = 0;
+	for ( int i = 0; i < requests; i++ )
+	{
+		int blas = feedback[1 + i];
+		// no room without evicting what the frame used: the request comes back later
+		if ( !Place( blas, _slot ) ) roots_[blas] = BLAS_ABSENT;
+		else loads.push_back( blas ), bytes += blas_[blas].nodes * nodeSize_ + blas_[blas].idxCount * sizeof( uint );
+		lru_.SetEntry( _slot, blas, roots_[blas] );
+	}
+	cl_command_queue queue = Kernel::GetQueue( );
+	staging_[_slot].resize( bytes );
+	uchar* data = staging_[_slot].data( );
+	for ( int blas : loads )
+	{
+		const Blas& b = blas_[blas];
+		size_t nodeBytes = b.nodes * nodeSize_, idxBytes = b.idxCount * sizeof( uint );
+		Copy( b, data, (uint*)( data + nodeBytes ) );
+		clEnqueueWriteBuffer( queue, nodeBuffer->deviceBuffer, CL_FALSE, b.poolNode * nodeSize_, nodeBytes, data, 0, 0, 0 );
+		if ( idxBytes > 0 ) clEnqueueWriteBuffer( queue, idxBuffer->deviceBuffer, CL_FALSE, b.poolIdx * sizeof( uint ), idxBytes, data + nodeBytes, 0, 0, 0 );
+		data += nodeBytes + idxBytes;
+		loaded++;
+	}
+	lru_.WriteEntries( _slot, rootBuffer );
+}
+void BlasPool::Readback( int _slot )
+{
+	if ( !allResident_ ) lru_.Readback( _slot );
+}
+int BlasPool::Find( uint _root ) const
+{
+	auto it = std::lower_bound( blas_.begin( ), blas_.end( ), _root, []( const Blas& blas, uint root ) { return blas.firstNode < root; } );
+	return it != blas_.end( ) && it->firstNode == _root ? (int)( it - blas_.begin( ) ) : -1;
+}
+size_t BlasPool::ReloadBytes( uint _root ) const
+{
+	int blas = Find( _root );
+	return blas >= 0 && roots_[blas] >= 0 ? blas_[blas].nodes * nodeSize_ : 0;
+}
+void BlasPool::Reload( uint _root, uchar* _staging )
+{
+	int blas = Find( _root );
+	if ( blas < 0 || roots_[blas] < 0 ) return;
+	// a refit leaves the indices as they were
+	const Blas& b = blas_[blas];
+	Copy( b, _staging, 0 );
+	clEnqueueWriteBuffer( Kernel::GetQueue( ), nodeBuffer->deviceBuffer, CL_FALSE, b.poolNode * nodeSize_, b.nodes * nodeSize_, _staging, 0, 0, 0 );
+}
\ No newline at end of file
@@ -0,0 +1,60 @@
+#pragma once
+// keeps the nodes and primitive indices of the BLASes the rays reach in fixed pools on the device,
+// so scenes with more acceleration structure than device memory still render. Instances refer to
+// a BLAS by its index in a root table; a BLAS that is not resident is queued in the feedback buffer
+// and the rays that pass it wait in the deferred queue. Every frame the host reads the feedback
+// back, loads the queued BLASes and evicts the least recently used ones
+class BlasPool
+{
+public:
+	// splits the scene BVH into its BLASes and fills the pools with as many as fit
+	void Init( Scene& scene, bool bvh4 );
+	// loads the BLASes requested in the feedback that was read back into this frame slot
+	void Update( int slot );
+	// reads this frame's feedback back into the slot without blocking, then clears it for the next
+	void Readback( int slot );
+	// bytes of the nodes Reload writes for the BLAS with this root, 0 when it is not resident
+	size_t ReloadBytes( uint root ) const;
+	// writes the nodes of a resident BLAS again after a refit, through staging that the caller keeps
+	// until the frame is done
+	void Reload( uint root, uchar* staging );
+	std::vector<BVHInstance> instances; // the scene instances, bvhIdx being their BLAS
+	Buffer* nodeBuffer = 0; // the pools
+	Buffer* idxBuffer = 0;
+	Buffer* rootBuffer = 0;
+	Buffer* feedbackBuffer = 0;
+	int blases = 0, resident = 0, loaded = 0; // loaded by the last Update
+	size_t poolBytes = 0;
+private:
+	// a range of nodes and one of indices in the scene BVH, and where they are in the pools
+	struct Blas
+	{
+		uint firstNode, nodes, firstIdx, idxCount;
+		uint poolNode, poolIdx;
+	};
+	// first fit over the elements of a pool; returned ranges merge with their free neighbours
+	struct Allocator
+	{
+		void Init( uint size );
+		int Alloc( uint size );
+		void Free( uint offset, uint size );
+		std::map<uint, uint> free; // offset, size
+	};
+	int Find( uint root ) const;
+	// evicts to make room when given the frame slot that takes the root table entries; at init, with
+	// -1, the whole table is uploaded instead
+	bool Place( int blas, int slot );
+	void Evict( int blas, int slot );
+	void Copy( const Blas& blas, uchar* nodes, uint* idx ) const;
+	const uchar* nodes_ = 0;
+	const uint* idx_ = 0;
+	size_t nodeSize_ = 0;
+	bool bvh4_ = false;
+	std::vector<Blas> blas_;
+	std::vector<int> roots_; // host copy of the device root table
+	Allocator nodeAlloc_, idxAlloc_;
+	Residency lru_; // of the resident BLASes
+	bool allResident_ = false;
+	// per frame slot: BLAS data on its way up, reused once the frame of the slot has finished
+	std::vector<uchar> staging_[FRAMES_IN_FLIGHT];
+};
@@ -1,7 +1,7 @@
 #include "precomp.h"
 #include <stack>
-BVH2::BVH2( std::vector<Primitive>& _primitives, std::vector<BVHInstance>& _blasNodes )
-	: primitives_( _primitives ), blasNodes( _blasNodes )
+BVH2::BVH2( std::vector<Primitive>& _primitives, std::vector<float4>& _vertices, std::vector<BVHInstance>& _blasNodes )
+	: primitives_( _primitives ), vertices_( _vertices ), blasNodes( _blasNodes )
 {
 }
 #pragma region bvh_statistics
@@ -166,8 +166,9 @@ float BVH2::FindBestObjectSplitPlane( BVHNode2& node, int& axis, float& splitPos
 			switch ( prim.objType ) {
 				case TRIANGLE:
 				{
-					boundsMin = min( boundsMin, prim.objData.triangle.centroid[a] );
-					boundsMax = max( boundsMax, prim.objData.triangle.centroid[a] );
+					float4 centroid = Centroid( prim.objData.triangle );
+					boundsMin = min( boundsMin, centroid[a] );
+					boundsMax = max( boundsMax, centroid[a] );
 				} break;
 				case SPHERE:
 				{
@@ -193,11 +194,11 @@ float BVH2::FindBestObjectSplitPlane( BVHNode2& node, int& axis, float& splitPos
 				case TRIANGLE:
 				{
 					Triangle& tri = prim.objData.triangle;
-					int binIdx = min( BVH_BINS - 1, (int)( ( tri.centroid[a] - boundsMin ) * scale ) );
+					int binIdx = min( BVH_BINS - 1, (int)( ( Centroid( tri )[a] - boundsMin ) * scale ) );
 					bin[binIdx].count++;
-					bin[binIdx].bounds.Grow( tri.v0 );
-					bin[binIdx].bounds.Grow( tri.v1 );
-					bin[binIdx].bounds.Grow( tri.v2 );
+					bin[binIdx].bounds.Grow( vertices_[tri.v0] );
+					bin[binIdx].bounds.Grow( vertices_[tri.v1] );
+					bin[binIdx].bounds.Grow( vertices_[tri.v2] );
 				} break;
 				case SPHERE:
 				{
@@ -265,26 +266,47 @@ std::vector<BVHPrimData> BVH2::CreateBVHPrimData( int _startIdx )
 {
 	std::vector<BVHPrimData> data;
 	for ( uint i = _startIdx; i < primitives_.size( ); i++ ) {
-		aabb box;
-		Primitive p = primitives_[i];
-		switch ( p.objType ) {
-			case TRIANGLE:
-				box.Grow( p.objData.triangle.v0 );
-				box.Grow( p.objData.triangle.v1 );
-				box.Grow( p.objData.triangle.v2 );
-				break;
-			case SPHERE:
-				box.Grow( p.objData.sphere.pos + p.objData.sphere.r );
-				box.Grow( p.objData.sphere.pos - p.objData.sphere.r );
-				break;
-		}
 		BVHPrimData prim;
-		prim.box = box;
+		prim.box = PrimBounds( i );
 		prim.idx = i;
 		data.push_back( prim );
 	}
 	return data;
 }
+aabb BVH2::PrimBounds( uint _primIdx ) const
+{
+	aabb box;
+	const Primitive& p = primitives_[_primIdx];
+	switch ( p.objType ) {
+		case TRIANGLE:
+			box.Grow( vertices_[p.objData.triangle.v0] );
+			box.Grow( vertices_[p.objData.triangle.v1] );
+			box.Grow( vertices_[p.objData.triangle.v2] );
+			break;
+		case SPHERE:
+			box.Grow( p.objData.sphere.pos + p.objData.sphere.r );
+			box.Grow( p.objData.sphere.pos - p.objData.sphere.r );
+			break;
+	}
+	return box;
+}
+void BVH2::Refit( uint _root, uint _end )
+{
+	// children come after their parent, walking the range backwards finishes them first
+	for ( uint i = _end; i-- > _root; ) {
+		BVHNode2& node = bvhNodes[i];
+		if ( node.count > 0 ) {
+			aabb box;
+			for ( uint j = 0; j < node.count; j++ ) box.Grow( PrimBounds( primIdx[node.first + j] ) );
+			node.aabbMin = box.bmin4f;
+			node.aabbMax = box.bmax4f;
+		} else {
+			const BVHNode2& left = bvhNodes[node.first], & right = bvhNodes[node.first + 1];
+			node.aabbMin = fminf( left.aabbMin, right.aabbMin );
+			node.aabbMax = fmaxf( left.aabbMax, right.aabbMax );
+		}
+	}
+}
 float3 BVH2::LineAAPlaneIntersection( float3 v1, float3 v2, int axis, float plane )
 {
 	assert( v1[axis] != v2[axis] );
@@ -509,7 +531,7 @@ float BVH2::FindBestSpatialSplitPlane( BVHNode2& node, int& axis, float& splitPo
 					switch ( prim.objType ) {
 						case TRIANGLE:
 							Triangle t = prim.objData.triangle;
-							intersection = ClipTriangleToAABB( binBounds, t.v0, t.v1, t.v2, outBounds );
+							intersection = ClipTriangleToAABB( binBounds, vertices_[t.v0], vertices_[t.v1], vertices_[t.v2], outBounds );
 							break;
 						case SPHERE:
 							Sphere s = prim.objData.sphere;
@@ -583,8 +605,8 @@ std::pair<std::vector<BVHPrimData>, std::vector<BVHPrimData>> BVH2::SpatialSplit
 			switch ( prim.objType ) {
 				case TRIANGLE:
 					Triangle t = prim.objData.triangle;
-					leftsuccess = ClipTriangleToAABB( leftClip, t.v0, t.v1, t.v2, leftClipped );
-					rightsuccess = ClipTriangleToAABB( rightClip, t.v0, t.v1, t.v2, rightClipped );
+					leftsuccess = ClipTriangleToAABB( leftClip, vertices_[t.v0], vertices_[t.v1], vertices_[t.v2], leftClipped );
+					rightsuccess = ClipTriangleToAABB( rightClip, vertices_[t.v0], vertices_[t.v1], vertices_[t.v2], rightClipped );
 					break;
 				case SPHERE:
 					Sphere s = prim.objData.sphere;
@@ -674,6 +696,28 @@ BVH4::BVH4( BVH2& _bvh2 ) : bvh2( _bvh2 )
 #endif
 	Convert( 0 );
 }
+BVH4::BVH4( BVH2& _bvh2, const std::vector<BVHNode4>& _nodes ) : bvh2( _bvh2 ), bvhNodes( _nodes )
+{
+}
+void BVH4::Refit( uint _root, uint _end )
+{
+	// an interior child has the bounds of the BVH2 node it came from, a leaf those of its primitives
+	for ( uint i = _root; i < _end; i++ ) {
+		BVHNode4& node = bvhNodes[i];
+		for ( int c = 0; c < 4; c++ ) {
+			if ( node.first[c] == INVALID ) continue;
+			if ( node.count[c] > 0 ) {
+				aabb box;
+				for ( int j = 0; j < node.count[c]; j++ ) box.Grow( bvh2.PrimBounds( bvh2.primIdx[node.first[c] + j] ) );
+				node.aabbMin[c] = box.bmin4f;
+				node.aabbMax[c] = box.bmax4f;
+			} else {
+				node.aabbMin[c] = bvh2.bvhNodes[node.first[c]].aabbMin;
+				node.aabbMax[c] = bvh2.bvhNodes[node.first[c]].aabbMax;
+			}
+		}
+	}
+}
 uint BVH4::Depth( BVHNode4 node )
 {
 	uint maxDepth = 0;
@@ -723,9 +767,11 @@ void BVH4::Convert( uint _root )
 			bvhNodes[i].count[j] = INVALID;
 		}
 	}
-	// handle special case where the root is a leaf
+	// handle special case where the root is a leaf; instances share roots, visit each once
+	std::set<uint> roots;
 	for ( size_t i = 0; i < bvh2.blasNodes.size( ); i++ ) {
 		uint root = bvh2.blasNodes[i].bvhIdx;
+		if ( !roots.insert( root ).second ) continue;
 		if ( bvh2.bvhNodes[root].count > 0 ) {
 			bvhNodes[root].aabbMin[0] = bvh2.bvhNodes[root].aabbMin;
 			bvhNodes[root].aabbMax[0] = bvh2.bvhNodes[root].aabbMax;
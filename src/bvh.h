@@ -1,13 +1,17 @@
 #pragma once
 #include "common.h"
+namespace Tmpl8 { class SceneCache; }
 struct BVHPrimData { aabb box; uint idx = 0; };
 class BVH2
 {
 	friend class BVH4;
 	friend class TLAS;
+	friend class Tmpl8::SceneCache;
 public:
-	BVH2( std::vector<Primitive>&, std::vector<BVHInstance>& );
+	BVH2( std::vector<Primitive>&, std::vector<float4>& vertices, std::vector<BVHInstance>& );
 	void BuildBLAS( bool statistics, int startIdx);
+	// new bounds for the nodes [root, end) of a BLAS whose primitives moved; the topology stays
+	void Refit( uint root, uint end );
 	uint Depth( uint nodeIdx = -1 );
 	uint Count( uint nodeIdx = -1 );
 	float TotalCost( uint nodeIdx = -1 );
@@ -25,6 +29,7 @@ private:
 	void BuildBVH( uint root, std::vector<BVHPrimData> data );
 	void UpdateNodeBounds( uint nodeIdx, std::vector<BVHPrimData> prims );
 	std::vector<BVHPrimData> CreateBVHPrimData( int startIdx );
+	aabb PrimBounds( uint primIdx ) const;
 	float CalculateNodeCost( BVHNode2& node, uint count );
 	float FindBestObjectSplitPlane( BVHNode2& node, int& axis, float& splitPos, float& overlap, std::vector<BVHPrimData> prims );
 	std::pair<std::vector<BVHPrimData>, std::vector<BVHPrimData>> ObjectSplit( BVHNode2& node, int axis, float splitPos, std::vector<BVHPrimData> prims );
@@ -34,7 +39,9 @@ private:
 	bool ClipSphereToAABB( aabb bounds, float3 pos, float r, aabb& outBounds );
 	float3 LineAAPlaneIntersection( float3 v1, float3 v2, int axis, float plane );
 	std::vector<float3> SphereAAPlaneIntersection( float3 pos, float d, int axis, float plane );
+	float4 Centroid( const Triangle& t ) { return ( vertices_[t.v0] + vertices_[t.v1] + vertices_[t.v2] ) * ( 1 / 3.f ); }
 	std::vector<Primitive>& primitives_;
+	std::vector<float4>& vertices_; // indexed by the triangles
 	uint subdivisions_ = 0;
 	uint rootNodeIdx_ = 0, nodesUsed_ = 0;
 };
@@ -42,8 +49,11 @@ class BVH4
 {
 public:
 	BVH4( BVH2& );
+	BVH4( BVH2&, const std::vector<BVHNode4>& nodes ); // already converted, from the scene cache
 	std::vector<BVHNode4>& Nodes( ) { return bvhNodes; }
 	std::vector<uint>& Idx( ) { return bvh2.primIdx; }
+	// after BVH2::Refit over the same nodes
+	void Refit( uint root, uint end );
 	uint Depth( BVHNode4 );
 	uint Count( BVHNode4 );
 	//BVHNode4 Root( ) { return bvhNodes[rootNodeIdx_]; }
@@ -0,0 +1,61 @@
+#include "src/constants.h"
+#include "src/common.h"
+#include "src/cl/util.cl"
+#include "src/cl/primitives.cl"
+#include "src/cl/ray.cl"
+
+// Möller-Trumbore, the routine intersectTriangle replaced; kept as a reference
+void intersectTriangleMT( int primIdx, Triangle tri, Ray* ray )
+{
+	float4 v0 = vertices[tri.v0];
+	float4 v0v1 = vertices[tri.v1] - v0;
+	float4 v0v2 = vertices[tri.v2] - v0;
+	float4 pvec = cross( ray->D, v0v2 );
+	float det = dot( v0v1, pvec );
+	if ( fabs( det ) < 1e-8f ) return;
+	float invDet = 1 / det;
+	float4 tvec = ray->O - v0;
+	float u = dot( tvec, pvec ) * invDet;
+	if ( u < 0 || u > 1 ) return;
+	float4 qvec = cross( tvec, v0v1 );
+	float v = dot( ray->D, qvec ) * invDet;
+	if ( v < 0 || u + v > 1 ) return;
+	float t = dot( v0v2, qvec ) * invDet;
+	if ( t > ray->t || t < 0 ) return;
+	ray->t = t, ray->primIdx = primIdx, ray->u = u, ray->v = v;
+}
+
+// every thread aims a ray at a random triangle and tests it against all triangles in triIdxs;
+// mode 0 uses the Möller-Trumbore reference, mode 1 the watertight test on the shared vertices,
+// mode 2 the precomputed transform with the watertight test near the edges, as the renderer does
+__kernel void triangles(
+	__global Primitive* _primitives,
+	__global float4* _vertices,
+	__global uint* triIdxs,
+	int count,
+	int mode,
+	__global uint* seeds,
+	__global int* hits,
+	__global TriAccel* _triAccels
+)
+{
+	int idx = get_global_id( 0 );
+	primitives = _primitives;
+	vertices = _vertices;
+	triAccels = _triAccels;
+	uint* seed = seeds + idx;
+	Primitive* target = primitives + triIdxs[randomUInt( seed ) % count];
+	Triangle* t = &target->objData.triangle;
+	float4 centroid = ( vertices[t->v0] + vertices[t->v1] + vertices[t->v2] ) * ( 1 / 3.f );
+	float4 O = centroid + getNormal( target, centroid ) + randomFloat3( seed );
+	Ray ray = initRay( O, normalize( centroid - O ) );
+	if ( mode == 0 )
+		for ( int i = 0; i < count; i++ ) intersectTriangleMT( triIdxs[i], primitives[triIdxs[i]].objData.triangle, &ray );
+	else {
+		RayShear shear = initShear( ray.D );
+		for ( int i = 0; i < count; i++ )
+			if ( mode == 1 ) intersectWatertight( triIdxs[i], &primitives[triIdxs[i]].objData.triangle, &ray, &shear );
+			else intersectTriangle( triIdxs[i], &primitives[triIdxs[i]].objData.triangle, &ray, &shear );
+	}
+	hits[idx] = ray.primIdx;
+}
@@ -10,20 +10,20 @@ float intersectAABB( Ray* ray, const float4 bmin, const float4 bmax )
 	tmin = max( tmin, min( tz1, tz2 ) ), tmax = min( tmax, max( tz1, tz2 ) );
 	if ( tmax >= tmin && tmin < ray->t && tmax > 0 ) return tmin; else return REALLYFAR;
 }
-int intersectBVH2( Ray* ray, BVHNode2* bvhNode, uint* primIdxs, uint bvhIdx, bool occlusion )
+int intersectBVH2( Ray* ray, BVHNode2* bvhNode, uint* primIdxs, uint bvhIdx )
 {
 	BVHNode2* stack[32];
 	BVHNode2* node = bvhNode + bvhIdx;
 	uint stackPtr = 0;
 	int steps = 0;
 	float t_light = ray->t;
+	RayShear shear = initShear( ray->D );
 	while ( 1 ) {
 		if ( node->count > 0 ) // isLeaf?
 		{
 			for ( uint i = 0; i < node->count; i++ ) {
 				int index = primIdxs[node->first + i];
-				intersect( index, &primitives[index], ray );
-				if(occlusion) if ( ray->t < t_light ) return -1;
+				intersect( index, &primitives[index], ray, &shear );
 			}
 			if ( stackPtr == 0 ) break;
 			else node = stack[--stackPtr];
@@ -52,13 +52,14 @@ int intersectBVH2( Ray* ray, BVHNode2* bvhNode, uint* primIdxs, uint bvhIdx, boo
 	}
 	return steps;
 }
-uint intersectBVH4( Ray* ray, BVHNode4* bvhNode, uint* primIdxs, uint bvhIdx, bool occlusion )
+uint intersectBVH4( Ray* ray, BVHNode4* bvhNode, uint* primIdxs, uint bvhIdx )
 {
 	BVHNode4* stack[64];
 	BVHNode4* node = bvhNode + bvhIdx;
 	uint stackPtr = 0;
 	uint steps = 0;
 	float light_t = ray->t;
+	RayShear shear = initShear( ray->D );
 	while ( 1 ) {
 		steps++;
 		float dist[4];
@@ -82,8 +83,7 @@ uint intersectBVH4( Ray* ray, BVHNode4* bvhNode, uint* primIdxs, uint bvhIdx, bo
 			if ( node->count[index] > 0 ) {
 				for ( uint j = 0; j < node->count[index]; j++ ) {
 					int primIdx = primIdxs[node->first[index] + j];
-					intersect( primIdx, primitives + primIdx, ray );
-					if(occlusion) if ( ray->t < light_t ) return -1;
+					intersect( primIdx, primitives + primIdx, ray, &shear );
 				}
 			} else {
 				stack[stackPtr++] = bvhNode + node->first[index];
@@ -94,4 +94,64 @@ uint intersectBVH4( Ray* ray, BVHNode4* bvhNode, uint* primIdxs, uint bvhIdx, bo
 	}
 	return steps;
 }
+bool hitAABB( OcclusionRay* ray, const float4 bmin, const float4 bmax )
+{
+	float4 t1 = ( bmin - ray->O ) * ray->rD, t2 = ( bmax - ray->O ) * ray->rD;
+	float4 tmin4 = fmin( t1, t2 ), tmax4 = fmax( t1, t2 );
+	float tmin = max( tmin4.x, max( tmin4.y, tmin4.z ) );
+	float tmax = min( tmax4.x, min( tmax4.y, tmax4.z ) );
+	return tmax >= tmin && tmin < ray->t && tmax > 0;
+}
+// any-hit traversal: children are visited in storage order and the first hit ends the query
+bool isOccludedBVH2( OcclusionRay* ray, BVHNode2* bvhNode, uint* primIdxs, uint bvhIdx )
+{
+	BVHNode2* stack[32];
+	BVHNode2* node = bvhNode + bvhIdx;
+	uint stackPtr = 0;
+	RayShear shear = initShear( ray->D );
+	while ( 1 ) {
+		if ( node->count > 0 ) {
+			for ( uint i = 0; i < node->count; i++ ) {
+				uint primIdx = primIdxs[node->first + i];
+				if ( occludes( primIdx, primitives + primIdx, ray, &shear ) ) return true;
+			}
+			if ( stackPtr == 0 ) return false;
+			node = stack[--stackPtr];
+			continue;
+		}
+		BVHNode2* child1 = bvhNode + node->first;
+		BVHNode2* child2 = child1 + 1;
+		bool hit1 = hitAABB( ray, child1->aabbMin, child1->aabbMax );
+		bool hit2 = hitAABB( ray, child2->aabbMin, child2->aabbMax );
+		if ( hit1 ) {
+			node = child1;
+			if ( hit2 ) stack[stackPtr++] = child2;
+		} else if ( hit2 ) node = child2;
+		else {
+			if ( stackPtr == 0 ) return false;
+			node = stack[--stackPtr];
+		}
+	}
+}
+bool isOccludedBVH4( OcclusionRay* ray, BVHNode4* bvhNode, uint* primIdxs, uint bvhIdx )
+{
+	BVHNode4* stack[64];
+	BVHNode4* node = bvhNode + bvhIdx;
+	uint stackPtr = 0;
+	RayShear shear = initShear( ray->D );
+	while ( 1 ) {
+		for ( int i = 0; i < 4; i++ ) {
+			if ( node->first[i] == INVALID ) continue;
+			if ( !hitAABB( ray, node->aabbMin[i], node->aabbMax[i] ) ) continue;
+			if ( node->count[i] > 0 ) {
+				for ( uint j = 0; j < node->count[i]; j++ ) {
+					uint primIdx = primIdxs[node->first[i] + j];
+					if ( occludes( primIdx, primitives + primIdx, ray, &shear ) ) return true;
+				}
+			} else stack[stackPtr++] = bvhNode + node->first[i];
+		}
+		if ( stackPtr == 0 ) return false;
+		node = stack[--stackPtr];
+	}
+}
 #endif // __BVH_CL
\ No newline at end of file
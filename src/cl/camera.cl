@@ -11,24 +11,30 @@ Ray initPrimaryRay(int x, int y, Camera cam, Settings* settings, uint* seed)
 		float v = (float)y * (1.0f / SCRHEIGHT);
 
 		if (settings->antiAliasing) {
-			u += randomFloat(seed) / (float)SCRWIDTH;
-			v += randomFloat(seed) / (float)SCRHEIGHT;
+			float2 jitter = sample2D( x + y * SCRWIDTH, sampleIndex( settings, x + y * SCRWIDTH ), DIM_PIXEL, seed );
+			u += jitter.x / (float)SCRWIDTH;
+			v += jitter.y / (float)SCRHEIGHT;
 		}
 
 		float4 P = cam.topLeft + u * cam.horizontal + v * cam.vertical;
 		float4 dir = normalize(P - cam.origin);
 		float4 focalPoint = cam.origin + dir * cam.focalLength;
-		float4 O = cam.origin + (randomFloat3(seed) - 0.5f) * cam.aperture;
+		float2 lens = sample2D( x + y * SCRWIDTH, sampleIndex( settings, x + y * SCRWIDTH ), DIM_LENS, seed ) - 0.5f;
+		float4 O = cam.origin + (lens.x * cam.right + lens.y * cam.up) * cam.aperture;
 		dir = normalize(focalPoint - O);
-		return initRay(O, dir);
+		Ray ray = initRay(O, dir);
+		// the angle one pixel covers
+		ray.coneSpread = length(cam.vertical) / (SCRHEIGHT * length(P - cam.origin));
+		return ray;
 	}break;
 	case FISHEYE: { // Kevin Suffern's book: "Ray Tracing from the Ground Up" p.188
 		float u = (float)(x - SCRWIDTH * .5f) * (2.f / SCRWIDTH);
 		float v = (float)(y - SCRHEIGHT * .5f) * (2.f / SCRHEIGHT);
 
 		if (settings->antiAliasing) {
-			u += randomFloat(seed) / (float)SCRWIDTH;
-			v += randomFloat(seed) / (float)SCRHEIGHT;
+			float2 jitter = sample2D( x + y * SCRWIDTH, sampleIndex( settings, x + y * SCRWIDTH ), DIM_PIXEL, seed );
+			u += jitter.x / (float)SCRWIDTH;
+			v += jitter.y / (float)SCRHEIGHT;
 		}
 
 		float r2 = u * u + v * v;
@@ -40,7 +46,9 @@ Ray initPrimaryRay(int x, int y, Camera cam, Settings* settings, uint* seed)
 		float sinAlpha = u / r;
 		float cosAlpha = v / r;
 		float4 D = sinPsi * cosAlpha * cam.up + sinPsi * sinAlpha * cam.right - cosPsi * cam.forward;
-		return initRay(cam.origin, D);
+		Ray ray = initRay(cam.origin, D);
+		ray.coneSpread = cam.fov * DEG_TO_RAD * 2 / SCRHEIGHT;
+		return ray;
 	}break;
 	}
 }
@@ -54,4 +62,21 @@ Ray initPrimaryRaySimple( int x, int y, Camera cam )
 	return initRay( cam.origin, dir );
 }
 
+// pixel of a projection camera that sees world position P; false when it is off screen
+bool projectToCamera( Camera cam, float4 P, int* pixel )
+{
+	float4 D = P - cam.origin;
+	float4 N = cross( cam.horizontal, cam.vertical );
+	float DN = dot( D, N );
+	if (DN == 0) return false;
+	float s = dot( cam.topLeft - cam.origin, N ) / DN;
+	if (s <= 0) return false;
+	float4 X = cam.origin + D * s - cam.topLeft;
+	float u = dot( X, cam.horizontal ) / dot( cam.horizontal, cam.horizontal );
+	float v = dot( X, cam.vertical ) / dot( cam.vertical, cam.vertical );
+	if (u < 0 || v < 0 || u >= 1 || v >= 1) return false;
+	*pixel = (int)(u * SCRWIDTH) + (int)(v * SCRHEIGHT) * SCRWIDTH;
+	return true;
+}
+
 #endif // __CAMERA_CL
\ No newline at end of file
@@ -4,74 +4,191 @@
 #include "src/constants.h"
 #include "src/common.h"
 
-__kernel void display(__global float3* source,
-	write_only image2d_t target)
+// sample count of the accumulation buffers; every pixel keeps its own, as adaptive sampling and temporal
+// reprojection give pixels different counts, and samples that wait for a BLAS can be dropped
+float sampleCount( __global Settings* settings, __global float4* moments, int idx )
 {
-	int idx = get_global_id( 0 );
-	int x = idx % SCRWIDTH;
-	int y = idx / SCRWIDTH;
+	return settings->renderBVH ? (float)(settings->frames) : max( moments[idx].z, 1.f );
+}
 
-	float4 color = (float4)(source[idx], 1);
-	write_imagef(target, (int2)(x, y), color);
+// post processing fused into a single pass from the accumulator to the screen; the host compiles
+// a variant for every combination of VIGNETTING, GAMMA and CHROMATIC, and DENOISED when the
+// source is the output of the denoiser rather than the accumulator
+float3 fetch( __global float4* source, __global Settings* settings, __global float4* moments, int idx )
+{
+#ifdef DENOISED
+	// remodulate already normalized and clamped it
+	return source[idx].xyz;
+#else
+	return min( source[idx].xyz * (1 / sampleCount( settings, moments, idx )), (float3)(1) );
+#endif
 }
 
-__kernel void vignetting( __global float3* source,
-	__global float3* dest,
-	float strength)
+float3 postColor( __global float4* source, __global Settings* settings, __global float4* moments, int idx,
+	float vignetStrength, float gamma )
 {
-	int idx = get_global_id( 0 );
+	float3 color = fetch( source, settings, moments, idx );
+#ifdef VIGNETTING
 	int x = idx % SCRWIDTH;
 	int y = idx / SCRWIDTH;
-
-	float3 color = source[idx]; //read_imagef(source, (x,y)).xyz;
 	float2 pos = (float2)(x / (float)SCRWIDTH - 0.5, y / (float)SCRHEIGHT - 0.5);
 	float vignette = 1 - smoothstep( 0, 1, length( pos ) );
-	color = mix( color, color * vignette, strength );
+	color = mix( color, color * vignette, vignetStrength );
+#endif
+#ifdef GAMMA
+	color = pow( color, gamma );
+#endif
+	return color;
+}
+
+__kernel void post( __global float4* source,
+	__global Settings* settings,
+	__global float4* moments,
+	write_only image2d_t target,
+	float vignetStrength,
+	float gamma,
+	float chromaticOffset )
+{
+	int idx = get_global_id( 0 );
+	int x = idx % SCRWIDTH;
+	int y = idx / SCRWIDTH;
 
-	dest[idx] = color; //write_imagef(dest, (x,y), (float4)(color, 1));
+	float3 color = postColor( source, settings, moments, idx, vignetStrength, gamma );
+#ifdef CHROMATIC
+	// green and blue lean towards the left neighbour, which is processed from the source as well;
+	// skip the first column
+	if (x > 0)
+	{
+		float3 prev = postColor( source, settings, moments, idx - 1, vignetStrength, gamma );
+		color.y = color.y * (1 - chromaticOffset) + prev.y * chromaticOffset;
+		color.z = color.z * (1 - 2 * chromaticOffset) + prev.z * 2 * chromaticOffset;
 	}
+#endif
+	write_imagef( target, (int2)(x, y), (float4)(color, 1) );
+}
 
-__kernel void gammaCorr( __global float3* source,
-	__global float3* dest,
-	float gamma)
+// denoiser: edge-avoiding a-trous wavelet filter after Dammertz et al. (HPG 2010), applied to
+// the illumination (colour divided by the first hit albedo) so texture detail is not blurred
+__kernel void demodulate( __global float4* pixels, __global float4* albedo, __global float4* dest,
+	__global Settings* settings, __global float4* moments )
 {
 	int idx = get_global_id( 0 );
-	dest[idx] = pow(source[idx], gamma);
+	float invSamples = 1 / sampleCount( settings, moments, idx );
+	dest[idx] = pixels[idx] * invSamples / max( albedo[idx] * invSamples, (float4)(1e-3f) );
 }
 
-__kernel void chromatic( __global float3* source,
-	__global float3* dest,
-	float offset )
+float lum( float4 c ) { return dot( c.xyz, (float3)(0.2126f, 0.7152f, 0.0722f) ); }
+
+// one iteration of the 5x5 B3 spline kernel, its taps spread step pixels apart; neighbours
+// only contribute when their luminance, normal and depth are close to those of the centre
+__kernel void atrous( __global float4* source, __global float4* dest, __global float4* normalDepth,
+	__global Settings* settings, __global float4* moments,
+	int step, float sigmaColor, float sigmaNormal, float sigmaDepth )
 {
+	const float h[3] = { 3 / 8.f, 1 / 4.f, 1 / 16.f };
 	int idx = get_global_id( 0 );
-	
-	// skip the first column
-	if (idx % SCRWIDTH == 0) 
+	int x = idx % SCRWIDTH;
+	int y = idx / SCRWIDTH;
+	float4 c = source[idx];
+	float4 nd = normalDepth[idx] / sampleCount( settings, moments, idx );
+	float4 sum = (float4)(0);
+	float weights = 0;
+	for (int dy = -2; dy <= 2; dy++) for (int dx = -2; dx <= 2; dx++)
 	{
-		dest[idx] = source[idx];
-		return; 
+		int qx = x + dx * step, qy = y + dy * step;
+		if (qx < 0 || qy < 0 || qx >= SCRWIDTH || qy >= SCRHEIGHT) continue;
+		int q = qx + qy * SCRWIDTH;
+		float4 cq = source[q];
+		float4 ndq = normalDepth[q] / sampleCount( settings, moments, q );
+		float wColor = exp( -fabs( lum( c ) - lum( cq ) ) / sigmaColor );
+		float wNormal = pow( max( 0.f, dot( nd.xyz, ndq.xyz ) ), sigmaNormal );
+		float wDepth = exp( -fabs( nd.w - ndq.w ) / (sigmaDepth * nd.w * step * length( (float2)(dx, dy) ) + 1e-4f) );
+		float w = h[abs( dx )] * h[abs( dy )] * wColor * wNormal * wDepth;
+		sum += cq * w;
+		weights += w;
 	}
+	// misses have no normal and are left alone
+	dest[idx] = weights > 0 ? sum / weights : c;
+}
+
+__kernel void remodulate( __global float4* source, __global float4* albedo, __global float4* dest,
+	__global Settings* settings, __global float4* moments )
+{
+	int idx = get_global_id( 0 );
+	float4 color = source[idx] * max( albedo[idx] / sampleCount( settings, moments, idx ), (float4)(1e-3f) );
+	dest[idx] = min( color, (float4)(1) );
+}
 
-	float3 cur = source[idx];
-	float3 prev = source[idx - 1];
-	// linear interpolation based on index
-	float r = cur.x;
-	float g = cur.y * (1 - offset) + prev.y * offset;
-	float b = cur.z * (1 - 2 * offset) + prev.z * 2 * offset;
+// frame statistics, reduced on the device so only a FrameStats crosses the bus; every work group
+// of STATS_GROUP pixels writes a partial (energy, luminance, min, max) that statsFinal combines
+float4 combineStats( float4 a, float4 b ) { return (float4)(a.x + b.x, a.y + b.y, min( a.z, b.z ), max( a.w, b.w )); }
 
-	dest[idx] = (float3)(r, g, b);
+// 0: finite, 1: inf, 2: nan; on the bits, -cl-fast-relaxed-math lets isnan and isinf fold to false
+int classify( float4 c )
+{
+	uint3 bits = as_uint3( c.xyz );
+	int3 special = (bits & 0x7f800000) == 0x7f800000;
+	int3 nan = special && (bits & 0x007fffff) != 0;
+	return any( nan ) ? 2 : any( special ) ? 1 : 0;
 }
 
-__kernel void prep(__global float3* pixels, __global float3* swap, __global Settings* settings)
+__kernel void stats( __global float4* accum, __global Settings* settings, __global float4* moments,
+	__global float4* partials, __global FrameStats* stats )
 {
-	int idx = get_global_id(0);
-	int x = idx % SCRWIDTH;
-	int y = idx / SCRWIDTH;
+	__local float4 reduction[STATS_GROUP];
+	__local int histogram[STATS_BINS];
+	int idx = get_global_id( 0 ), lid = get_local_id( 0 );
+	if (lid < STATS_BINS) histogram[lid] = 0;
+	work_group_barrier( CLK_LOCAL_MEM_FENCE );
+	float4 c = accum[idx] * (1 / sampleCount( settings, moments, idx ));
+	float4 r = (float4)(0, 0, REALLYFAR, -REALLYFAR);
+	int type = classify( c );
+	if (type == 2) atomic_inc( &stats->nanCount );
+	else if (type == 1) atomic_inc( &stats->infCount );
+	else
+	{
+		float l = lum( c );
+		r = (float4)(c.x + c.y + c.z, l, l, l);
+		int bin = (int)((log2( max( l, 1e-10f ) ) - STATS_MIN_LOG2) * STATS_BINS_PER_STOP);
+		atomic_inc( histogram + clamp( bin, 0, STATS_BINS - 1 ) );
+	}
+	reduction[lid] = r;
+	for (int s = STATS_GROUP / 2; s > 0; s >>= 1)
+	{
+		work_group_barrier( CLK_LOCAL_MEM_FENCE );
+		if (lid < s) reduction[lid] = combineStats( reduction[lid], reduction[lid + s] );
+	}
+	work_group_barrier( CLK_LOCAL_MEM_FENCE );
+	if (lid < STATS_BINS && histogram[lid]) atomic_add( stats->histogram + lid, histogram[lid] );
+	if (lid == 0) partials[get_group_id( 0 )] = reduction[0];
+}
 
-	float3 color = pixels[get_global_id(0)] * (1 / (float)(settings->frames));
-	color = min( color, (float3)(1) );
+// a single work group of STATS_GROUP threads
+__kernel void statsFinal( __global float4* partials, int count, __global FrameStats* stats )
+{
+	__local float4 reduction[STATS_GROUP];
+	int lid = get_local_id( 0 );
+	float4 r = (float4)(0, 0, REALLYFAR, -REALLYFAR);
+	for (int i = lid; i < count; i += STATS_GROUP) r = combineStats( r, partials[i] );
+	reduction[lid] = r;
+	for (int s = STATS_GROUP / 2; s > 0; s >>= 1)
+	{
+		work_group_barrier( CLK_LOCAL_MEM_FENCE );
+		if (lid < s) reduction[lid] = combineStats( reduction[lid], reduction[lid + s] );
+	}
+	if (lid != 0) return;
+	int valid = PIXELS - stats->nanCount - stats->infCount;
+	stats->energy = reduction[0].x;
+	stats->meanLum = valid > 0 ? reduction[0].y / valid : 0;
+	stats->minLum = valid > 0 ? reduction[0].z : 0;
+	stats->maxLum = valid > 0 ? reduction[0].w : 0;
+}
 
-	swap[idx] = color;
+// linear radiance estimate for the float export formats
+__kernel void linear( __global float4* accum, __global Settings* settings, __global float4* moments, __global float4* dest )
+{
+	int idx = get_global_id( 0 );
+	dest[idx] = accum[idx] * (1 / sampleCount( settings, moments, idx ));
 }
 
 __kernel void saveImage(read_only image2d_t src, __global float4* dst)
@@ -5,8 +5,14 @@
 
 __global Primitive* primitives;
 __global Material* materials;
-__global uint* lights;
-__global float4* textures;
+__global LightAlias* lights;
+__global uint* textures; // the pool of resident pages, VT_TILE * VT_TILE words each; one word per texel, see the TEX_ formats
+__global int* pageTable; // per virtual page: its tile in the pool, or VT_ABSENT / VT_REQUESTED
+__global uint* vtFeedback; // pages to load and pool tiles used, read back by the host every frame
+__global float4* vertices; // shared by the triangles, which index them
+__global TriAccel* triAccels; // per primitive, see TriAccel
+__global float2* texcoords; // one per vertex
+__global float* skyCdf;
 
 void intersectSphere( int primIdx, Sphere sphere, Ray* ray )
 {
@@ -42,40 +48,115 @@ void intersectPlane( int primIdx, Plane plane, Ray* ray )
 	ray->v = dot( I, vAxis );
 }
 
-// https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection
-float kEpsilon = 1e-8;
-void intersectTriangle( int primIdx, Triangle tri, Ray* ray )
+// per-ray constants of the watertight test (Woop, Benthin and Wald 2013): the dominant
+// axis of the direction becomes z, and the shear maps the direction onto (0, 0, 1)
+typedef struct RayShear
 {
-	float4 v0v1 = tri.v1 - tri.v0;
-	float4 v0v2 = tri.v2 - tri.v0;
-	float4 pvec = cross( ray->D, v0v2 );
-	float det = dot( v0v1, pvec );
-	// ray and triangle are parallel if det is close to 0
+	uint4 axes; // kx, ky, kz
+	float Sx, Sy, Sz;
+} RayShear;
+
+RayShear initShear( float4 D )
+{
+	RayShear s;
+	float4 a = fabs( D );
+	uint kz = a.x > a.y ? ( a.x > a.z ? 0 : 2 ) : ( a.y > a.z ? 1 : 2 );
+	uint kx = kz == 2 ? 0 : kz + 1, ky = kx == 2 ? 0 : kx + 1;
+	float4 P = shuffle( D, ( uint4 )( kx, ky, kz, 3 ) );
+	// swap kx and ky to preserve the winding of the triangle
+	if ( P.z < 0 ) s.axes = ( uint4 )( ky, kx, kz, 3 ), P = P.yxzw;
+	else s.axes = ( uint4 )( kx, ky, kz, 3 );
+	s.Sx = P.x / P.z;
+	s.Sy = P.y / P.z;
+	s.Sz = 1 / P.z;
+	return s;
+}
+
+// edge functions U, V, W and the scaled hit distance T of a triangle in ray space;
+// returns false when the ray misses or the triangle is seen edge-on
+bool shearTriangle( Triangle* tri, float4 O, RayShear* s, float* U, float* V, float* W, float* det, float* T )
+{
+	float4 A = shuffle( vertices[tri->v0] - O, s->axes );
+	float4 B = shuffle( vertices[tri->v1] - O, s->axes );
+	float4 C = shuffle( vertices[tri->v2] - O, s->axes );
+	float Ax = A.x - s->Sx * A.z, Ay = A.y - s->Sy * A.z;
+	float Bx = B.x - s->Sx * B.z, By = B.y - s->Sy * B.z;
+	float Cx = C.x - s->Sx * C.z, Cy = C.y - s->Sy * C.z;
+	*U = Cx * By - Cy * Bx;
+	*V = Ax * Cy - Ay * Cx;
+	*W = Bx * Ay - By * Ax;
 #ifdef ONE_SIDED_TRIANGLE
-	if ( det < kEpsilon ) return;
+	if ( *U < 0 || *V < 0 || *W < 0 ) return false;
 #else
-	if ( fabs( det ) < kEpsilon ) return;
+	if ( ( *U < 0 || *V < 0 || *W < 0 ) && ( *U > 0 || *V > 0 || *W > 0 ) ) return false;
 #endif
-	float invDet = 1 / det;
-	float4 tvec = ray->O - tri.v0;
-	float u = dot( tvec, pvec ) * invDet;
-	if ( u < 0 || u > 1 ) return;
-
-	float4 qvec = cross( tvec, v0v1 );
-	float v = dot( ray->D, qvec ) * invDet;
-	if ( v < 0 || u + v > 1 ) return;
+	*det = *U + *V + *W;
+	if ( *det == 0 ) return false;
+	*T = s->Sz * ( *U * A.z + *V * B.z + *W * C.z );
+	return true;
+}
 
-	float t = dot( v0v2, qvec ) * invDet;
-	if ( t > ray->t || t < 0 ) return;
-	ray->t = t;
+// the watertight test itself, on the shared vertices
+void intersectWatertight( int primIdx, Triangle* tri, Ray* ray, RayShear* shear )
+{
+	float U, V, W, det, T;
+	if ( !shearTriangle( tri, ray->O, shear, &U, &V, &W, &det, &T ) ) return;
+	// compare T against 0 and ray->t * det without dividing, flipping the sign with det
+	uint detSign = as_uint( det ) & 0x80000000;
+	float Ts = as_float( as_uint( T ) ^ detSign );
+	if ( Ts < 0 || Ts > ray->t * fabs( det ) ) return;
+	float invDet = 1 / det;
+	ray->t = T * invDet;
 	ray->primIdx = primIdx;
+	// barycenter, u and v weigh v1 and v2
+	ray->u = V * invDet;
+	ray->v = W * invDet;
+}
 
-	// set barycenter
-	ray->u = u;
-	ray->v = v;
+// Woop's test on the precomputed transform: two dot products give the distance, two more the
+// barycentrics, without fetching the vertices. Returns 1 for a hit, 0 for a miss, and -1 when the
+// rounding of the transform could put the hit on either side of an edge; the watertight test on
+// the shared vertices decides those, so neighbouring triangles never both miss
+int woopTriangle( int primIdx, float4 O, float4 D, float tmax, float* t, float* u, float* v )
+{
+	TriAccel* acc = triAccels + primIdx;
+	O.w = 1, D.w = 0;
+	float Dz = dot( acc->m2, D );
+	// parallel, or degenerate with an all zero transform
+	if ( Dz == 0 ) return 0;
+	float Oz = dot( acc->m2, O );
+	*t = -Oz / Dz;
+	if ( *t <= 0 || *t >= tmax ) return 0;
+	float Du = dot( acc->m0, D ), Dv = dot( acc->m1, D );
+	*u = dot( acc->m0, O ) + *t * Du;
+	*v = dot( acc->m1, O ) + *t * Dv;
+	float w = 1 - *u - *v;
+	// the rounding error of a dot product follows the magnitude of its terms, not of its result
+	float4 aO = fabs( O ), aD = fabs( D );
+	float errT = ( dot( fabs( acc->m2 ), aO ) + *t * dot( fabs( acc->m2 ), aD ) ) / fabs( Dz );
+	float errU = dot( fabs( acc->m0 ), aO ) + *t * dot( fabs( acc->m0 ), aD ) + fabs( Du ) * errT;
+	float errV = dot( fabs( acc->m1 ), aO ) + *t * dot( fabs( acc->m1 ), aD ) + fabs( Dv ) * errT;
+	errU *= 8 * FLT_EPSILON, errV *= 8 * FLT_EPSILON;
+	float errW = errU + errV + FLT_EPSILON;
+	if ( *u < -errU || *v < -errV || w < -errW ) return 0;
+	if ( *u < errU || *v < errV || w < errW ) return -1;
+	return 1;
 }
 
-void intersect( int primIdx, Primitive* prim, Ray* ray )
+void intersectTriangle( int primIdx, Triangle* tri, Ray* ray, RayShear* shear )
+{
+#ifdef ONE_SIDED_TRIANGLE
+	// the transform does not tell the sides apart
+	intersectWatertight( primIdx, tri, ray, shear );
+#else
+	float t, u, v;
+	int hit = woopTriangle( primIdx, ray->O, ray->D, ray->t, &t, &u, &v );
+	if ( hit < 0 ) intersectWatertight( primIdx, tri, ray, shear );
+	else if ( hit > 0 ) ray->t = t, ray->primIdx = primIdx, ray->u = u, ray->v = v;
+#endif
+}
+
+void intersect( int primIdx, Primitive* prim, Ray* ray, RayShear* shear )
 {
 	switch ( prim->objType )
 	{
@@ -84,10 +165,63 @@ void intersect( int primIdx, Primitive* prim, Ray* ray )
 		case PLANE:
 			intersectPlane( primIdx, prim->objData.plane, ray ); break;
 		case TRIANGLE:
-			intersectTriangle( primIdx, prim->objData.triangle, ray ); break;
+			intersectTriangle( primIdx, &prim->objData.triangle, ray, shear ); break;
 	}
 }
 
+// any-hit tests for occlusion rays: no barycentrics, no hit record, just whether
+// something lies between the ray origin and ray->t
+bool occludesSphere( Sphere* sphere, OcclusionRay* ray )
+{
+	float4 oc = ray->O - sphere->pos;
+	float b = dot( oc, ray->D );
+	float c = dot( oc, oc ) - sphere->r2;
+	float d = b * b - c;
+	if ( d <= 0 ) return false;
+	d = sqrt( d );
+	float t = -b - d;
+	if ( t > 0 && t < ray->t ) return true;
+	t = d - b;
+	return t > 0 && t < ray->t;
+}
+
+bool occludesPlane( Plane* plane, OcclusionRay* ray )
+{
+	float t = -( dot( ray->O, plane->N ) + plane->d ) / ( dot( ray->D, plane->N ) );
+	return t > 0 && t < ray->t;
+}
+
+bool occludesWatertight( Triangle* tri, OcclusionRay* ray, RayShear* shear )
+{
+	float U, V, W, det, T;
+	if ( !shearTriangle( tri, ray->O, shear, &U, &V, &W, &det, &T ) ) return false;
+	uint detSign = as_uint( det ) & 0x80000000;
+	float Ts = as_float( as_uint( T ) ^ detSign );
+	return Ts > 0 && Ts < ray->t * fabs( det );
+}
+
+bool occludesTriangle( int primIdx, Triangle* tri, OcclusionRay* ray, RayShear* shear )
+{
+#ifdef ONE_SIDED_TRIANGLE
+	return occludesWatertight( tri, ray, shear );
+#else
+	float t, u, v;
+	int hit = woopTriangle( primIdx, ray->O, ray->D, ray->t, &t, &u, &v );
+	return hit < 0 ? occludesWatertight( tri, ray, shear ) : hit > 0;
+#endif
+}
+
+bool occludes( int primIdx, Primitive* prim, OcclusionRay* ray, RayShear* shear )
+{
+	switch ( prim->objType )
+	{
+		case SPHERE: return occludesSphere( &prim->objData.sphere, ray );
+		case PLANE: return occludesPlane( &prim->objData.plane, ray );
+		case TRIANGLE: return occludesTriangle( primIdx, &prim->objData.triangle, ray, shear );
+	}
+	return false;
+}
+
 float4 getNormal( Primitive* prim, float4 I )
 {
 	switch ( prim->objType )
@@ -100,10 +234,169 @@ float4 getNormal( Primitive* prim, float4 I )
 		case PLANE:
 			return prim->objData.plane.N;
 		case TRIANGLE:
-			return prim->objData.triangle.N;
+		{
+			Triangle t = prim->objData.triangle;
+			return normalize( cross( vertices[t.v1] - vertices[t.v0], vertices[t.v2] - vertices[t.v0] ) );
+		}
 	}
 }
 
+// a texel decoded to linear rgb
+float4 decodeTexel( uint t, int format )
+{
+	if ( format == TEX_RGB9E5 ) {
+		int e = (int)( t >> 27 ) - 24;
+		return ( float4 )( ldexp( (float)( t & 511 ), e ), ldexp( (float)( ( t >> 9 ) & 511 ), e ), ldexp( (float)( ( t >> 18 ) & 511 ), e ), 0 );
+	}
+	float4 c = ( float4 )( t & 255, ( t >> 8 ) & 255, ( t >> 16 ) & 255, 0 ) * ( 1 / 255.f );
+	return format == TEX_SRGB8 ? pow( c, ( float4 )( 2.2f ) ) : c;
+}
+
+// the virtual page holding texel x, y of a mip level, and the offset of the texel in that page;
+// large levels are cut into tiles, the small ones follow each other in the tail page
+int texelPage( TexRef tex, int level, int x, int y, int* offset )
+{
+	int page = tex.page, w = tex.w, h = tex.h, tail = 0;
+	for ( int i = 0; i < level; i++ ) {
+		if ( max( w, h ) > VT_TILE / 2 ) page += ( ( w + VT_TILE - 1 ) / VT_TILE ) * ( ( h + VT_TILE - 1 ) / VT_TILE );
+		else tail += w * h;
+		w = max( 1, w >> 1 ), h = max( 1, h >> 1 );
+	}
+	// coordinates halved from a finer level can be one past an odd size
+	x = min( x, w - 1 ), y = min( y, h - 1 );
+	if ( max( w, h ) <= VT_TILE / 2 ) {
+		*offset = tail + x + y * w;
+		return page;
+	}
+	*offset = ( y % VT_TILE ) * VT_TILE + x % VT_TILE;
+	return page + ( y / VT_TILE ) * ( ( w + VT_TILE - 1 ) / VT_TILE ) + x / VT_TILE;
+}
+
+// texel x, y of a mip level, decoded; a page that is not resident is requested from the host
+// and the texel comes from the first coarser level that is, the last page is always resident
+float4 fetchTexel( TexRef tex, int level, int x, int y )
+{
+	for ( ; level < tex.levels; level++, x >>= 1, y >>= 1 ) {
+		int offset, page = texelPage( tex, level, x, y, &offset );
+		int tile = pageTable[page];
+		if ( tile >= 0 ) {
+			vtFeedback[VT_FEEDBACK_USED + tile] = 1;
+			return decodeTexel( textures[tile * VT_TILE * VT_TILE + offset], tex.format );
+		}
+		// the first miss queues the page, later ones see it requested
+		if ( tile == VT_ABSENT && atomic_cmpxchg( (volatile __global int*)( pageTable + page ), VT_ABSENT, VT_REQUESTED ) == VT_ABSENT ) {
+			uint request = atomic_inc( vtFeedback );
+			if ( request < VT_MAX_REQUESTS ) vtFeedback[1 + request] = page;
+			else pageTable[page] = VT_ABSENT; // full for this frame, ask again next time
+		}
+	}
+	return ( float4 )( 0 );
+}
+
+// one mip level of a texture, wrapping uv; nearest texel, or bilinear with TEXTURE_BILINEAR or TEXTURE_TRILINEAR
+float4 sampleLevel( TexRef tex, int level, float2 uv )
+{
+	int w = tex.w, h = tex.h;
+	for ( int i = 0; i < level; i++ ) w = max( 1, w >> 1 ), h = max( 1, h >> 1 );
+	uv -= floor( uv );
+#if defined( TEXTURE_BILINEAR ) || defined( TEXTURE_TRILINEAR )
+	// texel centers sit at half coordinates, the neighbours wrap around the edges
+	float fx = uv.x * w - .5f, fy = uv.y * h - .5f;
+	int x0 = (int)floor( fx ), y0 = (int)floor( fy );
+	float ax = fx - x0, ay = fy - y0;
+	int x1 = x0 + 1 == w ? 0 : x0 + 1, y1 = y0 + 1 == h ? 0 : y0 + 1;
+	if ( x0 < 0 ) x0 = w - 1;
+	if ( y0 < 0 ) y0 = h - 1;
+	float4 top = mix( fetchTexel( tex, level, x0, y0 ), fetchTexel( tex, level, x1, y0 ), ax );
+	float4 bottom = mix( fetchTexel( tex, level, x0, y1 ), fetchTexel( tex, level, x1, y1 ), ax );
+	return mix( top, bottom, ay );
+#else
+	int x = min( (int)( uv.x * w ), w - 1 );
+	int y = min( (int)( uv.y * h ), h - 1 );
+	return fetchTexel( tex, level, x, y );
+#endif
+}
+
+// a texture at the level of detail of a ray footprint (see coneLod), blending two levels with TEXTURE_TRILINEAR
+float4 sampleTexture( TexRef tex, float2 uv, float lod )
+{
+	lod = clamp( lod + 0.5f * log2( (float)tex.w * tex.h ), 0.f, (float)( tex.levels - 1 ) );
+#ifdef TEXTURE_TRILINEAR
+	int level = (int)lod;
+	float4 c = sampleLevel( tex, level, uv );
+	if ( level + 1 < tex.levels ) c = mix( c, sampleLevel( tex, level + 1, uv ), lod - level );
+	return c;
+#else
+	return sampleLevel( tex, (int)( lod + .5f ), uv );
+#endif
+}
+
+// the base color map of a material
+TexRef albedoMap( Material* mat )
+{
+	TexRef tex = { mat->texIdx, mat->texW, mat->texH, mat->texFormat, mat->texLevels, mat->texPage };
+	return tex;
+}
+
+// log2 of the ray cone footprint at a triangle hit, relative to the uv area of the triangle;
+// sampleTexture adds the texture size (Akenine-Moller et al., "Texture Level of Detail
+// Strategies for Real-Time Ray Tracing", Ray Tracing Gems 2019). N is the world space normal,
+// scale converts the object space area of an instanced triangle to world space
+float coneLod( Ray* ray, Primitive* prim, float4 N, float scale )
+{
+	if ( prim->objType != TRIANGLE ) return -REALLYFAR;
+	Triangle* t = &prim->objData.triangle;
+	float4 v0 = vertices[t->v0];
+	float worldArea = length( cross( vertices[t->v1] - v0, vertices[t->v2] - v0 ) ) * scale * scale;
+	float2 uv0 = texcoords[t->v0], d1 = texcoords[t->v1] - uv0, d2 = texcoords[t->v2] - uv0;
+	float uvArea = fabs( d1.x * d2.y - d2.x * d1.y );
+	float width = ray->coneWidth + ray->coneSpread * ray->t;
+	float cosine = fabs( dot( N, ray->D ) );
+	if ( uvArea <= 0 || worldArea <= 0 || width <= 0 || cosine <= 0 ) return -REALLYFAR;
+	return 0.5f * log2( uvArea / worldArea ) + log2( width / cosine );
+}
+
+// texture coordinates of a triangle hit: u and v weigh v1 and v2
+float2 getTriangleUV( Triangle* t, Ray* ray )
+{
+	return ray->u * texcoords[t->v1] + ray->v * texcoords[t->v2] + ( 1 - ray->u - ray->v ) * texcoords[t->v0];
+}
+
+// chance of a mirror bounce; a metallic-roughness map (metal in b, roughness in g) scales the metallic factor
+float getSpecular( Ray* ray, Primitive* prim, Material* mat )
+{
+	if ( mat->metalRough.idx == -1 || prim->objType != TRIANGLE ) return mat->specular;
+	float4 mr = sampleTexture( mat->metalRough, getTriangleUV( &prim->objData.triangle, ray ), ray->lod );
+	return mat->specular * mr.z * ( 1 - mr.y );
+}
+
+// radiance of a surface with an emissive map; lights emit their emittance instead
+float4 getEmission( Ray* ray, Primitive* prim, Material* mat )
+{
+	if ( mat->emissiveMap.idx == -1 || mat->isLight || prim->objType != TRIANGLE ) return ( float4 )( 0 );
+	return mat->emittance * sampleTexture( mat->emissiveMap, getTriangleUV( &prim->objData.triangle, ray ), ray->lod );
+}
+
+// N bent by the tangent space normal map of the material, both in the space of the primitive;
+// the tangent frame follows the texture coordinates, green points up in the image
+float4 getShadingNormal( Ray* ray, Primitive* prim, float4 N )
+{
+	Material mat = materials[prim->matIdx];
+	if ( mat.normalMap.idx == -1 || prim->objType != TRIANGLE ) return N;
+	Triangle* t = &prim->objData.triangle;
+	float4 e1 = vertices[t->v1] - vertices[t->v0], e2 = vertices[t->v2] - vertices[t->v0];
+	float2 d1 = texcoords[t->v1] - texcoords[t->v0], d2 = texcoords[t->v2] - texcoords[t->v0];
+	float det = d1.x * d2.y - d2.x * d1.y;
+	if ( fabs( det ) < 1e-12f ) return N;
+	float4 T = ( e1 * d2.y - e2 * d1.y ) * ( 1 / det );
+	float4 dPdv = ( e2 * d1.x - e1 * d2.x ) * ( 1 / det );
+	T = normalize( T - N * dot( N, T ) );
+	float4 B = cross( N, T );
+	if ( dot( B, dPdv ) > 0 ) B = -B;
+	float4 n = sampleTexture( mat.normalMap, getTriangleUV( t, ray ), ray->lod ) * 2 - 1;
+	return normalize( T * n.x + B * n.y + N * n.z );
+}
+
 float4 getAlbedo( Ray* ray )
 {
 	Primitive prim = primitives[ray->primIdx];
@@ -113,25 +406,16 @@ float4 getAlbedo( Ray* ray )
 		switch ( prim.objType )
 		{
 			case TRIANGLE:
-			{
-				Triangle t = prim.objData.triangle;
-				float2 uv = ray->u * t.uv1 + ray->v * t.uv0 + ( 1 - ray->u - ray->v) * t.uv2;
-				uv = fmod( uv, ( float2 )( 1.f, 1.f ) );
-				if ( uv.x < 0 ) uv.x = 1 + uv.x;
-				if ( uv.y < 0 ) uv.y = 1 + uv.y;
-				int x = (int)( uv.x * mat.texW );
-				int y = (int)( uv.y * mat.texH );
-				//printf( "x: %i, y: %i, max.texIdx: %i, mat.texW: %i, mat.texH: %i, u: %f, v: %f\n", x, y, mat.texIdx, mat.texW, mat.texH, uv.x, uv.y );
-				albedo = textures[mat.texIdx + x + y * mat.texW];
-			}break;
+				albedo = sampleTexture( albedoMap( &mat ), getTriangleUV( &prim.objData.triangle, ray ), ray->lod );
+				break;
 			case SPHERE:
 			{
 				float2 uv;
 				uv.x = ( 1 + atan2pi( ray->N.z, ray->N.x ) ) * 0.5;
 				uv.y = acospi( ray->N.y );
-				int x = (int)( uv.x * mat.texW );
-				int y = (int)( uv.y * mat.texH );
-				albedo = textures[mat.texIdx + x + y * mat.texW];
+				int x = min( (int)( uv.x * mat.texW ), mat.texW - 1 );
+				int y = min( (int)( uv.y * mat.texH ), mat.texH - 1 );
+				albedo = fetchTexel( albedoMap( &mat ), 0, x, y );
 			}break;
 			case PLANE:
 			{
@@ -139,9 +423,9 @@ float4 getAlbedo( Ray* ray )
 				float v = fmod( ray->v, 1.f );
 				if ( u < 0 ) u = 1 - u;
 				if ( v < 0 ) v = 1 - v;
-				int x = (int)( u * mat.texW );
-				int y = (int)( v * mat.texH );
-				albedo = textures[mat.texIdx + ( x + y * mat.texW )];
+				int x = min( (int)( u * mat.texW ), mat.texW - 1 );
+				int y = min( (int)( v * mat.texH ), mat.texH - 1 );
+				albedo = fetchTexel( albedoMap( &mat ), 0, x, y );
 			}break;
 		}
 	return albedo;
@@ -152,7 +436,7 @@ float getSurvivalProb( float4 albedo )
 	return clamp( max(albedo.x, max(albedo.y, albedo.z)), 0.f, 1.f);
 }
 
-float4 getRandomPoint(Primitive* prim, uint* seed)
+float4 getRandomPoint(Primitive* prim, float2 r)
 {
 	switch(prim->objType)
 	{
@@ -160,8 +444,8 @@ float4 getRandomPoint(Primitive* prim, uint* seed)
 		{
 			Sphere sphere = prim->objData.sphere;
 			// https://www.demonstrations.wolfram.com/RandomPointsOnASphere/
-			float theta = random(seed) * 2 * M_PI_F;
-			float u = random(seed) * 2 - 1;
+			float theta = r.x * 2 * M_PI_F;
+			float u = r.y * 2 - 1;
 
 			float precomp = sqrt(1 - u * u);
 			float x = cos(theta) * precomp;
@@ -173,17 +457,15 @@ float4 getRandomPoint(Primitive* prim, uint* seed)
 		{
 			Triangle triangle = prim->objData.triangle;
 			// https://blogs.sas.com/content/iml/2020/10/19/random-points-in-triangle.html
-			float u1 = random(seed);
-			//printf("u1 %f\n", u1);
-			float u2 = random(seed);
+			float u1 = r.x;
+			float u2 = r.y;
 			if(u1 + u2 > 1)
 			{
 				u1 = 1 - u1;
 				u2 = 1 - u2;
 			}
-			float4 a = triangle.v1 - triangle.v0;
-			float4 b = triangle.v2 - triangle.v0;
-			return triangle.v0 + u1 * a + u2 * b;
+			float4 v0 = vertices[triangle.v0];
+			return v0 + u1 * ( vertices[triangle.v1] - v0 ) + u2 * ( vertices[triangle.v2] - v0 );
 		}
 	}
 }
@@ -12,9 +12,13 @@ Ray initRay( float4 O, float4 D )
 	ray.intensity = (float4)(1);
 	ray.t = 1e30f;
 	ray.primIdx = -1;
+	ray.instIdx = 0;
 	ray.bounces = 0;
 	ray.inside = false;
 	ray.lastSpecular = false;
+	ray.pdf = 0;
+	ray.coneWidth = ray.coneSpread = 0;
+	ray.lod = 0;
 	return ray;
 }
 
@@ -43,31 +47,30 @@ void intersectionPoint( Ray* ray )
 	ray->I = ray->O + ray->t * ray->D;
 }
 
-float4 randomRayHemisphere( float4 N, uint* seed )
+// orthonormal basis around N, Duff et al. "Building an Orthonormal Basis, Revisited" (JCGT 2017)
+void tangentFrame( float4 N, float4* T, float4* B )
 {
-    // random point from (-1,-1,-1) to (1,1,1)
-    float4 p = randomFloat3( seed ) * 2 - 1;
-    // reject if outside unit sphere
-    while (p.x * p.x + p.y * p.y + p.z * p.z > 1)
-        p = randomFloat3( seed ) * 2 - 1;
-    p = normalize( p );
-    // flip if in wrong half
-    return (dot( N, p ) < 0) ? -p : p;
+	float s = N.z >= 0 ? 1 : -1;
+	float a = -1 / ( s + N.z ), b = N.x * N.y * a;
+	*T = ( float4 )( 1 + s * N.x * N.x * a, s * b, -s * N.x, 0 );
+	*B = ( float4 )( b, s + N.y * N.y * a, -N.y, 0 );
 }
 
-// use rejection sampling
-float4 cosineWeightedRayHemisphere( float4 N, uint* seed )
+// uniform direction on the hemisphere around N from a 2D sample
+float4 randomRayHemisphere( float4 N, float2 r )
 {
-	// random point from (-1,-1,-1) to (1,1,1)
-	float4 p = randomFloat3( seed ) * 2 - 1;
-
-	// reject if outside unit sphere
-	while( p.x*p.x + p.y*p.y+p.z*p.z > 1 )
-		p = randomFloat3( seed ) * 2 - 1;
-
-	// normalize so it becomes a point on the boundary of the unit sphere
-	p = normalize( p );
-	return normalize( N + p );
+	float4 T, B;
+	tangentFrame( N, &T, &B );
+	float z = r.x, radius = sqrt( max( 0.f, 1 - z * z ) ), phi = 2 * M_PI_F * r.y;
+	return radius * cos( phi ) * T + radius * sin( phi ) * B + z * N;
+}
 
+// cosine-weighted direction on the hemisphere around N from a 2D sample (Malley's method)
+float4 cosineWeightedRayHemisphere( float4 N, float2 r )
+{
+	float4 T, B;
+	tangentFrame( N, &T, &B );
+	float radius = sqrt( r.x ), phi = 2 * M_PI_F * r.y;
+	return radius * cos( phi ) * T + radius * sin( phi ) * B + sqrt( max( 0.f, 1 - r.x ) ) * N;
 }
 #endif // __RAY_CL
\ No newline at end of file
@@ -0,0 +1,89 @@
+#ifndef __SAMPLER_CL
+#define __SAMPLER_CL
+
+// every random decision draws a 2D sample from its own dimension: the camera uses the
+// first two, after that each bounce gets a block of DIMS_PER_BOUNCE dimensions
+#define DIM_PIXEL 0 // anti-aliasing jitter
+#define DIM_LENS 1 // depth of field
+#define DIM_BOUNCE 2 // start of the block of bounce 0
+#define DIM_LOBE 0 // x: reflect or refract / specular or diffuse, y: russian roulette
+#define DIM_LIGHT 1 // x: skydome or area light, y: slot in the light alias table
+#define DIM_LIGHT_POINT 2 // point on the area light or direction on the skydome
+#define DIM_BSDF 3 // diffuse bounce direction
+#define DIMS_PER_BOUNCE 4
+
+__global float4* pixelMoments; // the sample count of each pixel is in z, see the moments buffer
+
+// index of the sample a pixel takes now; with adaptive sampling or temporal reprojection every pixel
+// keeps its own count, as in sampleCount of postproc.cl, a reprojected history included
+uint sampleIndex( Settings* settings, uint pixel )
+{
+	return settings->adaptive || settings->temporal ? (uint)pixelMoments[pixel].z : settings->frames - 1;
+}
+
+// Owen-scrambled, shuffled 2D Sobol points after Burley, "Practical Hash-based Owen Scrambling" (JCGT 2020)
+uint reverseBits( uint x )
+{
+	x = ( ( x >> 1 ) & 0x55555555 ) | ( ( x & 0x55555555 ) << 1 );
+	x = ( ( x >> 2 ) & 0x33333333 ) | ( ( x & 0x33333333 ) << 2 );
+	x = ( ( x >> 4 ) & 0x0F0F0F0F ) | ( ( x & 0x0F0F0F0F ) << 4 );
+	x = ( ( x >> 8 ) & 0x00FF00FF ) | ( ( x & 0x00FF00FF ) << 8 );
+	return ( x >> 16 ) | ( x << 16 );
+}
+
+uint hashCombine( uint seed, uint v )
+{
+	return seed ^ ( v + ( seed << 6 ) + ( seed >> 2 ) );
+}
+
+uint laineKarrasPermutation( uint x, uint seed )
+{
+	x += seed;
+	x ^= x * 0x6c50b47c;
+	x ^= x * 0xb82f1e52;
+	x ^= x * 0xc7afe638;
+	x ^= x * 0x8d22f6e6;
+	return x;
+}
+
+uint nestedUniformScramble( uint x, uint seed )
+{
+	return reverseBits( laineKarrasPermutation( reverseBits( x ), seed ) );
+}
+
+// first two Sobol dimensions: van der Corput, and the one generated by the Pascal matrix
+uint2 sobol2D( uint index )
+{
+	uint2 p = ( uint2 )( reverseBits( index ), 0 );
+	for ( uint v = 1u << 31; index; index >>= 1, v ^= v >> 1 )
+		if ( index & 1 ) p.y ^= v;
+	return p;
+}
+
+float2 scrambledSobol2D( uint pixel, uint index, uint dim )
+{
+	uint seed = hashCombine( wangHash( pixel ), wangHash( dim ) );
+	index = nestedUniformScramble( index, seed );
+	uint2 p = sobol2D( index );
+	p.x = nestedUniformScramble( p.x, hashCombine( seed, 0 ) );
+	p.y = nestedUniformScramble( p.y, hashCombine( seed, 1 ) );
+	// keep 24 bits so the result stays below 1
+	return convert_float2( p >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+// 2D sample of dimension dim for sample index of a pixel; falls back to the per-thread xorshift stream
+float2 sample2D( uint pixel, uint index, uint dim, uint* seed )
+{
+#ifdef SAMPLER_SOBOL
+	return scrambledSobol2D( pixel, index, dim );
+#else
+	return ( float2 )( random( seed ), random( seed ) );
+#endif
+}
+
+float2 bounceSample( Ray* ray, Settings* settings, uint decision, uint* seed )
+{
+	return sample2D( ray->pixelIdx, sampleIndex( settings, ray->pixelIdx ), DIM_BOUNCE + ray->bounces * DIMS_PER_BOUNCE + decision, seed );
+}
+
+#endif // __SAMPLER_CL
@@ -4,16 +4,50 @@
 #define BLACK ( float4 )(0)
 #define WHITE ( float4 )(1)
 
-float4 kajiyaShading( Ray* ray, Ray* extensionRay, uint* seed )
+// MIS is NEE with weighted contributions and shares all of its code paths
+#ifdef SHADING_NEEMIS
+#define SHADING_NEE
+#endif
+
+// pdf with respect to solid angle of the diffuse sampling strategy returning a direction at cosTheta
+float diffusePdf( float cosTheta )
+{
+#if defined(SAMPLING_HEMISPHERE)
+	return 0.5f * M_1_PI_F;
+#elif defined(SAMPLING_COSINE)
+	return cosTheta * M_1_PI_F;
+#endif
+}
+
+float powerHeuristic( float pdfA, float pdfB )
+{
+	float a = pdfA * pdfA, b = pdfB * pdfB;
+	return a + b > 0 ? a / ( a + b ) : 0;
+}
+
+// probability that NEE picks the skydome rather than an area light
+float skySelectProb( Settings* settings )
+{
+#ifdef SKYDOME
+	return settings->numLights > 0 ? 0.5f : 1;
+#else
+	return 0;
+#endif
+}
+
+float4 kajiyaShading( Ray* ray, Ray* extensionRay, Settings* settings, uint* seed )
 {
 	// we hit an object
 	Primitive prim = primitives[ray->primIdx];
 	Material mat = materials[prim.matIdx];
 	
 	if ( mat.isLight ) return ray->intensity * mat.emittance;
+	// emissive maps are not in the light table, so they only count when hit
+	float4 emitted = ray->intensity * getEmission( ray, &prim, &mat );
 
 	Ray r;
-	float rand = randomFloat( seed );
+	float2 lobe = bounceSample( ray, settings, DIM_LOBE, seed );
+	float rand = lobe.x;
 	
 	if (mat.isDieletric)
 	{
@@ -30,7 +64,7 @@ float4 kajiyaShading( Ray* ray, Ray* extensionRay, uint* seed )
 	}
 	else
 	{
-		if (rand < mat.specular)
+		if (rand < getSpecular( ray, &prim, &mat ))
 		{
 			r = reflect( ray );
 		}
@@ -39,23 +73,19 @@ float4 kajiyaShading( Ray* ray, Ray* extensionRay, uint* seed )
 			float4 albedo = getAlbedo( ray );
 #ifdef RUSSIAN_ROULETTE
 			float rr_p = getSurvivalProb( albedo );
-			if ( rr_p < randomFloat( seed ) )
-				return BLACK;
+			if ( rr_p < lobe.y )
+				return emitted;
 			else
 				ray->intensity *= 1 / rr_p;
 #endif
 			// diffuse 
 #if defined(SAMPLING_HEMISPHERE)
-			float4 reflection = randomRayHemisphere( ray->N, seed );
+			float4 reflection = randomRayHemisphere( ray->N, bounceSample( ray, settings, DIM_BSDF, seed ) );
 #elif defined(SAMPLING_COSINE)
-			float4 reflection = cosineWeightedRayHemisphere( ray->N, seed );
+			float4 reflection = cosineWeightedRayHemisphere( ray->N, bounceSample( ray, settings, DIM_BSDF, seed ) );
 #endif
 			float dotNR = dot( ray->N, reflection );
-#if defined(SAMPLING_HEMISPHERE)
-			float I_PDF = 2 * M_PI_F;
-#elif defined(SAMPLING_COSINE)
-			float I_PDF = dotNR * M_PI_F;
-#endif
+			float I_PDF = 1 / diffusePdf( dotNR );
 			float4 BRDF = albedo * M_1_PI_F;
 			ray->intensity *= BRDF * I_PDF * dotNR;
 			r = initRay( ray->I + EPSILON * reflection, reflection );
@@ -65,10 +95,49 @@ float4 kajiyaShading( Ray* ray, Ray* extensionRay, uint* seed )
 		}
 	}
 	r.pixelIdx = ray->pixelIdx;
+	// the cone widens over the distance travelled, flat triangles leave its spread as it is
+	r.coneWidth = ray->coneWidth + ray->coneSpread * ray->t;
+	r.coneSpread = ray->coneSpread;
 	*extensionRay = r;
-	return BLACK;
+	return emitted;
 }
 
+// pick a light proportional to its power from the alias table, returns its primitive index;
+// the fraction of r within the picked slot decides between the slot and its alias
+uint sampleLight( uint numLights, float* pdf, float r )
+{
+	float s = r * numLights;
+	uint slot = min( (uint)s, numLights - 1 );
+	LightAlias entry = lights[slot];
+	if ( s - slot >= entry.q ) entry = lights[entry.alias];
+	*pdf = entry.pdf;
+	return entry.primIdx;
+}
+
+#ifdef SKYDOME
+// shadow ray towards a direction on the skydome, picked proportional to its brightness
+void skydomeShadowRay( Ray* ray, float4 BRDF, float selectProb, ShadowRay* shadowRay, float2 r )
+{
+	float pdf;
+	float4 L = sampleSkydome( &pdf, r );
+	float dotNL = dot( ray->N, L );
+	if ( dotNL <= 0 || pdf <= 0 ) return;
+	ShadowRay sr;
+	sr.I = ray->I;
+	sr.L = L;
+	sr.Nl = -L;
+	sr.intensity = ray->intensity * ( 1 / ( selectProb * pdf ) );
+	sr.BRDF = BRDF;
+	sr.lightIdx = SKY_LIGHT;
+	sr.pixelIdx = ray->pixelIdx;
+	sr.dotNL = dotNL;
+	sr.dist = REALLYFAR;
+	sr.lightPdf = selectProb * pdf;
+	sr.bsdfPdf = diffusePdf( dotNL );
+	*shadowRay = sr;
+}
+#endif
+
 float4 neeShading(Ray* ray, Ray* extensionRay, ShadowRay* shadowRay, Settings* settings, uint* seed)
 {
 	// we hit an object
@@ -78,10 +147,20 @@ float4 neeShading(Ray* ray, Ray* extensionRay, ShadowRay* shadowRay, Settings* s
 		if ( ray->lastSpecular ) {
 			return ray->intensity * mat.emittance;
 		}
-		else return BLACK;	
+#ifdef SHADING_NEEMIS
+		// bsdf side of MIS, weighed against the chance that NEE picked this point;
+		// NEE lights are one-sided, so their back is black for both strategies
+		float cosL = dot( getNormal( primitives + ray->primIdx, ray->I ), -ray->D );
+		if ( cosL <= 0 || prim.area <= 0 ) return BLACK;
+		float lightPdf = ( 1 - skySelectProb( settings ) ) * prim.lightPdf * ray->t * ray->t / ( cosL * prim.area );
+		return ray->intensity * mat.emittance * powerHeuristic( ray->pdf, lightPdf );
+#endif
+		return BLACK;
 	}
+	float4 emitted = ray->intensity * getEmission( ray, &prim, &mat );
 	Ray r;
-	float rand = randomFloat( seed );
+	float2 lobe = bounceSample( ray, settings, DIM_LOBE, seed );
+	float rand = lobe.x;
 	if (mat.isDieletric)
 	{
 		float4 T = (float4)(0);
@@ -98,7 +177,7 @@ float4 neeShading(Ray* ray, Ray* extensionRay, ShadowRay* shadowRay, Settings* s
 	}
 	else
 	{
-		if (rand < mat.specular)
+		if (rand < getSpecular( ray, &prim, &mat ))
 		{
 			r = reflect( ray );
 			r.lastSpecular = true;
@@ -111,10 +190,20 @@ float4 neeShading(Ray* ray, Ray* extensionRay, ShadowRay* shadowRay, Settings* s
 			
 			// sample a random light source
 			// output: a new shadow ray
+			float skyProb = skySelectProb( settings ), selectProb = 1 - skyProb;
+			float2 lightSample = bounceSample( ray, settings, DIM_LIGHT, seed );
+			float2 pointSample = bounceSample( ray, settings, DIM_LIGHT_POINT, seed );
+#ifdef SKYDOME
+			// split the shadow rays between the skydome and the area lights
+			if ( lightSample.x < skyProb )
+				skydomeShadowRay( ray, BRDF, skyProb, shadowRay, pointSample );
+			else
+#endif
 			if (settings->numLights > 0)
 			{
-				uint lightIdx = lights[(uint)(floor( random( seed ) * settings->numLights ))];
-				float4 pointOnLight = getRandomPoint( primitives + lightIdx, seed );
+				float lightPdf;
+				uint lightIdx = sampleLight( settings->numLights, &lightPdf, lightSample.y );
+				float4 pointOnLight = getRandomPoint( primitives + lightIdx, pointSample );
 				//printf("Point on light: %f %f %f\n", pointOnLight.x, pointOnLight.y, pointOnLight.z);
 				float4 dirToLight = pointOnLight - ray->I;
 				float4 Nl = getNormal( primitives + lightIdx, pointOnLight );
@@ -129,42 +218,61 @@ float4 neeShading(Ray* ray, Ray* extensionRay, ShadowRay* shadowRay, Settings* s
 					sr.I = ray->I;
 					sr.L = L;
 					sr.Nl = Nl;
-					sr.intensity = ray->intensity * settings->numLights;
+					sr.intensity = ray->intensity * ( 1 / ( selectProb * lightPdf ) );
 					sr.BRDF = BRDF;
 					sr.lightIdx = lightIdx;
 					sr.pixelIdx = ray->pixelIdx;
 					sr.dotNL = dotNL;
 					sr.dist = dist;
+					sr.lightPdf = selectProb * lightPdf * dist * dist / ( dot( Nl, -L ) * primitives[lightIdx].area );
+					sr.bsdfPdf = diffusePdf( dotNL );
 					*shadowRay = sr;
 				}
 			}
 #ifdef RUSSIAN_ROULETTE
 			float rr_p = getSurvivalProb( albedo );
-			if ( rr_p < randomFloat( seed ) )
-				return BLACK;
+			if ( rr_p < lobe.y )
+				return emitted;
 			else
 				ray->intensity *= 1 / rr_p;
 #endif
 			// diffuse 
 #if defined(SAMPLING_HEMISPHERE)
-			float4 reflection = randomRayHemisphere( ray->N, seed );
+			float4 reflection = randomRayHemisphere( ray->N, bounceSample( ray, settings, DIM_BSDF, seed ) );
 #elif defined(SAMPLING_COSINE)
-			float4 reflection = cosineWeightedRayHemisphere( ray->N, seed );
+			float4 reflection = cosineWeightedRayHemisphere( ray->N, bounceSample( ray, settings, DIM_BSDF, seed ) );
 #endif
 			float dotNR = dot( ray->N, reflection );
-#if defined(SAMPLING_HEMISPHERE)
-			float I_PDF = 2 * M_PI_F;
-#elif defined(SAMPLING_COSINE)
-			float I_PDF = dotNR * M_PI_F;
-#endif
+			float I_PDF = 1 / diffusePdf( dotNR );
 			r = initRay( ray->I + EPSILON * reflection, reflection );
 			r.intensity = ray->intensity * BRDF * I_PDF * dotNR;
+			r.pdf = diffusePdf( dotNR );
 			r.bounces = ray->bounces + 1;
 			r.inside = ray->inside;
 		}
 	}
 	r.pixelIdx = ray->pixelIdx;
+	// the cone widens over the distance travelled, flat triangles leave its spread as it is
+	r.coneWidth = ray->coneWidth + ray->coneSpread * ray->t;
+	r.coneSpread = ray->coneSpread;
 	*extensionRay = r;
-	return BLACK;
+	return emitted;
+}
+
+// contribution of a ray that left the scene
+float4 missShading( Ray* ray, Settings* settings )
+{
+	float4 sky = ray->intensity * readSkydome( ray->D );
+#if defined(SKYDOME) && defined(SHADING_NEE)
+	// NEE already sampled the skydome from diffuse surfaces
+	if ( !ray->lastSpecular ) {
+#ifdef SHADING_NEEMIS
+		return sky * powerHeuristic( ray->pdf, skySelectProb( settings ) * skydomePdfDir( ray->D ) );
+#else
+		return BLACK;
+#endif
+	}
+#endif
+	return sky;
 }
 #endif // __SHADING_CL
\ No newline at end of file
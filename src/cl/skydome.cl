@@ -1,16 +1,79 @@
 #ifndef __SKYDOME_CL
 #define __SKYDOME_CL
 
+// lightIdx of a shadow ray that samples the skydome instead of an area light
+#define SKY_LIGHT -1
+
 // https://www.cs.uu.nl/docs/vakken/magr/2021-2022/files/lecture%2011%20-%20various.pdf
 float4 readSkydome( float4 dir )
 {
+#ifndef SKYDOME
 	return (float4)( 0.0784f, 0.0941f, 0.3215f, 0 );
+#else
 	float u = (1 + atan2pi( dir.x, -dir.z )) * 0.5f;
 	float v = acospi( dir.y );
 	Material mat = materials[0];
-	int x = (int)(u * mat.texW);
-	int y = (int)(v * mat.texH);
-	return textures[mat.texIdx + x + y * mat.texW];
+	int x = min( (int)(u * mat.texW), mat.texW - 1 );
+	int y = min( (int)(v * mat.texH), mat.texH - 1 );
+	return fetchTexel( albedoMap( &mat ), 0, x, y );
+#endif
+}
+
+#ifdef SKYDOME
+// first entry of a normalized, inclusive cdf that exceeds r
+int upperBound( __global float* cdf, int n, float r )
+{
+	int lo = 0, hi = n - 1;
+	while ( lo < hi ) {
+		int mid = ( lo + hi ) >> 1;
+		if ( cdf[mid] > r ) hi = mid; else lo = mid + 1;
+	}
+	return lo;
+}
+
+// skyCdf holds a conditional cdf per texel row, followed by the marginal cdf over the rows
+float probability( __global float* cdf, int i ) { return i == 0 ? cdf[0] : cdf[i] - cdf[i - 1]; }
+
+// pdf with respect to solid angle of sampling dir, for a texel at (x, y)
+float skydomePdf( int x, int y, float sinTheta )
+{
+	Material mat = materials[0];
+	if ( sinTheta <= 0 ) return 0;
+	float pRow = probability( skyCdf + mat.texW * mat.texH, y );
+	float pCol = probability( skyCdf + y * mat.texW, x );
+	return pRow * pCol * mat.texW * mat.texH / ( 2 * M_PI_F * M_PI_F * sinTheta );
+}
+
+// pdf with respect to solid angle of sampleSkydome returning dir
+float skydomePdfDir( float4 dir )
+{
+	Material mat = materials[0];
+	float u = (1 + atan2pi( dir.x, -dir.z )) * 0.5f;
+	float v = acospi( dir.y );
+	int x = min( (int)(u * mat.texW), mat.texW - 1 );
+	int y = min( (int)(v * mat.texH), mat.texH - 1 );
+	return skydomePdf( x, y, sqrt( max( 0.f, 1 - dir.y * dir.y ) ) );
+}
+
+// pick a direction on the skydome proportional to texel luminance; what is left of
+// the 2D sample within the picked row and column places the direction inside the texel
+float4 sampleSkydome( float* pdf, float2 r )
+{
+	Material mat = materials[0];
+	__global float* marginal = skyCdf + mat.texW * mat.texH;
+	int y = upperBound( marginal, mat.texH, r.x );
+	__global float* row = skyCdf + y * mat.texW;
+	int x = upperBound( row, mat.texW, r.y );
+	float ry = ( r.x - ( y == 0 ? 0 : marginal[y - 1] ) ) / probability( marginal, y );
+	float rx = ( r.y - ( x == 0 ? 0 : row[x - 1] ) ) / probability( row, x );
+	float u = ( x + clamp( rx, 0.f, 1.f ) ) / mat.texW;
+	float v = ( y + clamp( ry, 0.f, 1.f ) ) / mat.texH;
+	// invert the mapping of readSkydome
+	float phi = ( 2 * u - 1 ) * M_PI_F, theta = v * M_PI_F;
+	float sinTheta = sin( theta );
+	*pdf = skydomePdf( x, y, sinTheta );
+	return ( float4 )( sinTheta * sin( phi ), cos( theta ), -sinTheta * cos( phi ), 0 );
 }
+#endif
 
-#endif // __SKYDOME_CL
\ No newline at end of file
+#endif // __SKYDOME_CL
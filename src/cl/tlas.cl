@@ -6,22 +6,55 @@ void transformRay( Ray* ray, float* invT )
 	ray->O = transformPosition( &( ray->O ), invT );
 	ray->rD = ( float4 )( 1.0f / ray->D.x, 1.0f / ray->D.y, 1.0f / ray->D.z, 1.0f );
 }
-int instanceIntersect( Ray* ray, BVHNode2* bvhNodes, uint* primIdxs, BVHInstance* bvhInstance, bool occlusion )
+// normals transform with the transpose of the inverse instance transform
+float4 instanceNormal( float* invT, float4 N )
+{
+	return normalize( ( float4 )(
+		invT[0] * N.x + invT[4] * N.y + invT[8] * N.z,
+		invT[1] * N.x + invT[5] * N.y + invT[9] * N.z,
+		invT[2] * N.x + invT[6] * N.y + invT[10] * N.z, 0 ) );
+}
+// world units per object unit of an instance, assuming it scales uniformly
+float instanceScale( float* invT )
+{
+	float det = invT[0] * ( invT[5] * invT[10] - invT[6] * invT[9] ) - invT[1] * ( invT[4] * invT[10] - invT[6] * invT[8] ) +
+		invT[2] * ( invT[4] * invT[9] - invT[5] * invT[8] );
+	return 1 / cbrt( fabs( det ) );
+}
+__global int* blasRoots; // per BLAS: its root in the node pool, or BLAS_ABSENT / BLAS_REQUESTED / BLAS_MISSING
+__global uint* blasFeedback; // the BLASes to load and the BLASes used, read back by the host
+
+// the root of a BLAS in the pool; a BLAS that is not resident is queued for the host, once
+int blasRoot( uint blas )
+{
+	int root = blasRoots[blas];
+	if ( root >= 0 ) blasFeedback[BLAS_FEEDBACK_USED + blas] = 1;
+	else if ( root == BLAS_ABSENT && atomic_cmpxchg( (volatile __global int*)( blasRoots + blas ), BLAS_ABSENT, BLAS_REQUESTED ) == BLAS_ABSENT ) {
+		uint request = atomic_inc( blasFeedback );
+		// a full queue puts the entry back, a later ray asks again
+		if ( request < BLAS_MAX_REQUESTS ) blasFeedback[1 + request] = blas;
+		else blasRoots[blas] = BLAS_ABSENT;
+	}
+	return root;
+}
+int instanceIntersect( Ray* ray, BVHNode2* bvhNodes, uint* primIdxs, BVHInstance* bvhInstance, int instIdx, int root )
 {
 	// backup and transform ray using instance transform
 	Ray backup = *ray;
+	float t = ray->t;
 	transformRay( ray, (float*)&bvhInstance->invT );
 	// traverse the BLAS
 #ifdef USE_BVH4
-	int steps = intersectBVH4( ray, bvhNodes, primIdxs, bvhInstance->bvhIdx, occlusion );
+	int steps = intersectBVH4( ray, bvhNodes, primIdxs, root );
 #endif
 #ifdef USE_BVH2
-	int steps = intersectBVH2( ray, bvhNodes, primIdxs, bvhInstance->bvhIdx, occlusion );
+	int steps = intersectBVH2( ray, bvhNodes, primIdxs, root );
 #endif
 	ray->D = backup.D;
 	ray->O = backup.O;
 	ray->rD = backup.rD;
-	if ( occlusion ) if ( steps == -1 ) return -1;
+	// instances of the same BLAS share primIdx, a closer hit tells them apart
+	if ( ray->t < t ) ray->instIdx = instIdx;
 	return steps;
 }
 
@@ -35,27 +68,26 @@ int intersectTLAS(
 #ifdef USE_BVH2
 	BVHNode2* bvhNodes,
 #endif
-	uint* primIdxs,
-	bool occlusion
+	uint* primIdxs
 )
 {
 	TLASNode* node = &tlasNodes[0], * stack[32];
 	uint stackPtr = 0;
 	int steps = 0;
-	float t_light = ray->t;
+	float t_light = ray->t, t_deferred = REALLYFAR;
 	while ( 1 ) {
-		if ( node->leftRight == 0 ) {
+		if ( node->left == 0 ) {
 			BVHInstance* bvhInstance = &blasNodes[node->BLASidx];
-			int value = instanceIntersect( ray, bvhNodes, primIdxs, bvhInstance, occlusion );
-			if ( occlusion ) if ( value == -1 ) return -1;
-			steps += value;
+			int root = blasRoot( bvhInstance->bvhIdx );
+			if ( root >= 0 ) steps += instanceIntersect( ray, bvhNodes, primIdxs, bvhInstance, node->BLASidx, root );
+			else if ( root != BLAS_MISSING ) t_deferred = min( t_deferred, intersectAABB( ray, node->aabbMin, node->aabbMax ) );
 			if ( stackPtr == 0 ) break;
 			else node = stack[--stackPtr];
 			continue;
 		}
 		// current node is an interior node: visit child nodes, ordered
-		TLASNode* child1 = &tlasNodes[node->leftRight & 0xffff];
-		TLASNode* child2 = &tlasNodes[node->leftRight >> 16];
+		TLASNode* child1 = &tlasNodes[node->left];
+		TLASNode* child2 = &tlasNodes[node->right];
 		float dist1 = intersectAABB( ray, child1->aabbMin, child1->aabbMax );
 		float dist2 = intersectAABB( ray, child2->aabbMin, child2->aabbMax );
 		if ( dist1 > dist2 ) {
@@ -73,6 +105,82 @@ int intersectTLAS(
 		}
 		//steps++;
 	}
+	// the BLAS that was skipped may hide the hit: trace the ray again once it is resident
+	if ( t_deferred < ray->t ) ray->primIdx = DEFERRED;
 	return steps;
 }
+bool isOccludedInstance(
+	OcclusionRay* ray,
+#ifdef USE_BVH4
+	BVHNode4* bvhNodes,
+#endif
+#ifdef USE_BVH2
+	BVHNode2* bvhNodes,
+#endif
+	uint* primIdxs,
+	BVHInstance* bvhInstance,
+	int root
+)
+{
+	// the occlusion ray is small enough to transform a copy instead of restoring it
+	OcclusionRay r = *ray;
+	float* invT = (float*)&bvhInstance->invT;
+	r.D = transformVector( &( r.D ), invT );
+	r.O = transformPosition( &( r.O ), invT );
+	r.rD = ( float4 )( 1.0f / r.D.x, 1.0f / r.D.y, 1.0f / r.D.z, 1.0f );
+#ifdef USE_BVH4
+	return isOccludedBVH4( &r, bvhNodes, primIdxs, root );
+#endif
+#ifdef USE_BVH2
+	return isOccludedBVH2( &r, bvhNodes, primIdxs, root );
+#endif
+}
+
+bool isOccludedTLAS(
+	OcclusionRay* ray,
+	TLASNode* tlasNodes,
+	BVHInstance* blasNodes,
+#ifdef USE_BVH4
+	BVHNode4* bvhNodes,
+#endif
+#ifdef USE_BVH2
+	BVHNode2* bvhNodes,
+#endif
+	uint* primIdxs,
+	bool* deferred
+)
+{
+	TLASNode* node = &tlasNodes[0], * stack[32];
+	uint stackPtr = 0;
+	*deferred = false;
+	while ( 1 ) {
+		if ( node->left == 0 ) {
+			// a BLAS that is not resident yet may hide the light; unless a resident one does,
+			// the answer waits for it: deferred is set and false returned
+			BVHInstance* bvhInstance = &blasNodes[node->BLASidx];
+			int root = blasRoot( bvhInstance->bvhIdx );
+			if ( root >= 0 && isOccludedInstance( ray, bvhNodes, primIdxs, bvhInstance, root ) ) {
+				*deferred = false;
+				return true;
+			}
+			if ( root < 0 && root != BLAS_MISSING ) *deferred = true;
+			if ( stackPtr == 0 ) return false;
+			node = stack[--stackPtr];
+			continue;
+		}
+		// any child that is hit gets visited, order does not matter
+		TLASNode* child1 = &tlasNodes[node->left];
+		TLASNode* child2 = &tlasNodes[node->right];
+		bool hit1 = hitAABB( ray, child1->aabbMin, child1->aabbMax );
+		bool hit2 = hitAABB( ray, child2->aabbMin, child2->aabbMax );
+		if ( hit1 ) {
+			node = child1;
+			if ( hit2 ) stack[stackPtr++] = child2;
+		} else if ( hit2 ) node = child2;
+		else {
+			if ( stackPtr == 0 ) return false;
+			node = stack[--stackPtr];
+		}
+	}
+}
 #endif // __TLAS_CL
\ No newline at end of file
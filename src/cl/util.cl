@@ -58,6 +58,8 @@ float randomFloat( uint* seed ) { return randomUInt( seed ) * 2.3283064365387e-1
 float random( uint* seed ) { return fabs( randomFloat( seed ) ); }
 float4 randomFloat3( uint* seed ) { return ( float4 )( randomFloat( seed ), randomFloat( seed ), randomFloat( seed ), 0 ); };
 
+float luminance( float4 c ) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
 float4 transformVector( float4* V, float* T )
 {
 	float4 tv = ( float4 )(
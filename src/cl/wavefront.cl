@@ -3,6 +3,7 @@
 #include "src/constants.h"
 #include "src/common.h"
 #include "src/cl/util.cl"
+#include "src/cl/sampler.cl"
 #include "src/cl/primitives.cl"
 #include "src/cl/ray.cl"
 #include "src/cl/camera.cl"
@@ -11,11 +12,59 @@
 #include "src/cl/shading.cl"
 #include "src/cl/bvh.cl"
 #include "src/cl/tlas.cl"
+
+// first hit features that guide the denoiser, kept with the path and accumulated per sample like
+// the colour; lights, glass and misses get a white albedo so their colour stays in the illumination
+void writeFeatures( Ray* ray, __global PathState* path )
+{
+	if ( ray->primIdx == -1 ) {
+		path->albedo = WHITE;
+		path->normalDepth = path->position = ( float4 )( 0 );
+		return;
+	}
+	// the hit position, w = 1, for temporal reprojection
+	path->position = ( float4 )( ray->I.xyz, 1 );
+	Material mat = materials[primitives[ray->primIdx].matIdx];
+	path->albedo = mat.isLight || mat.isDieletric ? WHITE : getAlbedo( ray );
+	path->normalDepth = ( float4 )( ray->N.xyz, ray->t );
+}
+
+// the shadow rays of a path may be connected at the same time, their light is added atomically
+void atomicAddFloat( volatile __global float* p, float v )
+{
+	float old;
+	do old = *p;
+	while ( atomic_cmpxchg( (volatile __global uint*)p, as_uint( old ), as_uint( old + v ) ) != as_uint( old ) );
+}
+void addRadiance( __global PathState* path, float4 color )
+{
+	if ( color.x == 0 && color.y == 0 && color.z == 0 ) return;
+	volatile __global float* radiance = (volatile __global float*)&path->radiance;
+	atomicAddFloat( radiance, color.x );
+	atomicAddFloat( radiance + 1, color.y );
+	atomicAddFloat( radiance + 2, color.z );
+}
+
+// a ray of the path is done; resolve takes the path once none are left
+void endRay( __global PathState* path )
+{
+	atomic_dec( &path->pending );
+}
+// a ray that found its deferred queue full: the path is left out as a whole, its light and its sample
+void dropRay( __global PathState* path )
+{
+	path->status = PATH_DROPPED;
+	atomic_dec( &path->pending );
+}
+
 __kernel void generate(
 	__global Ray* rays,
 	__global Settings* settings,
 	__global uint* seeds,
-	Camera _camera
+	Camera _camera,
+	__global uint* activePixels,
+	__global float4* _moments,
+	__global PathState* paths
 )
 {
 	//__local Camera camera;
@@ -24,13 +73,31 @@ __kernel void generate(
 	//	camera = _camera;
 	//work_group_barrier( CLK_LOCAL_MEM_FENCE );
 	int idx = get_global_id( 0 );
+	if ( idx >= settings->numActive ) return;
 	uint* seed = seeds + idx;
-	int x = idx % SCRWIDTH;
-	int y = idx / SCRWIDTH;
+	int pixel = settings->adaptive ? activePixels[idx] : idx;
+	if ( !settings->renderBVH ) {
+		// one path per pixel: while the previous one waits for a BLAS, the pixel takes no new sample
+		__global PathState* path = paths + pixel;
+		if ( path->status != PATH_NONE ) return;
+		path->radiance = ( float4 )( 0 );
+		path->status = PATH_LIVE;
+		path->pending = 1;
+	}
+	pixelMoments = _moments;
+	int x = pixel % SCRWIDTH;
+	int y = pixel / SCRWIDTH;
 	Ray r = initPrimaryRay( x, y, _camera, settings, seed );
 	r.lastSpecular = true;
-	r.pixelIdx = idx;
-	rays[idx] = r;
+	r.pixelIdx = pixel;
+	rays[atomic_inc( &( settings->numOutRays ) )] = r;
+}
+// appends the rays deferred by the previous frames to the primary rays
+__kernel void resume( __global Ray* rays, __global Settings* settings, __global Ray* deferred, __global uint* deferCount )
+{
+	int idx = get_global_id( 0 );
+	if ( idx >= min( *deferCount, (uint)MAX_DEFERRED ) ) return;
+	rays[atomic_inc( &( settings->numOutRays ) )] = deferred[idx];
 }
 __kernel void extend(
 	__global Ray* rays,
@@ -45,7 +112,19 @@ __kernel void extend(
 #endif
 	__global uint* primIdxs,
 	__global float4* accum,
-	__global Settings* settings
+	__global Settings* settings,
+	__global float4* _vertices,
+	__global Material* _materials,
+	__global uint* _textures,
+	__global float2* _texcoords,
+	__global int* _pageTable,
+	__global uint* _vtFeedback,
+	__global int* _blasRoots,
+	__global uint* _blasFeedback,
+	__global Ray* deferred,
+	__global uint* deferCount,
+	__global PathState* paths,
+	__global TriAccel* _triAccels
 )
 {
 	// swap the atomics after an extend-shade cycle
@@ -57,17 +136,49 @@ __kernel void extend(
 	}
 	work_group_barrier( CLK_GLOBAL_MEM_FENCE );
 	primitives = _primitives;
+	vertices = _vertices;
+	triAccels = _triAccels;
+	texcoords = _texcoords;
+	materials = _materials;
+	textures = _textures;
+	pageTable = _pageTable;
+	vtFeedback = _vtFeedback;
+	blasRoots = _blasRoots;
+	blasFeedback = _blasFeedback;
 	// persistent thread
 	while ( true ) {
 		// stop when there are no more incoming extensionRays
 		int idx = atomic_dec( &( settings->numInRays ) ) - 1;
 		if ( idx < 0 ) break;
 		Ray* ray = rays + idx;
-		uint steps = intersectTLAS( ray, tlasNodes, blasNodes, bvhNodes, primIdxs, false );
-		if ( settings->renderBVH ) accum[idx] = ( float4 )( steps / 255.f );
+		uint steps = intersectTLAS( ray, tlasNodes, blasNodes, bvhNodes, primIdxs );
+		if ( settings->renderBVH ) accum[ray->pixelIdx] = ( float4 )( steps / 255.f );
+		if ( ray->primIdx == DEFERRED ) {
+			// traced again from the start of a later frame; a path that is left out already does not
+			// wait, one that finds the queue full is left out
+			if ( settings->renderBVH ) continue;
+			__global PathState* path = paths + ray->pixelIdx;
+			if ( path->status == PATH_DROPPED ) {
+				endRay( path );
+				continue;
+			}
+			uint slot = atomic_inc( deferCount );
+			if ( slot >= MAX_DEFERRED ) {
+				dropRay( path );
+				continue;
+			}
+			deferred[slot] = *ray;
+			deferred[slot].t = REALLYFAR;
+			deferred[slot].primIdx = -1;
+			continue;
+		}
 		if ( ray->primIdx == -1 ) continue;
 		intersectionPoint( ray );
-		ray->N = getNormal( primitives + ray->primIdx, ray->I );
+		Primitive* prim = primitives + ray->primIdx;
+		float* invT = (float*)&blasNodes[ray->instIdx].invT;
+		float4 N = getNormal( prim, ray->I );
+		ray->lod = coneLod( ray, prim, instanceNormal( invT, N ), instanceScale( invT ) );
+		ray->N = instanceNormal( invT, getShadingNormal( ray, prim, N ) );
 		// flip normal if we hit backside of obj
 		if ( dot( ray->N, -ray->D ) < 0 ) ray->N *= -1;
 		//if ( ray->inside ) ray->N = -ray->N;
@@ -78,12 +189,19 @@ __kernel void shade(
 	__global Ray* extensionRays,
 	__global ShadowRay* shadowRays,
 	__global Primitive* _primitives,
-	__global float4* _textures,
+	__global uint* _textures,
 	__global Material* _materials,
-	__global uint* _lights,
+	__global LightAlias* _lights,
 	__global Settings* settings,
-	__global float4* accum,
-	__global uint* seeds
+	__global PathState* paths,
+	__global uint* seeds,
+	__global float* _skyCdf,
+	__global float4* _vertices,
+	__global float2* _texcoords,
+	__global int* _pageTable,
+	__global uint* _vtFeedback,
+	__global float4* _moments,
+	int lastBounce
 )
 {
 	int global_idx = get_global_id( 0 );
@@ -96,18 +214,33 @@ __kernel void shade(
 
 	uint* seed = seeds + global_idx;
 	primitives = _primitives;
+	vertices = _vertices;
+	texcoords = _texcoords;
 	textures = _textures;
+	pageTable = _pageTable;
+	vtFeedback = _vtFeedback;
 	materials = _materials;
 	lights = _lights;
+	skyCdf = _skyCdf;
+	pixelMoments = _moments;
 
 	while ( true ) {
 		int idx = atomic_dec( &( settings->numInRays ) ) - 1;
 		if ( idx < 0 ) break;
 
 		Ray* ray = inputRays + idx;
+		// waits in the deferred queue for its BLAS
+		if ( ray->primIdx == DEFERRED ) continue;
+		__global PathState* path = paths + ray->pixelIdx;
+		if ( path->status == PATH_DROPPED ) {
+			endRay( path );
+			continue;
+		}
+		if ( ray->bounces == 0 ) writeFeatures( ray, path );
 		// we did not hit anything, fall back to the skydome
 		if ( ray->primIdx == -1 ) {
-			accum[ray->pixelIdx] += ray->intensity * readSkydome( ray->D );
+			path->radiance += missShading( ray, settings );
+			endRay( path );
 			continue;
 		}
 		Ray extensionRay = initRay( ( float4 )( 0 ), ( float4 )( 0 ) );
@@ -115,7 +248,7 @@ __kernel void shade(
 
 		float4 color;
 #ifdef SHADING_SIMPLE
-		color = kajiyaShading( ray, &extensionRay, seed );
+		color = kajiyaShading( ray, &extensionRay, settings, seed );
 #endif
 #ifdef SHADING_NEE
 		ShadowRay shadowRay;
@@ -125,22 +258,110 @@ __kernel void shade(
 #ifdef FILTER_FIREFLIES
 		if ( dot( color, color ) > 25 ) color = 5 * normalize( color );
 #endif
-		accum[ray->pixelIdx] += color;
-		if ( extensionRay.bounces <= MAX_BOUNCES ) {
+		// the only ray of its path in this kernel, the shadow rays are connected later
+		path->radiance += color;
+		// the rays that carry the path on; the frame traces no extension rays after its last bounce
+		int next = 0;
+		if ( extensionRay.bounces <= MAX_BOUNCES && !lastBounce ) {
 			// get atomic inc in settings->numOutRays and set extensionRay in _extensionRays on that idx 
 			int extensionIdx = atomic_inc( &( settings->numOutRays ) );
 			extensionRays[extensionIdx] = extensionRay;
+			next++;
 		}
 #ifdef SHADING_NEE
 		if ( shadowRay.pixelIdx != -1 ) {
 			int shadowIdx = atomic_inc( &( settings->shadowRays ) );
 			//printf("raid shadow rays%i\n", shadowIdx);
 			shadowRays[shadowIdx] = shadowRay;
+			next++;
 		}
 #endif
+		// they take the place of this ray
+		if ( next != 1 ) atomic_add( &path->pending, (uint)( next - 1 ) );
 	}
 }
 
+// trace a shadow ray towards its light and return the light it carries, or black when occluded;
+// deferred tells when a BLAS that is not resident may be in the way
+float4 connectShadowRay(
+	ShadowRay* shadowRay,
+	TLASNode* tlasNodes,
+	BVHInstance* blasNodes,
+#ifdef USE_BVH4
+	BVHNode4* bvhNodes,
+#endif
+#ifdef USE_BVH2
+	BVHNode2* bvhNodes,
+#endif
+	uint* bvhIdxs,
+	bool* deferred
+)
+{
+	OcclusionRay ray;
+	ray.O = shadowRay->I + shadowRay->L * EPSILON;
+	ray.D = shadowRay->L;
+	ray.rD = 1 / shadowRay->L;
+	ray.t = shadowRay->dist - 2 * EPSILON;
+	if ( isOccludedTLAS( &ray, tlasNodes, blasNodes, bvhNodes, bvhIdxs, deferred ) || *deferred ) return BLACK;
+
+	float4 Ld;
+#ifdef SKYDOME
+	// the skydome pdf is already per solid angle
+	if ( shadowRay->lightIdx == SKY_LIGHT ) Ld = readSkydome( shadowRay->L ) * shadowRay->BRDF * shadowRay->dotNL;
+	else
+#endif
+	{
+		Primitive* prim = primitives + shadowRay->lightIdx;
+		float solidAngle = dot( shadowRay->Nl, -shadowRay->L ) * prim->area * ( 1 / ( shadowRay->dist * shadowRay->dist ) );
+		float4 lightColor = materials[prim->matIdx].emittance;
+		Ld = lightColor * solidAngle * shadowRay->BRDF * shadowRay->dotNL;
+	}
+	float4 color = Ld * shadowRay->intensity;
+#ifdef SHADING_NEEMIS
+	// light side of MIS, weighed against the chance that the extension ray found the same light
+	color *= powerHeuristic( shadowRay->lightPdf, shadowRay->bsdfPdf );
+#endif
+#ifdef FILTER_FIREFLIES
+	if ( dot( color, color ) > 25 ) color = 5 * normalize( color );
+#endif
+	return color;
+}
+
+// adds the light of a shadow ray to its path; one that waits for a BLAS is tested again next
+// frame, from the deferred shadow queue, and when that is full its path is left out
+void connectOrDefer(
+	ShadowRay* shadowRay,
+	TLASNode* tlasNodes,
+	BVHInstance* blasNodes,
+#ifdef USE_BVH4
+	BVHNode4* bvhNodes,
+#endif
+#ifdef USE_BVH2
+	BVHNode2* bvhNodes,
+#endif
+	uint* bvhIdxs,
+	__global PathState* paths,
+	ShadowRay* deferred,
+	uint* deferCount
+)
+{
+	__global PathState* path = paths + shadowRay->pixelIdx;
+	if ( path->status == PATH_DROPPED ) {
+		endRay( path );
+		return;
+	}
+	bool wait;
+	float4 color = connectShadowRay( shadowRay, tlasNodes, blasNodes, bvhNodes, bvhIdxs, &wait );
+	if ( !wait ) {
+		addRadiance( path, color );
+		endRay( path );
+		return;
+	}
+	uint slot = atomic_inc( deferCount );
+	if ( slot < MAX_DEFERRED ) deferred[slot] = *shadowRay;
+	else dropRay( path );
+}
+
 __kernel void connect(
 	__global ShadowRay* shadowRays,
 	__global TLASNode* tlasNodes,
@@ -155,49 +376,186 @@ __kernel void connect(
 	__global Primitive* _primitives,
 	__global Material* _materials,
 	__global Settings* settings,
-	__global float4* accum
+	__global PathState* paths,
+	__global float4* _vertices,
+	__global uint* _textures,
+	__global int* _pageTable,
+	__global uint* _vtFeedback,
+	__global int* _blasRoots,
+	__global uint* _blasFeedback,
+	__global ShadowRay* deferred,
+	__global uint* deferCount,
+	__global TriAccel* _triAccels
 )
 {
-	if ( get_global_id( 0 ) == 0 ) {
-		//printf("nr of shadow rays input %i\n", settings->shadowRays);
-		primitives = _primitives;
-		materials = _materials;
-	}
-	work_group_barrier( CLK_GLOBAL_MEM_FENCE );
+	primitives = _primitives;
+	materials = _materials;
+	vertices = _vertices;
+	triAccels = _triAccels;
+	textures = _textures;
+	pageTable = _pageTable;
+	vtFeedback = _vtFeedback;
+	blasRoots = _blasRoots;
+	blasFeedback = _blasFeedback;
 
 	while ( true ) {
 		int idx = atomic_dec( &( settings->shadowRays ) ) - 1;
 		if ( idx < 0 ) break;
 		ShadowRay shadowRay = shadowRays[idx];
-	/*	float4 dir = shadowRay.L - shadowRay.I;
-		float4 norm = dir / shadowRay.dist;*/
-
-		Ray ray = initRay(shadowRay.I + shadowRay.L * EPSILON, shadowRay.L );
-		ray.t = shadowRay.dist - 2 * EPSILON;
-
-		int value = intersectTLAS( &ray, tlasNodes, blasNodes, bvhNodes, bvhIdxs, true );
-
-		if ( value == -1 ) continue;
-		//printf("ray %i connected\n", idx);
-
-		// calculate 
-		Primitive* prim = _primitives + shadowRay.lightIdx;
-		//printf( "Prim type: %i\n", prim->objType );
-		//float4 NL = getNormal(prim, shadowRay.L);
-		float solidAngle = dot(shadowRay.Nl, -shadowRay.L) * prim->area * (1 / (shadowRay.dist * shadowRay.dist));
-		//printf( "Area: %f, Dist: %f, DOT: %f\n", prim->area, shadowRay.dist, dot( shadowRay.Nl, -shadowRay.L ) );
-
-		float4 lightColor = _materials[prim->matIdx].emittance;
-		//printf( "matIdx: %i, lightColor: %f %f %f\n", prim->matIdx, lightColor.x, lightColor.y, lightColor.z );
-		//printf( "SA: %f, BRDF: %f %f %f, DOT: %f\n", solidAngle, shadowRay.BRDF.x, shadowRay.BRDF.y, shadowRay.BRDF.z, shadowRay.dotNL );
-		
-		float4 Ld = lightColor * solidAngle * shadowRay.BRDF * shadowRay.dotNL;
-		float4 color = Ld * shadowRay.intensity;
+		connectOrDefer( &shadowRay, tlasNodes, blasNodes, bvhNodes, bvhIdxs, paths, deferred, deferCount );
+	}
+}
+
+// tests the shadow rays deferred by the previous frame again; the queues swap every frame, the
+// ones that still wait go to the other
+__kernel void reconnect(
+	__global ShadowRay* waiting,
+	__global uint* waitCount,
+	__global TLASNode* tlasNodes,
+	__global BVHInstance* blasNodes,
+#ifdef USE_BVH4
+	__global BVHNode4* bvhNodes,
+#endif
+#ifdef USE_BVH2
+	__global BVHNode2* bvhNodes,
+#endif
+	__global uint* bvhIdxs,
+	__global Primitive* _primitives,
+	__global Material* _materials,
+	__global PathState* paths,
+	__global float4* _vertices,
+	__global uint* _textures,
+	__global int* _pageTable,
+	__global uint* _vtFeedback,
+	__global int* _blasRoots,
+	__global uint* _blasFeedback,
+	__global ShadowRay* deferred,
+	__global uint* deferCount,
+	__global TriAccel* _triAccels
+)
+{
+	int idx = get_global_id( 0 );
+	if ( idx >= min( *waitCount, (uint)MAX_DEFERRED ) ) return;
+	primitives = _primitives;
+	materials = _materials;
+	vertices = _vertices;
+	triAccels = _triAccels;
+	textures = _textures;
+	pageTable = _pageTable;
+	vtFeedback = _vtFeedback;
+	blasRoots = _blasRoots;
+	blasFeedback = _blasFeedback;
+	ShadowRay shadowRay = waiting[idx];
+	connectOrDefer( &shadowRay, tlasNodes, blasNodes, bvhNodes, bvhIdxs, paths, deferred, deferCount );
+}
+
+// megakernel alternative to generate/extend/shade/connect: one thread traces
+// the full path of one pixel, including its shadow rays, without ray queues
+__kernel void render(
+	__global Primitive* _primitives,
+	__global uint* _textures,
+	__global Material* _materials,
+	__global LightAlias* _lights,
+	__global TLASNode* tlasNodes,
+	__global BVHInstance* blasNodes,
+#ifdef USE_BVH4
+	__global BVHNode4* bvhNodes,
+#endif
+#ifdef USE_BVH2
+	__global BVHNode2* bvhNodes,
+#endif
+	__global uint* primIdxs,
+	__global Settings* settings,
+	__global PathState* paths,
+	__global uint* seeds,
+	Camera camera,
+	__global float4* _vertices,
+	__global float* _skyCdf,
+	__global uint* activePixels,
+	__global float2* _texcoords,
+	__global int* _pageTable,
+	__global uint* _vtFeedback,
+	__global int* _blasRoots,
+	__global uint* _blasFeedback,
+	__global float4* _moments,
+	__global TriAccel* _triAccels
+)
+{
+	int idx = get_global_id( 0 );
+	if ( idx >= settings->numActive ) return;
+	uint* seed = seeds + idx;
+	int pixel = settings->adaptive ? activePixels[idx] : idx;
+	primitives = _primitives;
+	vertices = _vertices;
+	triAccels = _triAccels;
+	texcoords = _texcoords;
+	skyCdf = _skyCdf;
+	textures = _textures;
+	pageTable = _pageTable;
+	vtFeedback = _vtFeedback;
+	blasRoots = _blasRoots;
+	blasFeedback = _blasFeedback;
+	materials = _materials;
+	lights = _lights;
+	pixelMoments = _moments;
+
+	Ray ray = initPrimaryRay( pixel % SCRWIDTH, pixel / SCRWIDTH, camera, settings, seed );
+	ray.lastSpecular = true;
+	ray.pixelIdx = pixel;
+	float4 radiance = ( float4 )( 0 );
+	// the features are written with the radiance, a sample that waits for a BLAS has neither
+	Ray first;
+	bool wait = false;
+	while ( true ) {
+		intersectTLAS( &ray, tlasNodes, blasNodes, bvhNodes, primIdxs );
+		if ( ray.primIdx == DEFERRED ) {
+			wait = true;
+			break;
+		}
+		if ( ray.primIdx == -1 ) {
+			if ( ray.bounces == 0 ) first = ray;
+			radiance += missShading( &ray, settings );
+			break;
+		}
+		intersectionPoint( &ray );
+		Primitive* prim = primitives + ray.primIdx;
+		float* invT = (float*)&blasNodes[ray.instIdx].invT;
+		float4 N = getNormal( prim, ray.I );
+		ray.lod = coneLod( &ray, prim, instanceNormal( invT, N ), instanceScale( invT ) );
+		ray.N = instanceNormal( invT, getShadingNormal( &ray, prim, N ) );
+		if ( dot( ray.N, -ray.D ) < 0 ) ray.N *= -1;
+		if ( ray.bounces == 0 ) first = ray;
+
+		Ray extensionRay = initRay( ( float4 )( 0 ), ( float4 )( 0 ) );
+		extensionRay.bounces = MAX_BOUNCES + 1;
+		float4 color;
+#ifdef SHADING_SIMPLE
+		color = kajiyaShading( &ray, &extensionRay, settings, seed );
+#endif
+#ifdef SHADING_NEE
+		ShadowRay shadowRay;
+		shadowRay.pixelIdx = -1;
+		color = neeShading( &ray, &extensionRay, &shadowRay, settings, seed );
+		if ( shadowRay.pixelIdx != -1 ) {
+			radiance += connectShadowRay( &shadowRay, tlasNodes, blasNodes, bvhNodes, primIdxs, &wait );
+			if ( wait ) break;
+		}
+#endif
 #ifdef FILTER_FIREFLIES
 		if ( dot( color, color ) > 25 ) color = 5 * normalize( color );
 #endif
-		accum[shadowRay.pixelIdx] += color;
+		radiance += color;
+		if ( extensionRay.bounces > MAX_BOUNCES ) break;
+		ray = extensionRay;
 	}
+	// no queue to wait in: the sample is left out, its BLAS is there for a later one
+	if ( wait ) return;
+	// the path is done as it is written, resolve takes it like a wavefront one
+	__global PathState* path = paths + pixel;
+	writeFeatures( &first, path );
+	path->radiance = radiance;
+	path->status = PATH_LIVE;
+	path->pending = 0;
 }
 
 __kernel void focus(
@@ -214,15 +572,115 @@ __kernel void focus(
 	__global uint* primIdxs,
 	__global Primitive* _primitives,
 	__global Settings* settings,
-	Camera camera
+	Camera camera,
+	__global float4* _vertices,
+	__global int* _blasRoots,
+	__global uint* _blasFeedback,
+	__global TriAccel* _triAccels
 )
 {
 	primitives = _primitives;
+	vertices = _vertices;
+	triAccels = _triAccels;
+	blasRoots = _blasRoots;
+	blasFeedback = _blasFeedback;
+	// a BLAS that is not resident is left out, the focus is on what is
 	Ray r = initPrimaryRaySimple( x, y, camera );
-	intersectTLAS( &r, tlasNodes, blasNodes, bvhNodes, primIdxs, false );
+	intersectTLAS( &r, tlasNodes, blasNodes, bvhNodes, primIdxs );
 	settings->focalLength = r.t;
 }
 
+// adaptive sampling: a 16x16 tile stays active until the relative standard error of its worst
+// pixel drops below the threshold; active tiles append their pixels to activePixels
+__kernel void compact( __global float4* moments, __global uint* activePixels, __global Settings* settings )
+{
+	__local float tileError[ADAPTIVE_TILE * ADAPTIVE_TILE];
+	__local uint base;
+	uint lid = get_local_id( 0 ), tile = get_group_id( 0 );
+	uint x = ( tile % ( SCRWIDTH / ADAPTIVE_TILE ) ) * ADAPTIVE_TILE + lid % ADAPTIVE_TILE;
+	uint y = ( tile / ( SCRWIDTH / ADAPTIVE_TILE ) ) * ADAPTIVE_TILE + lid / ADAPTIVE_TILE;
+	uint pixel = x + y * SCRWIDTH;
+	// moments: sum of luminance, sum of squared luminance, sample count, accumulated luminance
+	float4 m = moments[pixel];
+	float n = m.z, error = REALLYFAR;
+	if ( n >= ADAPTIVE_MIN_SAMPLES ) {
+		float mean = m.x / n;
+		float variance = max( 0.f, ( m.y / n - mean * mean ) * n / ( n - 1 ) );
+		error = sqrt( variance / n ) / ( mean + 1e-3f );
+	}
+	tileError[lid] = error;
+	for ( uint s = ADAPTIVE_TILE * ADAPTIVE_TILE / 2; s > 0; s >>= 1 ) {
+		work_group_barrier( CLK_LOCAL_MEM_FENCE );
+		if ( lid < s ) tileError[lid] = max( tileError[lid], tileError[lid + s] );
+	}
+	work_group_barrier( CLK_LOCAL_MEM_FENCE );
+	// the whole work group takes the same branch
+	if ( tileError[0] < settings->adaptiveThreshold ) return;
+	if ( lid == 0 ) base = atomic_add( &( settings->numActive ), ADAPTIVE_TILE * ADAPTIVE_TILE );
+	work_group_barrier( CLK_LOCAL_MEM_FENCE );
+	activePixels[base + lid] = pixel;
+}
+
+// adds the paths that are done to their pixels and folds their samples into the moments, for every
+// pixel: a path that waited for a BLAS may end in a frame its pixel is not active. A path that was
+// left out on the way is not counted, nor is any of its light
+__kernel void resolve( __global float4* accum, __global float4* moments, __global float4* albedo, __global float4* normalDepth,
+	__global float4* positions, __global PathState* paths )
+{
+	int pixel = get_global_id( 0 );
+	__global PathState* path = paths + pixel;
+	if ( path->status == PATH_NONE || path->pending ) return;
+	if ( path->status == PATH_LIVE ) {
+		accum[pixel] += path->radiance;
+		albedo[pixel] += path->albedo;
+		normalDepth[pixel] += path->normalDepth;
+		positions[pixel] = path->position;
+		float4 m = moments[pixel];
+		float sample = luminance( path->radiance );
+		moments[pixel] = ( float4 )( m.x + sample, m.y + sample * sample, m.z + 1, luminance( accum[pixel] ) );
+	}
+	path->status = PATH_NONE;
+}
+
+// temporal reprojection: after a camera move, the first hit of each pixel is projected into the
+// previous camera, and the history accumulated there is kept when its depth and normal agree.
+// History beyond maxHistory samples is scaled down, so the new sample always weighs at least
+// 1 / ( maxHistory + 1 ), more where the history is short
+__kernel void reproject(
+	__global float4* accum,
+	__global float4* moments,
+	__global float4* albedo,
+	__global float4* normalDepth,
+	__global float4* positions,
+	__global float4* prevAccum,
+	__global float4* prevMoments,
+	__global float4* prevAlbedo,
+	__global float4* prevNormalDepth,
+	Camera prev,
+	float maxHistory
+)
+{
+	int idx = get_global_id( 0 );
+	float4 P = positions[idx];
+	int q;
+	if ( P.w == 0 || !projectToCamera( prev, P, &q ) ) return;
+	float4 pm = prevMoments[q], m = moments[idx];
+	if ( pm.z < 1 || m.z < 1 ) return;
+	float4 nd = normalDepth[idx] / m.z;
+	float4 pnd = prevNormalDepth[q] / pm.z;
+	// disocclusion: the previous camera saw another surface there, or the same one from its back
+	if ( fabs( length( P - prev.origin ) - pnd.w ) > 0.05f * pnd.w + prev.aperture ) return;
+	if ( dot( nd.xyz, pnd.xyz ) < 0.9f ) return;
+	float s = min( 1.f, maxHistory / pm.z );
+	accum[idx] += prevAccum[q] * s;
+	albedo[idx] += prevAlbedo[q] * s;
+	m += pm * s;
+	// depth is only meaningful from the current camera
+	normalDepth[idx] = nd * m.z;
+	m.w = luminance( accum[idx] );
+	moments[idx] = m;
+}
+
 __kernel void reset( __global float4* pixels )
 {
 	pixels[get_global_id( 0 )] = ( float4 )( 0 );
@@ -7,28 +7,64 @@ typedef struct Ray
 	float t;
 	// Index of primitive
 	int primIdx, bounces, pixelIdx;
+	int instIdx; // BLAS instance the primitive was hit through
 	bool inside, lastSpecular;
 	float u, v; // barycenter, is calculated upon intersection
+	float pdf; // solid angle pdf of the bsdf sample that produced this ray, for MIS
+	float coneWidth, coneSpread; // ray cone at the origin, for texture level of detail
+	float lod; // footprint of the hit in uv space, see coneLod
 } Ray;
 
+// minimal ray for any-hit occlusion queries
+typedef struct OcclusionRay
+{
+	float4 O, D, rD;
+	float t;
+} OcclusionRay;
+
 typedef struct ShadowRay
 {
 	float4 I, L, Nl, intensity, BRDF;
 	int lightIdx, pixelIdx;
 	float dotNL, dist;
+	float lightPdf, bsdfPdf; // solid angle pdfs of both strategies for this direction, for MIS
 } ShadowRay;
 
+// the path of a pixel's sample, in flight: its light and first hit features are kept here until
+// all of its rays are done, then resolve adds them to the pixel and counts the sample. A path
+// that lost a ray, for want of room in a deferred queue, is left out as a whole
+typedef struct PathState
+{
+	float4 radiance;
+	float4 albedo, normalDepth, position; // see writeFeatures
+	int status; // PATH_NONE, PATH_LIVE or PATH_DROPPED
+	uint pending; // extension and shadow rays traced or waiting for a BLAS
+	int dummy[2];
+} PathState;
+
+// a texture in the shared texel array, idx is -1 when there is none; format is a TEX_ constant,
+// the mip levels follow level 0, each half the size of the previous one. The device reads it
+// through the page table, from the first virtual page of the texture
+typedef struct TexRef
+{
+	int idx, w, h, format, levels;
+	int page;
+} TexRef;
+
 typedef struct Material
 {
 	float4 color, absorption;
 	float specular, n1, n2;
 	bool isDieletric;
 	int texIdx;
-	int texW, texH;
+	int texW, texH, texFormat, texLevels, texPage;
 
 	// Kajiya
 	bool isLight;
-	float4 emittance;
+	float4 emittance; // scales the emissive map when the material is not a light
+
+	// glTF maps; with a metallic-roughness map, specular holds the metallic factor
+	TexRef metalRough, normalMap, emissiveMap;
 } Material;
 
 typedef struct Sphere
@@ -43,13 +79,20 @@ typedef struct Plane
 	float d;
 } Plane;
 
+// indices into the shared vertex and texcoord arrays; the normal follows the winding
 typedef struct Triangle
 {
-	float4 v0, v1, v2;
-	float4 N, centroid;
-	float2 uv0, uv1, uv2;
+	uint v0, v1, v2;
 } Triangle;
 
+// Woop's unit triangle transform, precomputed per primitive and indexed by primIdx: the rows map
+// object space to the space of the triangle, where it spans (0,0,0), (1,0,0) and (0,1,0) and z is
+// the distance along its normal. All zero for other primitives and degenerate triangles
+typedef struct TriAccel
+{
+	float4 m0, m1, m2;
+} TriAccel;
+
 typedef struct Primitive
 {
 	union
@@ -62,8 +105,17 @@ typedef struct Primitive
 	int objType;
 	int matIdx;
 	float area;
+	float lightPdf; // selection probability in the light table, 0 when not a light
 } Primitive;
 
+// one slot of the light alias table: a slot is picked uniformly, then keeps its own
+// light with probability q or falls back to its alias; pdf is the light's selection probability
+typedef struct LightAlias
+{
+	uint primIdx, alias;
+	float q, pdf;
+} LightAlias;
+
 typedef struct Light
 {
 	// Whitted
@@ -88,8 +140,22 @@ typedef struct Settings
 	int numInRays, numOutRays, shadowRays;
 	int renderBVH;
 	float focalLength;
+	// adaptive sampling: only the numActive pixels in activePixels get a sample this frame
+	int adaptive, numActive;
+	float adaptiveThreshold;
+	// temporal reprojection: per pixel sample counts in moments, like adaptive sampling
+	int temporal;
 } Settings;
 
+// reduced on the device from the accumulator, per pixel means
+typedef struct FrameStats
+{
+	float energy; // sum of r + g + b
+	float minLum, maxLum, meanLum;
+	int nanCount, infCount; // pixels left out of everything else
+	int histogram[STATS_BINS]; // log2 luminance
+} FrameStats;
+
 typedef struct BVHNode2
 {
 	float4 aabbMin, aabbMax;
@@ -111,6 +177,6 @@ typedef struct BVHInstance
 typedef struct TLASNode
 {
 	float4 aabbMin, aabbMax;
-	uint leftRight; // 2x16 bits, is leaf when leftRight == 0
-	uint BLASidx;
+	uint left, right; // is leaf when left == 0, the root is nobody's child
+	uint BLASidx, dummy;
 } TLASNode;
@@ -18,9 +18,48 @@
 #define WHITTED			0 
 #define KAJIYA			1
 
+// texel formats, a texel is one 32-bit word in each
+#define TEX_RGBA8		0 // linear, for data such as normal maps
+#define TEX_SRGB8		1 // gamma 2.2 encoded colour, decoded on lookup
+#define TEX_RGB9E5		2 // HDR, three 9-bit mantissas with a shared exponent
+
+// virtual textures: mip levels are cut into pages of VT_TILE x VT_TILE texels, the levels that fit
+// in half a page share a single tail page; the device keeps at most VT_POOL_TILES pages resident
+#define VT_TILE			64
+#define VT_POOL_TILES	16384 // 256MB
+#define VT_MAX_REQUESTS	512 // pages loaded per frame at most
+#define VT_ABSENT		-1 // page table entries that are not a pool tile
+#define VT_REQUESTED	-2
+#define VT_FEEDBACK_USED ( 1 + VT_MAX_REQUESTS ) // feedback: request count, requested pages, then a used flag per pool tile
+
+// BLAS streaming: the nodes and indices of the BLASes the rays reach are kept in pools of at most
+// BLAS_POOL_MB; a ray or shadow ray that passes a BLAS that is not resident waits for it in a deferred queue
+#define BLAS_POOL_MB		512
+#define BLAS_MAX_REQUESTS	64 // BLASes loaded per frame at most
+#define BLAS_ABSENT			-1 // root table entries that are not a node in the pool
+#define BLAS_REQUESTED		-2
+#define BLAS_MISSING		-3 // larger than the pool, traversed as empty
+#define BLAS_FEEDBACK_USED ( 1 + BLAS_MAX_REQUESTS ) // feedback: request count, requested BLASes, then a used flag per BLAS
+#define DEFERRED			-2 // primIdx of a ray that passed a BLAS that is not resident
+#define MAX_DEFERRED		( PIXELS / 4 )
+#define PATH_NONE			0 // PathState status: no sample in flight for the pixel
+#define PATH_LIVE			1
+#define PATH_DROPPED		2
+
 #define INVALID			-1
 #define REALLYFAR		1e30f
 
+#define ADAPTIVE_TILE 16 // tiles of 16x16 pixels converge together
+#define ADAPTIVE_MIN_SAMPLES 16
+
+#define STATS_GROUP 256 // pixels per partial of the frame statistics reduction
+#define STATS_BINS 64 // luminance histogram, 4 bins per stop from 2^-10 up
+#define STATS_BINS_PER_STOP 4
+#define STATS_MIN_LOG2 -10
+
+// frames the host may submit ahead of the device
+#define FRAMES_IN_FLIGHT 2
+
 #define BVH_BINS 8
 #define MIN_LEAF_PRIMS 2
 
@@ -0,0 +1,157 @@
+#include "precomp.h"
+#include "../lib/stb_image_write.h"
+
+FrameExporter::FrameExporter( )
+{
+	for ( int i = 0; i < EXPORT_SLOTS; i++ ) free_.push_back( i );
+	thread_ = std::thread( &FrameExporter::Worker, this );
+}
+FrameExporter::~FrameExporter( )
+{
+	Stop( );
+}
+void FrameExporter::Init( int _width, int _height )
+{
+	width_ = _width, height_ = _height;
+	size_t size = sizeof( float4 ) * _width * _height;
+	for ( Slot& slot : slots_ )
+	{
+		// host allocated memory is page-locked, so readbacks into it are plain dma transfers
+		cl_int error;
+		slot.pinned = clCreateBuffer( Kernel::GetContext( ), CL_MEM_ALLOC_HOST_PTR, size, 0, &error );
+		if ( error != CL_SUCCESS ) FatalError( "FrameExporter: could not allocate staging buffer (%i)", error );
+		slot.pixels = (float4*)clEnqueueMapBuffer( Kernel::GetQueue( ), slot.pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, 0, 0, &error );
+		if ( error != CL_SUCCESS ) FatalError( "FrameExporter: could not map staging buffer (%i)", error );
+	}
+}
+const char* FrameExporter::Extension( ExportFormat _format )
+{
+	switch ( _format )
+	{
+	case ExportFormat::HDR: return ".hdr";
+	case ExportFormat::PFM: return ".pfm";
+	default: return ".png";
+	}
+}
+void FrameExporter::Export( Buffer* _source, const std::string& _file, ExportFormat _format )
+{
+	int idx;
+	{
+		// only waits when the encoder falls EXPORT_SLOTS frames behind
+		std::unique_lock<std::mutex> lock( mutex_ );
+		freed_.wait( lock, [this] { return !free_.empty( ); } );
+		idx = free_.front( );
+		free_.pop_front( );
+	}
+	Slot& slot = slots_[idx];
+	slot.file = _file;
+	slot.format = _format;
+	cl_int error = clEnqueueReadBuffer( Kernel::GetQueue( ), _source->deviceBuffer, CL_FALSE, 0, sizeof( float4 ) * width_ * height_,
+		slot.pixels, 0, 0, &slot.ready );
+	if ( error != CL_SUCCESS )
+	{
+		// no event to wait for: the frame is skipped and the slot goes back
+		printf( "FrameExporter: could not read back %s (%i)\n", _file.c_str( ), error );
+		std::lock_guard<std::mutex> lock( mutex_ );
+		free_.push_back( idx );
+		return;
+	}
+	// make sure the read gets submitted, the worker only waits for it
+	clFlush( Kernel::GetQueue( ) );
+	{
+		std::lock_guard<std::mutex> lock( mutex_ );
+		queue_.push_back( idx );
+	}
+	signal_.notify_one( );
+}
+bool FrameExporter::Busy( )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+	return free_.size( ) < EXPORT_SLOTS;
+}
+void FrameExporter::Stop( )
+{
+	{
+		std::lock_guard<std::mutex> lock( mutex_ );
+		running_ = false;
+	}
+	signal_.notify_one( );
+	// frames already queued are still written
+	if ( thread_.joinable( ) ) thread_.join( );
+	for ( Slot& slot : slots_ )
+	{
+		if ( !slot.pinned ) continue;
+		clEnqueueUnmapMemObject( Kernel::GetQueue( ), slot.pinned, slot.pixels, 0, 0, 0 );
+		clFinish( Kernel::GetQueue( ) );
+		clReleaseMemObject( slot.pinned );
+		slot.pinned = 0, slot.pixels = 0;
+	}
+}
+void FrameExporter::Worker( )
+{
+	while ( true )
+	{
+		int idx;
+		{
+			std::unique_lock<std::mutex> lock( mutex_ );
+			signal_.wait( lock, [this] { return !running_ || !queue_.empty( ); } );
+			if ( queue_.empty( ) ) return;
+			idx = queue_.front( );
+			queue_.pop_front( );
+		}
+		Slot& slot = slots_[idx];
+		clWaitForEvents( 1, &slot.ready );
+		clReleaseEvent( slot.ready );
+		Encode( slot );
+		{
+			std::lock_guard<std::mutex> lock( mutex_ );
+			free_.push_back( idx );
+		}
+		freed_.notify_one( );
+	}
+}
+void FrameExporter::Encode( const Slot& _slot )
+{
+	int s = width_ * height_;
+	switch ( _slot.format )
+	{
+	case ExportFormat::PNG:
+	{
+		// clamped to [0,1] before the cast, NaN fails the comparison and becomes 0
+		auto quantize = []( float v ) { return (uchar)(v > 0 ? std::min( v, 1.f ) * 255 : 0); };
+		std::vector<uchar> img( 3 * s );
+		for ( int i = 0; i < s; i++ )
+		{
+			img[3 * i + 0] = quantize( _slot.pixels[i].x );
+			img[3 * i + 1] = quantize( _slot.pixels[i].y );
+			img[3 * i + 2] = quantize( _slot.pixels[i].z );
+		}
+		stbi_write_png( _slot.file.c_str( ), width_, height_, 3, img.data( ), 0 );
+	}
+	break;
+	case ExportFormat::HDR:
+	{
+		std::vector<float> img( 3 * s );
+		for ( int i = 0; i < s; i++ )
+			img[3 * i + 0] = _slot.pixels[i].x, img[3 * i + 1] = _slot.pixels[i].y, img[3 * i + 2] = _slot.pixels[i].z;
+		stbi_write_hdr( _slot.file.c_str( ), width_, height_, 3, img.data( ) );
+	}
+	break;
+	case ExportFormat::PFM:
+	{
+		// little endian (negative scale), rows stored bottom to top
+		FILE* f = fopen( _slot.file.c_str( ), "wb" );
+		if ( !f ) return;
+		fprintf( f, "PF\n%i %i\n-1.0\n", width_, height_ );
+		std::vector<float> row( 3 * width_ );
+		for ( int y = height_ - 1; y >= 0; y-- )
+		{
+			const float4* src = _slot.pixels + y * width_;
+			for ( int x = 0; x < width_; x++ ) row[3 * x + 0] = src[x].x, row[3 * x + 1] = src[x].y, row[3 * x + 2] = src[x].z;
+			fwrite( row.data( ), sizeof( float ), row.size( ), f );
+		}
+		fclose( f );
+	}
+	break;
+	}
+}
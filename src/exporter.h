@@ -0,0 +1,39 @@
+#pragma once
+enum class ExportFormat
+{
+	PNG, // 8 bit, clamped
+	HDR, // Radiance RGBE
+	PFM // raw 32 bit float
+};
+#define EXPORT_SLOTS 4 // frames that can be in flight between readback and disk
+// saves frames without stalling the render loop: the device copies into a ring of pinned
+// staging buffers with a non-blocking read, a worker thread waits for it and encodes the file
+class FrameExporter
+{
+public:
+	FrameExporter( );
+	~FrameExporter( );
+	void Init( int width, int height );
+	void Export( Buffer* source, const std::string& file, ExportFormat format );
+	bool Busy( );
+	void Stop( );
+	static const char* Extension( ExportFormat format );
+private:
+	struct Slot
+	{
+		cl_mem pinned = 0;
+		float4* pixels = 0; // mapped once, stays valid for the lifetime of the slot
+		cl_event ready = 0;
+		std::string file;
+		ExportFormat format;
+	};
+	void Worker( );
+	void Encode( const Slot& slot );
+	int width_ = 0, height_ = 0;
+	Slot slots_[EXPORT_SLOTS];
+	std::deque<int> free_, queue_;
+	std::thread thread_;
+	std::mutex mutex_;
+	std::condition_variable signal_, freed_;
+	bool running_ = true;
+};
@@ -0,0 +1,369 @@
+#include "precomp.h"
+namespace Tmpl8
+{
+	// just enough JSON for glTF: objects keep their keys in order, missing members read as null
+	struct Json
+	{
+		enum Type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT } type = NUL;
+		double number = 0;
+		std::string string;
+		std::vector<std::string> keys; // object members, parallel to items
+		std::vector<Json> items; // array elements or object values
+		static const Json& Null( ) { static Json null; return null; }
+		const Json& operator[]( size_t i ) const { return i < items.size( ) ? items[i] : Null( ); }
+		const Json& operator[]( int i ) const { return ( *this )[(size_t)i]; } // a literal 0 would also match a key
+		const Json& operator[]( const char* key ) const
+		{
+			for ( size_t i = 0; i < keys.size( ); i++ ) if ( keys[i] == key ) return items[i];
+			return Null( );
+		}
+		bool Has( const char* key ) const { return &( *this )[key] != &Null( ); }
+		size_t Size( ) const { return type == ARRAY ? items.size( ) : 0; }
+		double Number( double fallback ) const { return type == NUMBER ? number : fallback; }
+		int Int( int fallback = -1 ) const { return type == NUMBER ? (int)number : fallback; }
+	};
+
+	class JsonParser
+	{
+	public:
+		JsonParser( const char* data, size_t size ) : p_( data ), end_( data + size ) {}
+		bool Parse( Json& value )
+		{
+			if ( !Value( value, 0 ) ) return false;
+			Skip( );
+			return p_ == end_;
+		}
+	private:
+		void Skip( ) { while ( p_ < end_ && ( *p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r' ) ) p_++; }
+		bool Literal( const char* word )
+		{
+			size_t length = strlen( word );
+			if ( (size_t)( end_ - p_ ) < length || memcmp( p_, word, length ) ) return false;
+			p_ += length;
+			return true;
+		}
+		static void AppendUtf8( std::string& s, uint c )
+		{
+			if ( c < 0x80 ) s += (char)c;
+			else if ( c < 0x800 ) s += (char)( 0xc0 | c >> 6 ), s += (char)( 0x80 | ( c & 0x3f ) );
+			else s += (char)( 0xe0 | c >> 12 ), s += (char)( 0x80 | ( ( c >> 6 ) & 0x3f ) ), s += (char)( 0x80 | ( c & 0x3f ) );
+		}
+		bool String( std::string& s )
+		{
+			if ( p_ == end_ || *p_ != '"' ) return false;
+			for ( p_++; p_ < end_ && *p_ != '"'; p_++ ) {
+				if ( *p_ != '\\' ) { s += *p_; continue; }
+				if ( ++p_ == end_ ) return false;
+				switch ( *p_ ) {
+					case 'b': s += '\b'; break;
+					case 'f': s += '\f'; break;
+					case 'n': s += '\n'; break;
+					case 'r': s += '\r'; break;
+					case 't': s += '\t'; break;
+					case 'u':
+					{
+						uint c = 0;
+						if ( end_ - p_ < 5 || std::from_chars( p_ + 1, p_ + 5, c, 16 ).ptr != p_ + 5 ) return false;
+						AppendUtf8( s, c ); // surrogate pairs are not joined, names and uris do not need them
+						p_ += 4;
+					} break;
+					default: s += *p_; break;
+				}
+			}
+			if ( p_ == end_ ) return false;
+			p_++;
+			return true;
+		}
+		bool Value( Json& value, int depth )
+		{
+			Skip( );
+			if ( p_ == end_ || depth > 64 ) return false;
+			switch ( *p_ ) {
+				case '{':
+					value.type = Json::OBJECT;
+					for ( p_++, Skip( ); p_ < end_ && *p_ != '}'; ) {
+						value.keys.emplace_back( );
+						value.items.emplace_back( );
+						if ( !String( value.keys.back( ) ) ) return false;
+						Skip( );
+						if ( p_ == end_ || *p_++ != ':' ) return false;
+						if ( !Value( value.items.back( ), depth + 1 ) ) return false;
+						Skip( );
+						if ( p_ < end_ && *p_ == ',' ) p_++, Skip( );
+					}
+					if ( p_ == end_ ) return false;
+					p_++;
+					return true;
+				case '[':
+					value.type = Json::ARRAY;
+					for ( p_++, Skip( ); p_ < end_ && *p_ != ']'; ) {
+						value.items.emplace_back( );
+						if ( !Value( value.items.back( ), depth + 1 ) ) return false;
+						Skip( );
+						if ( p_ < end_ && *p_ == ',' ) p_++, Skip( );
+					}
+					if ( p_ == end_ ) return false;
+					p_++;
+					return true;
+				case '"': value.type = Json::STRING; return String( value.string );
+				case 't': value.type = Json::BOOL, value.number = 1; return Literal( "true" );
+				case 'f': value.type = Json::BOOL; return Literal( "false" );
+				case 'n': return Literal( "null" );
+				default:
+				{
+					value.type = Json::NUMBER;
+					auto result = std::from_chars( p_, end_, value.number );
+					if ( result.ptr == p_ ) return false;
+					p_ = result.ptr;
+					return true;
+				}
+			}
+		}
+		const char* p_, * end_;
+	};
+
+	// a bufferView resolved to memory
+	struct GltfView
+	{
+		const uchar* data = 0;
+		size_t size = 0;
+		int stride = 0;
+	};
+
+	enum { GLTF_BYTE = 5121, GLTF_SHORT = 5123, GLTF_UINT = 5125, GLTF_FLOAT = 5126, GLTF_TRIANGLES = 4 };
+	static const uint GLB_MAGIC = 0x46546c67, GLB_JSON = 0x4e4f534a, GLB_BIN = 0x004e4942;
+
+	uint GltfAccessor::Index( int i ) const
+	{
+		const uchar* e = data + (size_t)i * stride;
+		switch ( componentType ) {
+			case GLTF_BYTE: return *e;
+			case GLTF_SHORT: return *(const ushort*)e;
+			default: return *(const uint*)e;
+		}
+	}
+
+	static int ComponentSize( int componentType )
+	{
+		switch ( componentType ) {
+			case GLTF_BYTE: case 5120: return 1;
+			case GLTF_SHORT: case 5122: return 2;
+			case GLTF_UINT: case GLTF_FLOAT: return 4;
+		}
+		return 0;
+	}
+	static int Components( const std::string& type )
+	{
+		if ( type == "SCALAR" ) return 1;
+		if ( type == "VEC2" ) return 2;
+		if ( type == "VEC3" ) return 3;
+		if ( type == "VEC4" || type == "MAT2" ) return 4;
+		if ( type == "MAT3" ) return 9;
+		if ( type == "MAT4" ) return 16;
+		return 0;
+	}
+	// uris are relative to the gltf file and may be percent-encoded
+	static std::string ResolveUri( const std::string& baseDir, const std::string& uri )
+	{
+		std::string path = baseDir;
+		for ( size_t i = 0; i < uri.size( ); i++ ) {
+			uint c;
+			if ( uri[i] == '%' && i + 2 < uri.size( ) && std::from_chars( &uri[i + 1], &uri[i + 3], c, 16 ).ptr == &uri[i + 3] )
+				path += (char)c, i += 2;
+			else path += uri[i];
+		}
+		return path;
+	}
+	static bool ReadAccessor( const Json& json, int idx, const std::vector<GltfView>& views, GltfAccessor& accessor )
+	{
+		const Json& a = json["accessors"][idx];
+		if ( a.type != Json::OBJECT ) return false;
+		if ( a.Has( "sparse" ) ) {
+			printf( "W/LoadGltf: sparse accessors are not supported\n" );
+			return false;
+		}
+		int view = a["bufferView"].Int( );
+		if ( view < 0 || view >= (int)views.size( ) ) return false;
+		accessor.componentType = a["componentType"].Int( 0 );
+		accessor.components = Components( a["type"].string );
+		accessor.count = a["count"].Int( 0 );
+		int elementSize = ComponentSize( accessor.componentType ) * accessor.components;
+		accessor.stride = views[view].stride ? views[view].stride : elementSize;
+		size_t offset = (size_t)a["byteOffset"].Int( 0 );
+		if ( elementSize == 0 || accessor.count <= 0 ) return false;
+		if ( offset + (size_t)( accessor.count - 1 ) * accessor.stride + elementSize > views[view].size ) return false;
+		accessor.data = views[view].data + offset;
+		return true;
+	}
+	static std::string ImagePath( const Json& json, const Json& textureInfo, const std::string& baseDir )
+	{
+		int texture = textureInfo["index"].Int( );
+		if ( texture < 0 ) return "";
+		const Json& image = json["images"][json["textures"][texture]["source"].Int( 0 )];
+		if ( image["uri"].type != Json::STRING || image["uri"].string.compare( 0, 5, "data:" ) == 0 ) {
+			printf( "W/LoadGltf: only images in files are supported\n" );
+			return "";
+		}
+		return ResolveUri( baseDir, image["uri"].string );
+	}
+	static mat4 NodeTransform( const Json& node )
+	{
+		mat4 M;
+		if ( node["matrix"].Size( ) == 16 ) {
+			for ( int i = 0; i < 16; i++ ) M.cell[i] = (float)node["matrix"][i].Number( 0 );
+			return mat4::FromColumnMajor( M );
+		}
+		const Json& t = node["translation"], & r = node["rotation"], & s = node["scale"];
+		float x = (float)r[0].Number( 0 ), y = (float)r[1].Number( 0 ), z = (float)r[2].Number( 0 ), w = (float)r[3].Number( 1 );
+		mat4 R;
+		R.cell[0] = 1 - 2 * ( y * y + z * z ), R.cell[1] = 2 * ( x * y - z * w ), R.cell[2] = 2 * ( x * z + y * w );
+		R.cell[4] = 2 * ( x * y + z * w ), R.cell[5] = 1 - 2 * ( x * x + z * z ), R.cell[6] = 2 * ( y * z - x * w );
+		R.cell[8] = 2 * ( x * z - y * w ), R.cell[9] = 2 * ( y * z + x * w ), R.cell[10] = 1 - 2 * ( x * x + y * y );
+		float3 T( (float)t[0].Number( 0 ), (float)t[1].Number( 0 ), (float)t[2].Number( 0 ) );
+		float3 S( (float)s[0].Number( 1 ), (float)s[1].Number( 1 ), (float)s[2].Number( 1 ) );
+		return mat4::Translate( T ) * R * mat4::Scale( S );
+	}
+
+	bool LoadGltf( const std::string& _file, GltfModel& _model )
+	{
+		std::string baseDir = util::GetBaseDir( _file );
+		auto file = std::make_unique<MappedFile>( _file );
+		if ( !file->data ) return false;
+		// a .glb holds the json and the first buffer in chunks of one file
+		const char* text = (const char*)file->data;
+		size_t textSize = file->size;
+		const uchar* glbBuffer = 0;
+		size_t glbBufferSize = 0;
+		if ( file->size >= 20 && *(const uint*)file->data == GLB_MAGIC ) {
+			const uint* chunk = (const uint*)( file->data + 12 );
+			if ( chunk[1] != GLB_JSON || 20 + (size_t)chunk[0] > file->size ) return false;
+			text = (const char*)( chunk + 2 ), textSize = chunk[0];
+			size_t next = 20 + ( ( (size_t)chunk[0] + 3 ) & ~(size_t)3 );
+			if ( next + 8 <= file->size ) {
+				chunk = (const uint*)( file->data + next );
+				if ( chunk[1] == GLB_BIN && next + 8 + chunk[0] <= file->size ) glbBuffer = (const uchar*)( chunk + 2 ), glbBufferSize = chunk[0];
+			}
+		}
+		Json json;
+		if ( !JsonParser( text, textSize ).Parse( json ) ) {
+			printf( "E/LoadGltf: %s is not valid json\n", _file.c_str( ) );
+			return false;
+		}
+		_model.buffers.push_back( std::move( file ) );
+		// buffers and views
+		std::vector<GltfView> buffers, views;
+		for ( size_t i = 0; i < json["buffers"].Size( ); i++ ) {
+			const Json& buffer = json["buffers"][i];
+			GltfView view;
+			if ( !buffer.Has( "uri" ) ) view.data = glbBuffer, view.size = glbBufferSize;
+			else if ( buffer["uri"].string.compare( 0, 5, "data:" ) == 0 ) {
+				printf( "E/LoadGltf: embedded base64 buffers are not supported, use a .bin or .glb\n" );
+				return false;
+			} else {
+				std::string path = ResolveUri( baseDir, buffer["uri"].string );
+				auto mapped = std::make_unique<MappedFile>( path );
+				view.data = mapped->data, view.size = mapped->size;
+				_model.files.push_back( path );
+				_model.buffers.push_back( std::move( mapped ) );
+			}
+			if ( !view.data || view.size < (size_t)buffer["byteLength"].Number( 0 ) ) {
+				printf( "E/LoadGltf: buffer %i of %s is missing or too short\n", (int)i, _file.c_str( ) );
+				return false;
+			}
+			buffers.push_back( view );
+		}
+		for ( size_t i = 0; i < json["bufferViews"].Size( ); i++ ) {
+			const Json& bufferView = json["bufferViews"][i];
+			int buffer = bufferView["buffer"].Int( );
+			size_t offset = (size_t)bufferView["byteOffset"].Number( 0 ), size = (size_t)bufferView["byteLength"].Number( 0 );
+			GltfView view;
+			if ( buffer >= 0 && buffer < (int)buffers.size( ) && offset + size <= buffers[buffer].size )
+				view.data = buffers[buffer].data + offset, view.size = size;
+			view.stride = bufferView["byteStride"].Int( 0 );
+			views.push_back( view );
+		}
+		// meshes, triangle lists with float positions and texcoords
+		for ( size_t i = 0; i < json["meshes"].Size( ); i++ ) {
+			GltfMesh mesh;
+			const Json& primitives = json["meshes"][i]["primitives"];
+			for ( size_t j = 0; j < primitives.Size( ); j++ ) {
+				const Json& p = primitives[j];
+				GltfPrimitive prim;
+				prim.material = p["material"].Int( );
+				if ( p["mode"].Int( GLTF_TRIANGLES ) != GLTF_TRIANGLES ) {
+					printf( "W/LoadGltf: skipping a primitive that is not a triangle list\n" );
+					continue;
+				}
+				const Json& attributes = p["attributes"];
+				if ( !ReadAccessor( json, attributes["POSITION"].Int( ), views, prim.positions ) ||
+					prim.positions.componentType != GLTF_FLOAT || prim.positions.components != 3 ) {
+					printf( "W/LoadGltf: skipping a primitive without float positions\n" );
+					continue;
+				}
+				if ( attributes.Has( "TEXCOORD_0" ) && ( !ReadAccessor( json, attributes["TEXCOORD_0"].Int( ), views, prim.texcoords ) ||
+					prim.texcoords.componentType != GLTF_FLOAT || prim.texcoords.count != prim.positions.count ) ) {
+					printf( "W/LoadGltf: ignoring texcoords that are not floats\n" );
+					prim.texcoords = GltfAccessor( );
+				}
+				if ( p.Has( "indices" ) ) {
+					if ( !ReadAccessor( json, p["indices"].Int( ), views, prim.indices ) || prim.indices.components != 1 ||
+						( prim.indices.componentType != GLTF_BYTE && prim.indices.componentType != GLTF_SHORT && prim.indices.componentType != GLTF_UINT ) ) {
+						printf( "W/LoadGltf: skipping a primitive with unreadable indices\n" );
+						continue;
+					}
+					// out of range indices would read past the positions
+					bool valid = true;
+					for ( int k = 0; k < prim.indices.count && valid; k++ ) valid = prim.indices.Index( k ) < (uint)prim.positions.count;
+					if ( !valid ) {
+						printf( "W/LoadGltf: skipping a primitive with out of range indices\n" );
+						continue;
+					}
+				}
+				mesh.primitives.push_back( prim );
+			}
+			_model.meshes.push_back( mesh );
+		}
+		// materials
+		for ( size_t i = 0; i < json["materials"].Size( ); i++ ) {
+			const Json& m = json["materials"][i];
+			const Json& pbr = m["pbrMetallicRoughness"];
+			GltfMaterial mat;
+			mat.name = m["name"].type == Json::STRING ? m["name"].string : std::to_string( i );
+			const Json& color = pbr["baseColorFactor"];
+			mat.baseColor = float4( (float)color[0].Number( 1 ), (float)color[1].Number( 1 ), (float)color[2].Number( 1 ), (float)color[3].Number( 1 ) );
+			mat.metallic = (float)pbr["metallicFactor"].Number( 1 );
+			mat.roughness = (float)pbr["roughnessFactor"].Number( 1 );
+			const Json& emissive = m["emissiveFactor"];
+			mat.emissive = float3( (float)emissive[0].Number( 0 ), (float)emissive[1].Number( 0 ), (float)emissive[2].Number( 0 ) );
+			mat.transmission = (float)m["extensions"]["KHR_materials_transmission"]["transmissionFactor"].Number( 0 );
+			mat.baseColorMap = ImagePath( json, pbr["baseColorTexture"], baseDir );
+			mat.metalRoughMap = ImagePath( json, pbr["metallicRoughnessTexture"], baseDir );
+			mat.normalMap = ImagePath( json, m["normalTexture"], baseDir );
+			mat.emissiveMap = ImagePath( json, m["emissiveTexture"], baseDir );
+			_model.materials.push_back( mat );
+		}
+		// flatten the node hierarchy of the default scene
+		const Json& nodes = json["nodes"];
+		std::vector<int> roots;
+		const Json& scene = json["scenes"][json["scene"].Int( 0 )];
+		for ( size_t i = 0; i < scene["nodes"].Size( ); i++ ) roots.push_back( scene["nodes"][i].Int( ) );
+		std::stack<std::pair<int, mat4>> stack;
+		for ( int root : roots ) stack.push( { root, mat4( ) } );
+		int visited = 0;
+		while ( !stack.empty( ) ) {
+			auto [idx, parent] = stack.top( );
+			stack.pop( );
+			// a valid hierarchy is a forest, so more visits than nodes means a cycle
+			if ( idx < 0 || idx >= (int)nodes.Size( ) || ++visited > (int)nodes.Size( ) ) {
+				printf( "E/LoadGltf: %s has an invalid node hierarchy\n", _file.c_str( ) );
+				return false;
+			}
+			const Json& node = nodes[idx];
+			mat4 transform = parent * NodeTransform( node );
+			int mesh = node["mesh"].Int( );
+			if ( mesh >= 0 && mesh < (int)_model.meshes.size( ) ) _model.instances.push_back( { mesh, transform } );
+			for ( size_t i = 0; i < node["children"].Size( ); i++ ) stack.push( { node["children"][i].Int( ), transform } );
+		}
+		return true;
+	}
+} // namespace Tmpl8
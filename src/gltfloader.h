@@ -0,0 +1,48 @@
+#pragma once
+namespace Tmpl8
+{
+// typed view of a glTF accessor, pointing straight into a mapped buffer
+struct GltfAccessor
+{
+	const uchar* data = 0;
+	int count = 0, stride = 0, componentType = 0, components = 0;
+	float3 Float3( int i ) const { const float* f = (const float*)( data + (size_t)i * stride ); return float3( f[0], f[1], f[2] ); }
+	float2 Float2( int i ) const { const float* f = (const float*)( data + (size_t)i * stride ); return float2( f[0], f[1] ); }
+	uint Index( int i ) const;
+};
+struct GltfPrimitive
+{
+	GltfAccessor positions, texcoords, indices; // texcoords and indices may be empty
+	int material = -1;
+};
+struct GltfMesh
+{
+	std::vector<GltfPrimitive> primitives;
+};
+// a node with a mesh, transform is object to world
+struct GltfInstance
+{
+	int mesh;
+	mat4 transform;
+};
+// image paths are empty when the material does not have that map
+struct GltfMaterial
+{
+	std::string name;
+	float4 baseColor = float4( 1 );
+	float metallic = 1, roughness = 1, transmission = 0;
+	float3 emissive = float3( 0 );
+	std::string baseColorMap, metalRoughMap, normalMap, emissiveMap;
+};
+struct GltfModel
+{
+	std::vector<GltfMesh> meshes;
+	std::vector<GltfInstance> instances; // every node of the default scene that has a mesh
+	std::vector<GltfMaterial> materials;
+	std::vector<std::string> files; // buffers that were read, images are up to the caller
+	std::vector<std::unique_ptr<MappedFile>> buffers; // keeps the accessors valid
+};
+// reads a .gltf with external buffers or a .glb; buffers are mapped, not copied, and the
+// node hierarchy is flattened into instances; returns false when the file cannot be used
+bool LoadGltf( const std::string& file, GltfModel& model );
+} // namespace Tmpl8
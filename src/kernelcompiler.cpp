@@ -0,0 +1,183 @@
+#include "precomp.h"
+
+KernelCompiler::KernelCompiler( )
+{
+	thread_ = std::thread( &KernelCompiler::Worker, this );
+}
+KernelCompiler::~KernelCompiler( )
+{
+	Stop( );
+}
+std::string KernelCompiler::Key( const std::vector<std::string>& _defines )
+{
+	std::vector<std::string> sorted = _defines;
+	std::sort( sorted.begin( ), sorted.end( ) );
+	std::string key;
+	for ( const auto& define : sorted ) key += define + ";";
+	return key;
+}
+std::string KernelCompiler::Key( const char* _file, const char* _entryPoint, const std::vector<std::string>& _defines )
+{
+	return std::string( _file ) + ":" + _entryPoint + ";" + Key( _defines );
+}
+void KernelCompiler::Release( WavefrontKernels* _kernels )
+{
+	if ( !_kernels ) return;
+	// kernels still in flight keep the program alive until they are done
+	delete _kernels->reset;
+	delete _kernels->generate;
+	delete _kernels->resume;
+	delete _kernels->extend;
+	delete _kernels->shade;
+	delete _kernels->connect;
+	delete _kernels->reconnect;
+	delete _kernels->focus;
+	delete _kernels->render;
+	delete _kernels->compact;
+	delete _kernels->resolve;
+	delete _kernels->reproject;
+	if ( _kernels->program ) clReleaseProgram( _kernels->program );
+	delete _kernels;
+}
+WavefrontKernels* KernelCompiler::Compile( const std::vector<std::string>& _defines, std::string* _error )
+{
+	Timer t;
+	WavefrontKernels* kernels = new WavefrontKernels( );
+	// build the program once, the other entry points reuse it; an error in the source is reported
+	// rather than fatal, the renderer keeps the kernels it has
+	std::string error;
+	kernels->generate = new Kernel( "src/cl/wavefront.cl", "generate", _defines, &error );
+	if ( !kernels->generate->kernel )
+	{
+		printf( "Failed to compile wavefront kernels [%s]:\n%s\n", Key( _defines ).c_str( ), error.c_str( ) );
+		if ( _error ) *_error = error;
+		Release( kernels );
+		return 0;
+	}
+	kernels->program = kernels->generate->GetProgram( );
+	kernels->reset = new Kernel( kernels->program, "reset" );
+	kernels->resume = new Kernel( kernels->program, "resume" );
+	kernels->extend = new Kernel( kernels->program, "extend" );
+	kernels->shade = new Kernel( kernels->program, "shade" );
+	kernels->connect = new Kernel( kernels->program, "connect" );
+	kernels->reconnect = new Kernel( kernels->program, "reconnect" );
+	kernels->focus = new Kernel( kernels->program, "focus" );
+	kernels->render = new Kernel( kernels->program, "render" );
+	kernels->compact = new Kernel( kernels->program, "compact" );
+	kernels->resolve = new Kernel( kernels->program, "resolve" );
+	kernels->reproject = new Kernel( kernels->program, "reproject" );
+	printf( "Compiled wavefront kernels [%s] in %.2fs\n", Key( _defines ).c_str( ), t.elapsed( ) );
+	return kernels;
+}
+Kernel* KernelCompiler::Build( char* _file, char* _entryPoint, const std::vector<std::string>& _defines )
+{
+	// a single kernel, compiled on the calling thread next to the worker
+	return new Kernel( _file, _entryPoint, _defines );
+}
+void KernelCompiler::Request( const std::vector<std::string>& _defines )
+{
+	Enqueue( Key( _defines ), { "", "", _defines } );
+}
+void KernelCompiler::Request( const char* _file, const char* _entryPoint, const std::vector<std::string>& _defines )
+{
+	Enqueue( Key( _file, _entryPoint, _defines ), { _file, _entryPoint, _defines } );
+}
+void KernelCompiler::Enqueue( const std::string& _key, const Job& _job )
+{
+	{
+		std::lock_guard<std::mutex> lock( mutex_ );
+		if ( pending_.count( _key ) || ready_.count( _key ) || readyKernels_.count( _key ) ) return;
+		failed_.erase( _key );
+		pending_.insert( _key );
+		queue_.push_back( _job );
+	}
+	signal_.notify_one( );
+}
+WavefrontKernels* KernelCompiler::Acquire( const std::string& _key )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+	auto it = ready_.find( _key );
+	if ( it == ready_.end( ) ) return 0;
+	WavefrontKernels* kernels = it->second;
+	ready_.erase( it );
+	return kernels;
+}
+Kernel* KernelCompiler::AcquireKernel( const std::string& _key )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+	auto it = readyKernels_.find( _key );
+	if ( it == readyKernels_.end( ) ) return 0;
+	Kernel* kernel = it->second;
+	readyKernels_.erase( it );
+	return kernel;
+}
+bool KernelCompiler::Failed( const std::string& _key, std::string& _error )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+	auto it = failed_.find( _key );
+	if ( it == failed_.end( ) ) return false;
+	_error = it->second;
+	failed_.erase( it );
+	return true;
+}
+void KernelCompiler::Store( const std::string& _key, WavefrontKernels* _kernels )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+	if ( ready_.count( _key ) ) Release( _kernels );
+	else ready_[_key] = _kernels;
+}
+bool KernelCompiler::Busy( )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+	return !pending_.empty( );
+}
+void KernelCompiler::Stop( )
+{
+	{
+		std::lock_guard<std::mutex> lock( mutex_ );
+		running_ = false;
+		queue_.clear( );
+	}
+	signal_.notify_one( );
+	if ( thread_.joinable( ) ) thread_.join( );
+	for ( auto& pair : ready_ ) Release( pair.second );
+	ready_.clear( );
+	for ( auto& pair : readyKernels_ ) delete pair.second;
+	readyKernels_.clear( );
+}
+void KernelCompiler::Worker( )
+{
+	while ( true ) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock( mutex_ );
+			signal_.wait( lock, [this] { return !running_ || !queue_.empty( ); } );
+			if ( !running_ ) return;
+			job = queue_.front( );
+			queue_.pop_front( );
+		}
+		std::string error;
+		if ( !job.file.empty( ) )
+		{
+			std::string key = Key( job.file.c_str( ), job.entryPoint.c_str( ), job.defines );
+			Kernel* kernel = new Kernel( (char*)job.file.c_str( ), (char*)job.entryPoint.c_str( ), job.defines, &error );
+			if ( !kernel->kernel )
+			{
+				printf( "Failed to compile %s [%s]:\n%s\n", job.entryPoint.c_str( ), Key( job.defines ).c_str( ), error.c_str( ) );
+				delete kernel;
+				kernel = 0;
+			}
+			std::lock_guard<std::mutex> lock( mutex_ );
+			pending_.erase( key );
+			if ( kernel ) readyKernels_[key] = kernel;
+			else failed_[key] = error;
+			continue;
+		}
+		WavefrontKernels* kernels = Compile( job.defines, &error );
+		std::string key = Key( job.defines );
+		std::lock_guard<std::mutex> lock( mutex_ );
+		pending_.erase( key );
+		if ( kernels ) ready_[key] = kernels;
+		else failed_[key] = error;
+	}
+}
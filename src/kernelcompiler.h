@@ -0,0 +1,52 @@
+#pragma once
+// all wavefront kernels of one define combination, sharing a single cl_program
+struct WavefrontKernels
+{
+	cl_program program = 0;
+	Kernel* reset = 0, * generate = 0, * resume = 0, * extend = 0, * shade = 0, * connect = 0, * reconnect = 0, * focus = 0;
+	Kernel* render = 0; // megakernel
+	Kernel* compact = 0, * resolve = 0; // adaptive sampling
+	Kernel* reproject = 0; // temporal reprojection
+};
+// compiles wavefront kernel variants on a background thread, so the renderer
+// can keep using the current variant until the new one is ready to be swapped in
+class KernelCompiler
+{
+public:
+	KernelCompiler( );
+	~KernelCompiler( );
+	static std::string Key( const std::vector<std::string>& defines );
+	static std::string Key( const char* file, const char* entryPoint, const std::vector<std::string>& defines );
+	static void Release( WavefrontKernels* kernels );
+	// 0 when the source does not build, error then holds the build error
+	WavefrontKernels* Compile( const std::vector<std::string>& defines, std::string* error = 0 );
+	Kernel* Build( char* file, char* entryPoint, const std::vector<std::string>& defines );
+	void Request( const std::vector<std::string>& defines );
+	WavefrontKernels* Acquire( const std::string& key );
+	// a single kernel built on the worker, 0 from AcquireKernel until it is ready
+	void Request( const char* file, const char* entryPoint, const std::vector<std::string>& defines );
+	Kernel* AcquireKernel( const std::string& key );
+	// whether the background build of a variant failed, with the build error, once
+	bool Failed( const std::string& key, std::string& error );
+	void Store( const std::string& key, WavefrontKernels* kernels );
+	bool Busy( );
+	void Stop( );
+private:
+	// the wavefront kernels of a define combination, or a single kernel when file is set
+	struct Job
+	{
+		std::string file, entryPoint;
+		std::vector<std::string> defines;
+	};
+	void Worker( );
+	void Enqueue( const std::string& key, const Job& job );
+	std::thread thread_;
+	std::mutex mutex_;
+	std::condition_variable signal_;
+	std::deque<Job> queue_;
+	std::set<std::string> pending_;
+	std::map<std::string, WavefrontKernels*> ready_;
+	std::map<std::string, Kernel*> readyKernels_;
+	std::map<std::string, std::string> failed_; // build errors
+	bool running_ = true;
+};
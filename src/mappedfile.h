@@ -0,0 +1,61 @@
+#pragma once
+#ifdef _WIN32
+#include <fileapi.h>
+#include <handleapi.h>
+#include <memoryapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Tmpl8
+{
+	// read-only memory mapping of a whole file; data is 0 when it could not be opened
+	class MappedFile
+	{
+	public:
+		MappedFile( const std::string& _file )
+		{
+#ifdef _WIN32
+			file_ = CreateFileA( _file.c_str( ), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0 );
+			if ( file_ == INVALID_HANDLE_VALUE ) return;
+			LARGE_INTEGER fileSize;
+			GetFileSizeEx( file_, &fileSize );
+			size = (size_t)fileSize.QuadPart;
+			if ( size == 0 ) return;
+			mapping_ = CreateFileMappingA( file_, 0, PAGE_READONLY, 0, 0, 0 );
+			if ( mapping_ ) data = (const uchar*)MapViewOfFile( mapping_, FILE_MAP_READ, 0, 0, 0 );
+#else
+			fd_ = open( _file.c_str( ), O_RDONLY );
+			if ( fd_ < 0 ) return;
+			struct stat st;
+			fstat( fd_, &st );
+			size = (size_t)st.st_size;
+			if ( size == 0 ) return;
+			void* view = mmap( 0, size, PROT_READ, MAP_PRIVATE, fd_, 0 );
+			if ( view != MAP_FAILED ) data = (const uchar*)view;
+#endif
+		}
+		~MappedFile( )
+		{
+#ifdef _WIN32
+			if ( data ) UnmapViewOfFile( data );
+			if ( mapping_ ) CloseHandle( mapping_ );
+			if ( file_ != INVALID_HANDLE_VALUE ) CloseHandle( file_ );
+#else
+			if ( data ) munmap( (void*)data, size );
+			if ( fd_ >= 0 ) close( fd_ );
+#endif
+		}
+		const uchar* data = 0;
+		size_t size = 0;
+	private:
+#ifdef _WIN32
+		HANDLE file_ = INVALID_HANDLE_VALUE, mapping_ = 0;
+#else
+		int fd_ = -1;
+#endif
+	};
+} // namespace Tmpl8
@@ -0,0 +1,234 @@
+#include "precomp.h"
+namespace Tmpl8
+{
+	// smaller chunks are not worth a thread
+	static const size_t MIN_CHUNK_SIZE = 1 << 20;
+
+	enum ObjLine { OBJ_OTHER, OBJ_VERTEX, OBJ_TEXCOORD, OBJ_FACE, OBJ_USEMTL, OBJ_MTLLIB, OBJ_NEWMTL, OBJ_MAP_KD };
+
+	// a line-aligned part of the file with what the first pass found in it
+	struct ObjChunk
+	{
+		const char* begin, * end;
+		int vertices = 0, texcoords = 0, faces = 0;
+		std::vector<std::string> usemtl; // material names in the order they are used
+		std::vector<int> usemtlIdx; // the same names, resolved to ObjMesh::materials
+		std::vector<std::string> mtllib;
+		int vertexStart = 0, texcoordStart = 0, faceStart = 0;
+		int material = -1; // active at the start of the chunk
+		bool valid = true;
+	};
+
+	static bool IsSpace( char c ) { return c == ' ' || c == '\t' || c == '\r'; }
+	static const char* SkipSpace( const char* p, const char* end )
+	{
+		while ( p < end && IsSpace( *p ) ) p++;
+		return p;
+	}
+	static const char* SkipToken( const char* p, const char* end )
+	{
+		while ( p < end && !IsSpace( *p ) ) p++;
+		return p;
+	}
+	static const char* LineEnd( const char* p, const char* end )
+	{
+		const char* eol = (const char*)memchr( p, '\n', end - p );
+		return eol ? eol : end;
+	}
+	// the rest of the line, trimmed
+	static std::string Rest( const char* p, const char* end )
+	{
+		p = SkipSpace( p, end );
+		while ( end > p && IsSpace( end[-1] ) ) end--;
+		return std::string( p, end );
+	}
+	// classifies a line and moves p past its keyword
+	static ObjLine Classify( const char*& p, const char* end )
+	{
+		p = SkipSpace( p, end );
+		auto keyword = [&]( const char* word, int length ) {
+			if ( end - p <= length || memcmp( p, word, length ) || !IsSpace( p[length] ) ) return false;
+			p += length;
+			return true;
+		};
+		switch ( p < end ? *p : 0 ) {
+			case 'v':
+				if ( keyword( "v", 1 ) ) return OBJ_VERTEX;
+				if ( keyword( "vt", 2 ) ) return OBJ_TEXCOORD;
+				break;
+			case 'f': if ( keyword( "f", 1 ) ) return OBJ_FACE; break;
+			case 'u': if ( keyword( "usemtl", 6 ) ) return OBJ_USEMTL; break;
+			case 'm':
+				if ( keyword( "mtllib", 6 ) ) return OBJ_MTLLIB;
+				if ( keyword( "map_Kd", 6 ) ) return OBJ_MAP_KD;
+				break;
+			case 'n': if ( keyword( "newmtl", 6 ) ) return OBJ_NEWMTL; break;
+		}
+		return OBJ_OTHER;
+	}
+	static const char* ParseFloat( const char* p, const char* end, float& value )
+	{
+		p = SkipSpace( p, end );
+		if ( p < end && *p == '+' ) p++;
+		value = 0;
+		return std::from_chars( p, end, value ).ptr;
+	}
+	static int FaceVertices( const char* p, const char* end )
+	{
+		int count = 0;
+		for ( p = SkipSpace( p, end ); p < end && *p != '#'; p = SkipSpace( SkipToken( p, end ), end ) ) count++;
+		return count;
+	}
+	// a v, v/t, v//n or v/t/n reference; negative indices count back from the elements read so far
+	static const char* ParseIndex( const char* p, const char* end, int vertexCount, int texcoordCount, int& v, int& t )
+	{
+		int value = 0;
+		p = std::from_chars( p, end, value ).ptr;
+		v = value < 0 ? vertexCount + value : value - 1;
+		t = -1;
+		if ( p < end && *p == '/' && ++p < end && *p != '/' ) {
+			value = 0;
+			p = std::from_chars( p, end, value ).ptr;
+			t = value < 0 ? texcoordCount + value : value - 1;
+		}
+		return SkipToken( p, end ); // the normal is not used
+	}
+
+	static void LoadMtl( const std::string& file, ObjMesh& mesh )
+	{
+		MappedFile mtl( file );
+		if ( !mtl.data ) {
+			printf( "W/LoadObj: could not read %s\n", file.c_str( ) );
+			return;
+		}
+		mesh.libraries.push_back( file );
+		const char* p = (const char*)mtl.data, * end = p + mtl.size;
+		while ( p < end ) {
+			const char* eol = LineEnd( p, end ), * next = eol < end ? eol + 1 : end;
+			switch ( Classify( p, eol ) ) {
+				case OBJ_NEWMTL: mesh.materials.push_back( { Rest( p, eol ) } ); break;
+				case OBJ_MAP_KD:
+					if ( mesh.materials.empty( ) ) break;
+					p = SkipSpace( p, eol );
+					// options such as -bm come before the file name, which is then the last token
+					if ( p < eol && *p == '-' ) {
+						const char* last = eol;
+						while ( last > p && IsSpace( last[-1] ) ) last--;
+						while ( last > p && !IsSpace( last[-1] ) ) last--;
+						p = last;
+					}
+					mesh.materials.back( ).diffuseTexture = Rest( p, eol );
+					break;
+				default: break;
+			}
+			p = next;
+		}
+	}
+
+	static void CountChunk( ObjChunk& chunk )
+	{
+		for ( const char* p = chunk.begin; p < chunk.end; ) {
+			const char* eol = LineEnd( p, chunk.end ), * next = eol < chunk.end ? eol + 1 : chunk.end;
+			switch ( Classify( p, eol ) ) {
+				case OBJ_VERTEX: chunk.vertices++; break;
+				case OBJ_TEXCOORD: chunk.texcoords++; break;
+				case OBJ_FACE: chunk.faces += std::max( 0, FaceVertices( p, eol ) - 2 ); break;
+				case OBJ_USEMTL: chunk.usemtl.push_back( Rest( p, eol ) ); break;
+				case OBJ_MTLLIB: chunk.mtllib.push_back( Rest( p, eol ) ); break;
+				default: break;
+			}
+			p = next;
+		}
+	}
+
+	static void ParseChunk( ObjChunk& chunk, ObjMesh& mesh )
+	{
+		float3* vertex = mesh.vertices.data( ) + chunk.vertexStart;
+		float2* texcoord = mesh.texcoords.data( ) + chunk.texcoordStart;
+		ObjFace* face = mesh.faces.data( ) + chunk.faceStart;
+		int vertexCount = chunk.vertexStart, texcoordCount = chunk.texcoordStart;
+		int totalVertices = (int)mesh.vertices.size( ), totalTexcoords = (int)mesh.texcoords.size( );
+		int material = chunk.material, usemtl = 0;
+		for ( const char* p = chunk.begin; p < chunk.end; ) {
+			const char* eol = LineEnd( p, chunk.end ), * next = eol < chunk.end ? eol + 1 : chunk.end;
+			switch ( Classify( p, eol ) ) {
+				case OBJ_VERTEX:
+					p = ParseFloat( p, eol, vertex->x );
+					p = ParseFloat( p, eol, vertex->y );
+					ParseFloat( p, eol, vertex->z );
+					vertex++, vertexCount++;
+					break;
+				case OBJ_TEXCOORD:
+					p = ParseFloat( p, eol, texcoord->x );
+					ParseFloat( p, eol, texcoord->y );
+					texcoord++, texcoordCount++;
+					break;
+				case OBJ_FACE:
+				{
+					// fan: ( 0, i - 1, i ) for every vertex i after the second
+					int v[3], t[3], count = 0;
+					for ( p = SkipSpace( p, eol ); p < eol && *p != '#'; p = SkipSpace( p, eol ), count++ ) {
+						int slot = std::min( count, 2 );
+						p = ParseIndex( p, eol, vertexCount, texcoordCount, v[slot], t[slot] );
+						if ( v[slot] < 0 || v[slot] >= totalVertices || t[slot] < -1 || t[slot] >= totalTexcoords ) chunk.valid = false;
+						if ( count < 2 ) continue;
+						*face++ = { { v[0], v[1], v[2] }, { t[0], t[1], t[2] }, material };
+						v[1] = v[2], t[1] = t[2];
+					}
+				} break;
+				case OBJ_USEMTL: material = chunk.usemtlIdx[usemtl++]; break;
+				default: break;
+			}
+			p = next;
+		}
+	}
+
+	bool LoadObj( const std::string& _file, ObjMesh& _mesh )
+	{
+		MappedFile file( _file );
+		if ( !file.data ) return false;
+		const char* data = (const char*)file.data, * end = data + file.size;
+		// split at line boundaries
+		int threads = std::max( 1u, std::thread::hardware_concurrency( ) );
+		size_t chunkSize = std::max( MIN_CHUNK_SIZE, file.size / threads + 1 );
+		std::vector<ObjChunk> chunks;
+		for ( const char* p = data; p < end; ) {
+			ObjChunk chunk;
+			chunk.begin = p;
+			chunk.end = (size_t)( end - p ) <= chunkSize ? end : std::min( end, LineEnd( p + chunkSize, end ) + 1 );
+			chunks.push_back( chunk );
+			p = chunk.end;
+		}
+		util::ParallelFor( (int)chunks.size( ), [&]( int i ) { CountChunk( chunks[i] ); } );
+		// material libraries first, so usemtl names resolve to their materials
+		for ( const ObjChunk& chunk : chunks )
+			for ( const std::string& library : chunk.mtllib ) LoadMtl( util::GetBaseDir( _file ) + library, _mesh );
+		std::map<std::string, int> materialIdx;
+		for ( int i = 0; i < (int)_mesh.materials.size( ); i++ ) materialIdx.insert( { _mesh.materials[i].name, i } );
+		// offsets of every chunk, and the material the previous chunks left active
+		int vertices = 0, texcoords = 0, faces = 0, material = -1;
+		for ( ObjChunk& chunk : chunks ) {
+			chunk.vertexStart = vertices, chunk.texcoordStart = texcoords, chunk.faceStart = faces;
+			chunk.material = material;
+			vertices += chunk.vertices, texcoords += chunk.texcoords, faces += chunk.faces;
+			for ( const std::string& name : chunk.usemtl ) {
+				auto it = materialIdx.find( name );
+				if ( it == materialIdx.end( ) ) {
+					// used but never defined: a material without a texture
+					it = materialIdx.insert( { name, (int)_mesh.materials.size( ) } ).first;
+					_mesh.materials.push_back( { name } );
+				}
+				chunk.usemtlIdx.push_back( material = it->second );
+			}
+		}
+		_mesh.vertices.resize( vertices );
+		_mesh.texcoords.resize( texcoords );
+		_mesh.faces.resize( faces );
+		util::ParallelFor( (int)chunks.size( ), [&]( int i ) { ParseChunk( chunks[i], _mesh ); } );
+		for ( const ObjChunk& chunk : chunks ) if ( !chunk.valid ) {
+			printf( "E/LoadObj: %s references a vertex or texcoord that does not exist\n", _file.c_str( ) );
+			return false;
+		}
+		return true;
+	}
+} // namespace Tmpl8
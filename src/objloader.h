@@ -0,0 +1,27 @@
+#pragma once
+namespace Tmpl8
+{
+// a triangle of an OBJ mesh; indices are 0-based, t is -1 when the face has no texcoords,
+// material indexes ObjMesh::materials and is -1 before the first usemtl
+struct ObjFace
+{
+	int v[3], t[3];
+	int material;
+};
+struct ObjMaterial
+{
+	std::string name, diffuseTexture;
+};
+struct ObjMesh
+{
+	std::vector<float3> vertices;
+	std::vector<float2> texcoords;
+	std::vector<ObjFace> faces; // polygons are fan-triangulated
+	std::vector<ObjMaterial> materials;
+	std::vector<std::string> libraries; // mtl files that were read
+};
+// maps the file and parses it in line-aligned chunks on all hardware threads: a first pass
+// counts elements per chunk so every chunk knows where its output starts, a second pass
+// fills the preallocated arrays; returns false when the file cannot be read
+bool LoadObj( const std::string& file, ObjMesh& mesh );
+} // namespace Tmpl8
@@ -9,17 +9,30 @@ void Renderer::Init()
 	settings->tracerType = KAJIYA;
 	settings->antiAliasing = true;
 	settings->renderBVH = false;
+	settings->adaptiveThreshold = 0.02f;
 	tlas = new TLAS( *scene.bvh2 );
 	tlas->Build();
 	InitBuffers();
 	InitWavefrontKernels();
 	InitPostProcKernels();
+	exporter.Init( SCRWIDTH, SCRHEIGHT );
+	// without implicit gl sync the render target must be finished before Tick returns
+	cl_device_id device;
+	char extensions[8192] = "";
+	clGetCommandQueueInfo( Kernel::GetQueue(), CL_QUEUE_DEVICE, sizeof( device ), &device, 0 );
+	clGetDeviceInfo( device, CL_DEVICE_EXTENSIONS, sizeof( extensions ), extensions, 0 );
+	glEventSync = strstr( extensions, "cl_khr_gl_event" ) != 0;
 
 	// Set initial camera focus
 		camera.UpdateCamVec();
 	FocusCamera( SCRWIDTH / 2, SCRHEIGHT / 2 );
+	prevCam = camera.cam;
+}
+void Renderer::Shutdown()
+{
+	compiler.Stop();
+	exporter.Stop();
 }
-void Renderer::Shutdown() {}
 // -----------------------------------------------------------
 // Main application tick function - Executed once per frame
 // -----------------------------------------------------------
@@ -37,18 +50,47 @@ void Renderer::Tick( float _deltaTime )
 #endif
 	// pixel loop
 	Timer t;
+	BeginFrame();
+	// frame boundary: pick up kernels that finished compiling in the background
+	SwapWavefrontKernels();
+	// texture pages the kernels asked for FRAMES_IN_FLIGHT frames ago
+	virtualTexture.Update( frameSlot );
+	blasPool.Update( frameSlot );
+	UploadSceneEdits();
 	camera.UpdateCamVec();
+	bool reproject = false;
 	if ( camera.moved || imgui.reset_every_frame )
 	{
-		resetKernel->Run( PIXELS );
+		// temporal mode keeps the old accumulation around to reproject, instead of discarding it
+		reproject = imgui.temporal && !imgui.reset_every_frame && !settings->renderBVH
+			&& camera.cam.type == PROJECTION && prevCam.type == PROJECTION;
+		if ( reproject )
+		{
+			accumBuffer->CopyTo( historyAccumBuffer );
+			momentsBuffer->CopyTo( historyMomentsBuffer );
+			albedoBuffer->CopyTo( historyAlbedoBuffer );
+			normalDepthBuffer->CopyTo( historyNormalDepthBuffer );
+		}
+		ResetAccumulation();
 		camera.moved = false;
-		settings->frames = 1;
 	}
 	if ( settings->renderBVH ) settings->frames = 1;
 	RayTrace();
+	if ( reproject ) Reproject();
+	prevCam = camera.cam;
 	PostProc();
+	if ( imgui.recording )
+	{
+		char file[256];
+		ExportFormat format = (ExportFormat)imgui.export_format;
+		snprintf( file, sizeof( file ), "screenshots/%s_%05i%s", sequenceName.c_str(), imgui.recorded_frames++, FrameExporter::Extension( format ) );
+		SaveFrame( file, format );
+	}
 
-	if ( imgui.show_energy_levels ) ComputeEnergy();
+	if ( imgui.show_energy_levels ) ComputeStats();
+	virtualTexture.Readback( frameSlot );
+	blasPool.Readback( frameSlot );
+	EndFrame();
 
 	settings->frames++;
 
@@ -63,14 +105,48 @@ void Renderer::Tick( float _deltaTime )
 }
 void Renderer::RayTrace()
 {
+	// adaptive sampling only traces the pixels of tiles that have not converged yet
+	settings->adaptive = imgui.adaptive_sampling && !settings->renderBVH;
+	settings->temporal = imgui.temporal && !settings->renderBVH;
 	settings->numInRays = 0;
-	settings->numOutRays = PIXELS;
+	// generate counts the rays it starts: a pixel whose path waits for a BLAS takes no new one
+	settings->numOutRays = 0;
+	settings->numActive = settings->adaptive ? 0 : PIXELS;
 	settings->shadowRays = 0;
-	settingsBuffer->CopyToDevice();
+	UploadSettings();
+	if ( settings->adaptive ) compactKernel->Run( PIXELS, ADAPTIVE_TILE * ADAPTIVE_TILE );
+	else activePixelsRead[frameSlot] = PIXELS;
+	if ( imgui.use_megakernel )
+	{
+		// full paths in a single kernel, no ray queues
+		clSetKernelArg( megaKernel->kernel, 11, sizeof( Camera ), &camera.cam );
+		megaKernel->Run( PIXELS );
+		ResolveAdaptive();
+		return;
+	}
 	// generate initial primary rays
 	generateKernel->SetArgument( 0, ray1Buffer );
 	clSetKernelArg( generateKernel->kernel, 3, sizeof( Camera ), &camera.cam );
 	generateKernel->Run( PIXELS );
+	// rays that waited for their BLAS continue where they left off
+	if ( !settings->renderBVH )
+	{
+		resumeKernel->SetArgument( 0, ray1Buffer );
+		resumeKernel->Run( MAX_DEFERRED );
+		deferCountBuffer->Clear();
+		// the shadow rays deferred by the previous frame are tested again, those that still wait
+		// go to the other queue, which the connects of this frame fill as well
+		std::swap( shadowDefer1Buffer, shadowDefer2Buffer );
+		std::swap( shadowDeferCount1Buffer, shadowDeferCount2Buffer );
+		shadowDeferCount1Buffer->Clear();
+		reconnectKernel->SetArgument( 0, shadowDefer2Buffer );
+		reconnectKernel->SetArgument( 1, shadowDeferCount2Buffer );
+		reconnectKernel->SetArgument( 15, shadowDefer1Buffer );
+		reconnectKernel->SetArgument( 16, shadowDeferCount1Buffer );
+		reconnectKernel->Run( MAX_DEFERRED );
+		connectKernel->SetArgument( 15, shadowDefer1Buffer );
+		connectKernel->SetArgument( 16, shadowDeferCount1Buffer );
+	}
 
 	for ( int i = 0; i < MAX_BOUNCES; i++ )
 	{
@@ -80,126 +156,347 @@ void Renderer::RayTrace()
 
 		shadeKernel->SetArgument( 0, ray1Buffer );
 		shadeKernel->SetArgument( 1, ray2Buffer );
+		shadeKernel->SetArgument( 16, (int)(i == MAX_BOUNCES - 1) );
 		shadeKernel->Run( NR_OF_PERSISTENT_THREADS );
 
 		if ( !imgui.use_russian_roulette )
-			if ( imgui.shading_type == SHADING_NEE || imgui.shading_type == SHADING_NEEIS )
+			if ( imgui.shading_type == SHADING_NEE || imgui.shading_type == SHADING_NEEIS || imgui.shading_type == SHADING_NEEMIS )
 				connectKernel->Run( NR_OF_PERSISTENT_THREADS );
 
 		std::swap( ray1Buffer, ray2Buffer );
 	}
 	if ( imgui.use_russian_roulette )
 		connectKernel->Run( NR_OF_PERSISTENT_THREADS );
-
+	ResolveAdaptive();
 }
-void Renderer::PostProc()
+void Renderer::UploadSettings()
 {
-	// Post processing
-	Buffer* src = swap1Buffer;
-	Buffer* dst = swap2Buffer;
-	// Kernel takes values from pixelbuffer and puts them in src
-	post_prepKernel->SetArguments( accumBuffer, src, settingsBuffer );
-	post_prepKernel->Run( PIXELS );
-	if ( imgui.vignet_strength > 0 )
+	// a snapshot, so the host can go on changing settings while the write is pending; the slot
+	// is reused FRAMES_IN_FLIGHT uploads later, by then its write has long completed. On the main
+	// queue the write follows the work that still reads the device copy, and precedes this frame's
+	cl_event& uploaded = settingsUploaded[uploadSlot];
+	if ( uploaded ) clWaitForEvents( 1, &uploaded ), clReleaseEvent( uploaded );
+	settingsStaging[uploadSlot] = *settings;
+	clEnqueueWriteBuffer( Kernel::GetQueue(), settingsBuffer->deviceBuffer, CL_FALSE, 0, sizeof( Settings ),
+		&settingsStaging[uploadSlot], 0, 0, &uploaded );
+	uploadSlot = (uploadSlot + 1) % FRAMES_IN_FLIGHT;
+}
+void Renderer::UploadSceneEdits()
+{
+	std::vector<uint> moved = scene.ApplyEdits( imgui.refit_edits );
+	if ( !moved.empty() ) tlas->Build();
+	// the ranges that changed, through a copy in the slot: the scene may change again before the
+	// writes execute, the slot is reused once its frame is done
+	struct Upload { Buffer* buffer; DirtyRanges* ranges; const void* data; size_t stride; };
+	Upload uploads[] = {
+		{ primBuffer, &scene.dirtyPrimitives, scene.primitives.data(), sizeof( Primitive ) },
+		{ triAccelBuffer, &scene.dirtyPrimitives, scene.triAccels.data(), sizeof( TriAccel ) },
+		{ vertexBuffer, &scene.dirtyVertices, scene.vertices.data(), sizeof( float4 ) },
+		{ matBuffer, &scene.dirtyMaterials, scene.materials.data(), sizeof( Material ) } };
+	size_t lightBytes = sizeof( LightAlias ) * scene.lightTable.size();
+	if ( scene.dirtyLights && lightBytes != lightBuffer->size )
+	{
+		// a light was added or removed: the frames in flight keep the old buffer until they are done
+		delete lightBuffer;
+		lightBuffer = new Buffer( (uint)lightBytes );
+		lightBuffer->hostBuffer = (uint*)scene.lightTable.data();
+		shadeKernel->SetArgument( 6, lightBuffer );
+		megaKernel->SetArgument( 3, lightBuffer );
+		settings->numLights = scene.lightTable.size();
+	}
+	size_t bytes = 0;
+	for ( const Upload& upload : uploads ) bytes += upload.ranges->Count() * upload.stride;
+	// the alias table is rebuilt as a whole, the TLAS too
+	if ( scene.dirtyLights ) bytes += lightBuffer->size;
+	if ( !moved.empty() ) bytes += tlasNodeBuffer->size;
+	for ( uint root : moved ) bytes += blasPool.ReloadBytes( root );
+	if ( bytes == 0 ) return;
+	std::vector<uchar>& staging = editStaging[frameSlot];
+	staging.resize( bytes );
+	uchar* data = staging.data();
+	auto write = [&]( Buffer* buffer, size_t offset, size_t size, const void* source ) {
+		memcpy( data, (const uchar*)source + offset, size );
+		buffer->CopyToDevice( (uint)offset, (uint)size, data, false );
+		data += size;
+	};
+	for ( const Upload& upload : uploads )
 	{
-		post_vignetKernel->SetArguments( src, dst, imgui.vignet_strength );
-		post_vignetKernel->Run( PIXELS );
-		std::swap( src, dst );
+		for ( const auto& range : upload.ranges->Ranges() )
+			write( upload.buffer, range.first * upload.stride, (range.second - range.first) * upload.stride, upload.data );
 	}
-	if ( imgui.gamma_strength != 1 )
+	// after all writes: the primitives and their transforms share one set of ranges
+	for ( const Upload& upload : uploads ) upload.ranges->Clear();
+	if ( scene.dirtyLights && lightBytes > 0 ) write( lightBuffer, 0, lightBuffer->size, scene.lightTable.data() );
+	scene.dirtyLights = false;
+	if ( !moved.empty() ) write( tlasNodeBuffer, 0, tlasNodeBuffer->size, tlas->tlasNodes.data() );
+	for ( uint root : moved )
 	{
-		post_gammaKernel->SetArguments( src, dst, imgui.gamma_strength );
-		post_gammaKernel->Run( PIXELS );
-		std::swap( src, dst );
+		size_t size = blasPool.ReloadBytes( root );
+		blasPool.Reload( root, data );
+		data += size;
 	}
-	if ( imgui.chromatic_strength > 0 )
+	imgui.edit_bytes = (int)bytes;
+	// the history shows the scene before the edit, reprojecting it would not help
+	ResetAccumulation();
+}
+void Renderer::BeginFrame()
+{
+	// at most FRAMES_IN_FLIGHT frames queued; the gui, camera and submission of this frame
+	// overlap the device work of the previous one
+	cl_event& done = frameDone[frameSlot];
+	if ( !done ) return;
+	clWaitForEvents( 1, &done );
+	clReleaseEvent( done );
+	done = 0;
+	// the reads of the frame that had this slot have landed
+	imgui.active_pixels = activePixelsRead[frameSlot];
+	frameStats = statsRead[frameSlot];
+}
+void Renderer::EndFrame()
+{
+	cl_event& done = frameDone[frameSlot];
+	clEnqueueMarkerWithWaitList( Kernel::GetQueue(), 0, 0, &done );
+	clFlush( Kernel::GetQueue() );
+	frameSlot = (frameSlot + 1) % FRAMES_IN_FLIGHT;
+	// gl draws the render target right after Tick
+	if ( !glEventSync ) clWaitForEvents( 1, &done );
+}
+void Renderer::ResetAccumulation()
+{
+	resetKernel->Run( PIXELS );
+	deferCountBuffer->Clear();
+	shadowDeferCount1Buffer->Clear();
+	shadowDeferCount2Buffer->Clear();
+	pathBuffer->Clear();
+	momentsBuffer->Clear();
+	albedoBuffer->Clear();
+	normalDepthBuffer->Clear();
+	settings->frames = 1;
+}
+void Renderer::Reproject()
+{
+	clSetKernelArg( reprojectKernel->kernel, 9, sizeof( Camera ), &prevCam );
+	reprojectKernel->SetArgument( 10, imgui.max_history );
+	reprojectKernel->Run( PIXELS );
+}
+void Renderer::ResolveAdaptive()
+{
+	// every pixel keeps its own sample count, the visualized BVH has a single sample
+	if ( settings->renderBVH ) return;
+	resolveKernel->Run( PIXELS );
+	if ( !settings->adaptive ) return;
+	// non-blocking, into the slot of this frame; the gui gets it once the frame is done
+	clEnqueueReadBuffer( Kernel::GetQueue(), settingsBuffer->deviceBuffer, CL_FALSE, offsetof( Settings, numActive ),
+		sizeof( int ), &activePixelsRead[frameSlot], 0, 0, 0 );
+}
+void Renderer::Benchmark( int frames )
+{
+	// render the same view with both architectures and report the average frame time
+	bool megakernel = imgui.use_megakernel;
+	float* results[2] = { &imgui.bench_wavefront_ms, &imgui.bench_megakernel_ms };
+	for ( int mode = 0; mode < 2; mode++ )
 	{
-		post_chromaticKernel->SetArguments( src, dst, imgui.chromatic_strength );
-		post_chromaticKernel->Run( PIXELS );
-		std::swap( src, dst );
+		imgui.use_megakernel = mode == 1;
+		ResetAccumulation();
+		RayTrace(); // warm-up
+		clFinish( Kernel::GetQueue() );
+		Timer t;
+		for ( int i = 0; i < frames; i++, settings->frames++ ) RayTrace();
+		clFinish( Kernel::GetQueue() );
+		*results[mode] = t.elapsed() * 1000 / frames;
 	}
-	// Kernel takes values from src and writes them to screen texture
-	displayKernel->SetArgument( 0, src );
-	displayKernel->Run( PIXELS );
+	printf( "Benchmark (%i frames): wavefront %.2fms, megakernel %.2fms\n", frames, imgui.bench_wavefront_ms, imgui.bench_megakernel_ms );
+	imgui.use_megakernel = megakernel;
+	camera.moved = true;
 }
 
-void Renderer::ComputeEnergy()
+void Renderer::BenchmarkTriangles()
 {
-	accumBuffer->CopyFromDevice();
-	float4* pixels = (float4*)(accumBuffer->hostBuffer);
+	// a spread of the scene's triangles, each tested against the same rays by all routines
+	const int maxTris = 1024, rays = 65536;
+	std::vector<uint> triIdxs;
+	int stride = std::max( 1, (int)scene.primitives.size() / maxTris );
+	for ( int i = 0; i < (int)scene.primitives.size() && triIdxs.size() < maxTris; i += stride )
+		if ( scene.primitives[i].objType == TRIANGLE ) triIdxs.push_back( i );
+	if ( triIdxs.empty() ) return;
+	if ( !benchTrianglesKernel ) benchTrianglesKernel = compiler.Build( "src/cl/bench.cl", "triangles", {} );
+	// seeds of its own, so the rays of the renderer stay as they were; all routines start from the
+	// same seeds and see the same rays
+	std::vector<uint> seeds( rays );
+	for ( uint& seed : seeds ) seed = RandomUInt();
+	Buffer* seedsBuffer = new Buffer( sizeof( uint ) * rays, seeds.data() );
+	Buffer* triIdxBuffer = new Buffer( sizeof( uint ) * triIdxs.size(), triIdxs.data() );
+	Buffer* hitBuffer = new Buffer( sizeof( int ) * rays );
+	triIdxBuffer->CopyToDevice();
+	float* results[3] = { &imgui.bench_mt_ms, &imgui.bench_watertight_ms, &imgui.bench_woop_ms };
+	for ( int mode = 0; mode < 3; mode++ )
+	{
+		seedsBuffer->CopyToDevice();
+		benchTrianglesKernel->SetArguments( primBuffer, vertexBuffer, triIdxBuffer, (int)triIdxs.size(), mode, seedsBuffer, hitBuffer, triAccelBuffer );
+		benchTrianglesKernel->Run( rays ); // warm-up
+		clFinish( Kernel::GetQueue() );
+		Timer t;
+		for ( int i = 0; i < 8; i++ ) benchTrianglesKernel->Run( rays );
+		clFinish( Kernel::GetQueue() );
+		*results[mode] = t.elapsed() * 1000 / 8;
+	}
+	printf( "Triangle benchmark (%i rays x %i triangles): Moller-Trumbore %.2fms, watertight %.2fms, Woop %.2fms\n",
+		rays, (int)triIdxs.size(), imgui.bench_mt_ms, imgui.bench_watertight_ms, imgui.bench_woop_ms );
+	delete seedsBuffer;
+	delete triIdxBuffer;
+	delete hitBuffer;
+}
 
-	imgui.energy_total = 0;
-	for ( int i = 0; i < PIXELS; i++ )
+void Renderer::PostProc()
+{
+	// Post processing
+	Buffer* source = accumBuffer;
+	int flags = 0;
+	if ( imgui.denoise && !settings->renderBVH )
 	{
-		imgui.energy_total += pixels[i].x;
-		imgui.energy_total += pixels[i].y;
-		imgui.energy_total += pixels[i].z;
+		// filter the illumination, ping-ponging between the swap buffers
+		Buffer* src = swap1Buffer;
+		Buffer* dst = swap2Buffer;
+		post_demodulateKernel->SetArguments( accumBuffer, albedoBuffer, src, settingsBuffer, momentsBuffer );
+		post_demodulateKernel->Run( PIXELS );
+		for ( int i = 0; i < imgui.denoise_iterations; i++ )
+		{
+			// the colour weight tightens as the taps spread out
+			post_atrousKernel->SetArguments( src, dst, normalDepthBuffer, settingsBuffer, momentsBuffer,
+				1 << i, imgui.denoise_sigma_color / (1 << i), imgui.denoise_sigma_normal, imgui.denoise_sigma_depth );
+			post_atrousKernel->Run( PIXELS );
+			std::swap( src, dst );
+		}
+		post_remodulateKernel->SetArguments( src, albedoBuffer, dst, settingsBuffer, momentsBuffer );
+		post_remodulateKernel->Run( PIXELS );
+		source = dst;
+		flags |= POST_DENOISED;
 	}
+	if ( imgui.vignet_strength > 0 ) flags |= POST_VIGNETTING;
+	if ( imgui.gamma_strength != 1 ) flags |= POST_GAMMA;
+	if ( imgui.chromatic_strength > 0 ) flags |= POST_CHROMATIC;
+	// one pass from the source straight to the screen texture
+	Kernel* post = PostKernel( flags );
+	post->SetArguments( source, settingsBuffer, momentsBuffer, screenBuffer,
+		imgui.vignet_strength, imgui.gamma_strength, imgui.chromatic_strength );
+	post->Run( PIXELS );
+}
+
+Kernel* Renderer::PostKernel( int flags )
+{
+	if ( !postKernels[flags] ) postKernels[flags] = compiler.AcquireKernel( KernelCompiler::Key( "src/cl/postproc.cl", "post", PostDefines( flags ) ) );
+	// until the worker has built this combination, the variant used last stands in, as long as it
+	// reads the same source; otherwise the one without effects does
+	if ( postKernels[flags] ) postFlags = flags;
+	else if ( (postFlags ^ flags) & POST_DENOISED ) postFlags = flags & POST_DENOISED;
+	return postKernels[postFlags];
+}
 
-	imgui.energy_total *= 1 / (float)(settings->frames);
+std::vector<string> Renderer::PostDefines( int flags )
+{
+	std::vector<string> defines;
+	if ( flags & POST_VIGNETTING ) defines.push_back( "VIGNETTING" );
+	if ( flags & POST_GAMMA ) defines.push_back( "GAMMA" );
+	if ( flags & POST_CHROMATIC ) defines.push_back( "CHROMATIC" );
+	if ( flags & POST_DENOISED ) defines.push_back( "DENOISED" );
+	return defines;
+}
+
+void Renderer::ComputeStats()
+{
+	statsBuffer->Clear();
+	statsKernel->Run( PIXELS, STATS_GROUP );
+	statsFinalKernel->Run( STATS_GROUP, STATS_GROUP );
+	clEnqueueReadBuffer( Kernel::GetQueue(), statsBuffer->deviceBuffer, CL_FALSE, 0, sizeof( FrameStats ), &statsRead[frameSlot], 0, 0, 0 );
 }
 
 void Renderer::InitBuffers()
 {
 	// data
 	primBuffer = new Buffer( sizeof( Primitive ) * scene.primitives.size() );
-	texBuffer = new Buffer( sizeof( float4 ) * scene.textures.size() );
+	triAccelBuffer = new Buffer( sizeof( TriAccel ) * scene.triAccels.size() );
+	vertexBuffer = new Buffer( sizeof( float4 ) * scene.vertices.size() );
+	texcoordBuffer = new Buffer( sizeof( float2 ) * scene.texcoords.size() );
+	skyCdfBuffer = new Buffer( sizeof( float ) * scene.skyCdf.size() );
 	matBuffer = new Buffer( sizeof( Material ) * scene.materials.size() );
-	lightBuffer = new Buffer( sizeof( uint ) * scene.lights.size() );
+	lightBuffer = new Buffer( sizeof( LightAlias ) * scene.lightTable.size() );
 
 	// rays
-	ray1Buffer = new Buffer( PIXELS * sizeof( Ray ) );
-	ray2Buffer = new Buffer( PIXELS * sizeof( Ray ) );
+	// room for the deferred rays that join the primary ones
+	ray1Buffer = new Buffer( ( PIXELS + MAX_DEFERRED ) * sizeof( Ray ) );
+	ray2Buffer = new Buffer( ( PIXELS + MAX_DEFERRED ) * sizeof( Ray ) );
 	shadowRayBuffer = new Buffer( 4 * PIXELS * sizeof( ShadowRay ) );
 
 	seedBuffer = new Buffer( sizeof( uint ) * PIXELS );
 	settingsBuffer = new Buffer( sizeof( Settings ) );
 	accumBuffer = new Buffer( 4 * 4 * PIXELS );
+	momentsBuffer = new Buffer( 4 * 4 * PIXELS );
+	activePixelBuffer = new Buffer( sizeof( uint ) * PIXELS );
+	albedoBuffer = new Buffer( 4 * 4 * PIXELS );
+	normalDepthBuffer = new Buffer( 4 * 4 * PIXELS );
+	positionBuffer = new Buffer( 4 * 4 * PIXELS );
+	historyAccumBuffer = new Buffer( 4 * 4 * PIXELS );
+	historyMomentsBuffer = new Buffer( 4 * 4 * PIXELS );
+	historyAlbedoBuffer = new Buffer( 4 * 4 * PIXELS );
+	historyNormalDepthBuffer = new Buffer( 4 * 4 * PIXELS );
+	momentsBuffer->Clear();
+	albedoBuffer->Clear();
+	normalDepthBuffer->Clear();
 
 	// set data
 	primBuffer->hostBuffer = (uint*)scene.primitives.data();
+	triAccelBuffer->hostBuffer = (uint*)scene.triAccels.data();
+	vertexBuffer->hostBuffer = (uint*)scene.vertices.data();
+	texcoordBuffer->hostBuffer = (uint*)scene.texcoords.data();
 	matBuffer->hostBuffer = (uint*)scene.materials.data();
-	texBuffer->hostBuffer = (uint*)scene.textures.data();
-	lightBuffer->hostBuffer = (uint*)scene.lights.data();
+	skyCdfBuffer->hostBuffer = (uint*)scene.skyCdf.data();
+	lightBuffer->hostBuffer = (uint*)scene.lightTable.data();
 	settingsBuffer->hostBuffer = (uint*)settings;
 	seedBuffer->hostBuffer = new uint[PIXELS];
 	// settings
 	settings->numPrimitives = scene.primitives.size();
-	settings->numLights = scene.lights.size();
+	settings->numLights = scene.lightTable.size();
 
 	// settings
 	settings->numPrimitives = scene.primitives.size();
-	settings->numLights = scene.lights.size();
-
-	blasNodeBuffer = new Buffer( sizeof( BVHInstance ) * scene.blasNodes.size() );
-	blasNodeBuffer->hostBuffer = (uint*)scene.blasNodes.data();
+	settings->numLights = scene.lightTable.size();
+
+	// BVH: the BLASes go into pools, the instances refer to them by index
+	blasPool.Init( scene, imgui.bvh_type == USE_BVH4 );
+	bvhNodeBuffer = blasPool.nodeBuffer;
+	bvhIdxBuffer = blasPool.idxBuffer;
+	blasNodeBuffer = new Buffer( sizeof( BVHInstance ) * blasPool.instances.size() );
+	blasNodeBuffer->hostBuffer = (uint*)blasPool.instances.data();
 	tlasNodeBuffer = new Buffer( sizeof( TLASNode ) * tlas->tlasNodes.size() );
 	tlasNodeBuffer->hostBuffer = (uint*)tlas->tlasNodes.data();
-
-	// BVH
-	if ( imgui.bvh_type == USE_BVH4 )
-	{
-		bvhNodeBuffer = new Buffer( sizeof( BVHNode4 ) * scene.bvh4->Nodes().size() );
-		bvhNodeBuffer->hostBuffer = (uint*)scene.bvh4->Nodes().data();
-		bvhIdxBuffer = new Buffer( sizeof( uint ) * scene.bvh4->Idx().size() );
-		bvhIdxBuffer->hostBuffer = (uint*)scene.bvh4->Idx().data();
-	}
-	else if ( imgui.bvh_type == USE_BVH2 )
-	{
-		bvhNodeBuffer = new Buffer( sizeof( BVHNode2 ) * scene.bvh2->bvhNodes.size() );
-		bvhNodeBuffer->hostBuffer = (uint*)scene.bvh2->bvhNodes.data();
-		bvhIdxBuffer = new Buffer( sizeof( uint ) * scene.bvh2->primIdx.size() );
-		bvhIdxBuffer->hostBuffer = (uint*)scene.bvh2->primIdx.data();
-	}
+	deferBuffer = new Buffer( MAX_DEFERRED * sizeof( Ray ) );
+	deferCountBuffer = new Buffer( sizeof( uint ) );
+	deferCountBuffer->Clear();
+	shadowDefer1Buffer = new Buffer( MAX_DEFERRED * sizeof( ShadowRay ) );
+	shadowDefer2Buffer = new Buffer( MAX_DEFERRED * sizeof( ShadowRay ) );
+	shadowDeferCount1Buffer = new Buffer( sizeof( uint ) );
+	shadowDeferCount2Buffer = new Buffer( sizeof( uint ) );
+	shadowDeferCount1Buffer->Clear();
+	shadowDeferCount2Buffer->Clear();
+	pathBuffer = new Buffer( sizeof( PathState ) * PIXELS );
+	pathBuffer->Clear();
 
 	for ( int i = 0; i < SCRHEIGHT * SCRWIDTH; i++ )
 		seedBuffer->hostBuffer[i] = RandomUInt();
 
-	bvhNodeBuffer->CopyToDevice();
-	bvhIdxBuffer->CopyToDevice();
+	// assigns the texture pages in the materials, so before they go up
+	virtualTexture.Init( scene );
+
 	seedBuffer->CopyToDevice();
 	primBuffer->CopyToDevice();
-	texBuffer->CopyToDevice();
+	triAccelBuffer->CopyToDevice();
+	if ( !scene.vertices.empty() )
+	{
+		vertexBuffer->CopyToDevice();
+		texcoordBuffer->CopyToDevice();
+	}
+	if ( !scene.skyCdf.empty() )
+		skyCdfBuffer->CopyToDevice();
 	matBuffer->CopyToDevice();
 	blasNodeBuffer->CopyToDevice();
 	tlasNodeBuffer->CopyToDevice();
@@ -210,20 +507,104 @@ void Renderer::InitBuffers()
 
 void Renderer::InitWavefrontKernels()
 {
-	std::vector<string> defines{ imgui.shading_type, imgui.sampling_type, imgui.bvh_type };
-	if ( imgui.use_russian_roulette ) defines.push_back( USE_RUSSIAN_ROULETTE );
+	std::vector<string> defines = WavefrontDefines( imgui.shading_type, imgui.sampling_type, imgui.use_russian_roulette );
+	// without kernels to fall back to, a build error is fatal
+	string error;
+	WavefrontKernels* kernels = compiler.Compile( defines, &error );
+	if ( !kernels ) FatalError( "%s", error.c_str() );
+	SetWavefrontKernels( kernels, KernelCompiler::Key( defines ) );
+}
+
+std::vector<string> Renderer::WavefrontDefines( const string& shading, const string& sampling, bool russianRoulette )
+{
+	std::vector<string> defines{ shading, sampling, imgui.bvh_type, imgui.texture_filter };
+	if ( imgui.use_sobol ) defines.push_back( SAMPLER_SOBOL );
+	if ( russianRoulette ) defines.push_back( USE_RUSSIAN_ROULETTE );
 	if ( imgui.filter_fireflies ) defines.push_back( FILTER_FIREFLIES );
+	if ( imgui.use_skydome && !scene.skyCdf.empty() ) defines.push_back( USE_SKYDOME );
+	return defines;
+}
+
+void Renderer::RequestWavefrontKernels()
+{
+	switch ( imgui.dummy_shading_type )
+	{
+	case 0: requestedShading = SHADING_SIMPLE;
+		break;
+	case 1: requestedShading = SHADING_NEE;
+		break;
+	case 2: requestedShading = SHADING_NEEMIS;
+		break;
+	};
+	requestedRussianRoulette = imgui.dummy_russian_roulette;
+	std::vector<string> defines = WavefrontDefines( requestedShading, imgui.sampling_type, requestedRussianRoulette );
+	requestedKey = KernelCompiler::Key( defines );
+	if ( requestedKey == wavefrontKey ) requestedKey.clear();
+	else compiler.Request( defines );
+}
+
+void Renderer::PrewarmWavefrontKernels()
+{
+	// variants that are toggled from the gui; compiled one after another in the background
+	for ( const string& shading : { SHADING_SIMPLE, SHADING_NEE, SHADING_NEEMIS } )
+		for ( const string& sampling : { SAMPLING_HEMISPHERE, SAMPLING_COSINE } )
+			for ( bool russianRoulette : { false, true } )
+			{
+				std::vector<string> defines = WavefrontDefines( shading, sampling, russianRoulette );
+				if ( KernelCompiler::Key( defines ) != wavefrontKey ) compiler.Request( defines );
+			}
+}
 
-	// wavefront
-	resetKernel = new Kernel( "src/cl/wavefront.cl", "reset", defines );
-	generateKernel = new Kernel( "src/cl/wavefront.cl", "generate", defines );
-	extendKernel = new Kernel( "src/cl/wavefront.cl", "extend", defines );
-	shadeKernel = new Kernel( "src/cl/wavefront.cl", "shade", defines );
-	connectKernel = new Kernel( "src/cl/wavefront.cl", "connect", defines );
-	focusKernel = new Kernel( "src/cl/wavefront.cl", "focus", defines );
+void Renderer::SwapWavefrontKernels()
+{
+	if ( requestedKey.empty() ) return;
+	if ( compiler.Failed( requestedKey, compileError ) )
+	{
+		// the variant in use stays, and so does its selection in the gui
+		imgui.dummy_shading_type = imgui.shading_type == SHADING_SIMPLE ? 0 : imgui.shading_type == SHADING_NEE ? 1 : 2;
+		imgui.dummy_russian_roulette = imgui.use_russian_roulette;
+		requestedKey.clear();
+		return;
+	}
+	WavefrontKernels* kernels = compiler.Acquire( requestedKey );
+	if ( !kernels ) return;
+	compileError.clear();
+	imgui.shading_type = requestedShading;
+	imgui.use_russian_roulette = requestedRussianRoulette;
+	SetWavefrontKernels( kernels, requestedKey );
+	requestedKey.clear();
+	camera.moved = true;
+}
+
+void Renderer::SetWavefrontKernels( WavefrontKernels* kernels, const string& key )
+{
+	WavefrontKernels* old = wavefront;
+	string oldKey = wavefrontKey;
+	wavefront = kernels;
+	wavefrontKey = key;
+
+	resetKernel = kernels->reset;
+	generateKernel = kernels->generate;
+	resumeKernel = kernels->resume;
+	extendKernel = kernels->extend;
+	shadeKernel = kernels->shade;
+	connectKernel = kernels->connect;
+	reconnectKernel = kernels->reconnect;
+	focusKernel = kernels->focus;
+	megaKernel = kernels->render;
+	compactKernel = kernels->compact;
+	resolveKernel = kernels->resolve;
+	reprojectKernel = kernels->reproject;
 
 	generateKernel->SetArgument( 1, settingsBuffer );
 	generateKernel->SetArgument( 2, seedBuffer );
+	generateKernel->SetArgument( 4, activePixelBuffer );
+	generateKernel->SetArgument( 5, momentsBuffer );
+	generateKernel->SetArgument( 6, pathBuffer );
+
+	resumeKernel->SetArgument( 1, settingsBuffer );
+	resumeKernel->SetArgument( 2, deferBuffer );
+	resumeKernel->SetArgument( 3, deferCountBuffer );
 
 	extendKernel->SetArgument( 1, primBuffer );
 	extendKernel->SetArgument( 2, tlasNodeBuffer );
@@ -232,15 +613,33 @@ void Renderer::InitWavefrontKernels()
 	extendKernel->SetArgument( 5, bvhIdxBuffer );
 	extendKernel->SetArgument( 6, accumBuffer );
 	extendKernel->SetArgument( 7, settingsBuffer );
+	extendKernel->SetArgument( 8, vertexBuffer );
+	extendKernel->SetArgument( 9, matBuffer );
+	extendKernel->SetArgument( 10, virtualTexture.tileBuffer );
+	extendKernel->SetArgument( 11, texcoordBuffer );
+	extendKernel->SetArgument( 12, virtualTexture.pageTableBuffer );
+	extendKernel->SetArgument( 13, virtualTexture.feedbackBuffer );
+	extendKernel->SetArgument( 14, blasPool.rootBuffer );
+	extendKernel->SetArgument( 15, blasPool.feedbackBuffer );
+	extendKernel->SetArgument( 16, deferBuffer );
+	extendKernel->SetArgument( 17, deferCountBuffer );
+	extendKernel->SetArgument( 18, pathBuffer );
+	extendKernel->SetArgument( 19, triAccelBuffer );
 
 	shadeKernel->SetArgument( 2, shadowRayBuffer );
 	shadeKernel->SetArgument( 3, primBuffer );
-	shadeKernel->SetArgument( 4, texBuffer );
+	shadeKernel->SetArgument( 4, virtualTexture.tileBuffer );
 	shadeKernel->SetArgument( 5, matBuffer );
 	shadeKernel->SetArgument( 6, lightBuffer );
 	shadeKernel->SetArgument( 7, settingsBuffer );
-	shadeKernel->SetArgument( 8, accumBuffer );
+	shadeKernel->SetArgument( 8, pathBuffer );
 	shadeKernel->SetArgument( 9, seedBuffer );
+	shadeKernel->SetArgument( 10, skyCdfBuffer );
+	shadeKernel->SetArgument( 11, vertexBuffer );
+	shadeKernel->SetArgument( 12, texcoordBuffer );
+	shadeKernel->SetArgument( 13, virtualTexture.pageTableBuffer );
+	shadeKernel->SetArgument( 14, virtualTexture.feedbackBuffer );
+	shadeKernel->SetArgument( 15, momentsBuffer );
 
 	connectKernel->SetArgument( 0, shadowRayBuffer );
 	connectKernel->SetArgument( 1, tlasNodeBuffer );
@@ -250,7 +649,35 @@ void Renderer::InitWavefrontKernels()
 	connectKernel->SetArgument( 5, primBuffer );
 	connectKernel->SetArgument( 6, matBuffer );
 	connectKernel->SetArgument( 7, settingsBuffer );
-	connectKernel->SetArgument( 8, accumBuffer );
+	connectKernel->SetArgument( 8, pathBuffer );
+	connectKernel->SetArgument( 9, vertexBuffer );
+	connectKernel->SetArgument( 10, virtualTexture.tileBuffer );
+	connectKernel->SetArgument( 11, virtualTexture.pageTableBuffer );
+	connectKernel->SetArgument( 12, virtualTexture.feedbackBuffer );
+	connectKernel->SetArgument( 13, blasPool.rootBuffer );
+	connectKernel->SetArgument( 14, blasPool.feedbackBuffer );
+	connectKernel->SetArgument( 15, shadowDefer1Buffer );
+	connectKernel->SetArgument( 16, shadowDeferCount1Buffer );
+	connectKernel->SetArgument( 17, triAccelBuffer );
+
+	reconnectKernel->SetArgument( 0, shadowDefer2Buffer );
+	reconnectKernel->SetArgument( 1, shadowDeferCount2Buffer );
+	reconnectKernel->SetArgument( 2, tlasNodeBuffer );
+	reconnectKernel->SetArgument( 3, blasNodeBuffer );
+	reconnectKernel->SetArgument( 4, bvhNodeBuffer );
+	reconnectKernel->SetArgument( 5, bvhIdxBuffer );
+	reconnectKernel->SetArgument( 6, primBuffer );
+	reconnectKernel->SetArgument( 7, matBuffer );
+	reconnectKernel->SetArgument( 8, pathBuffer );
+	reconnectKernel->SetArgument( 9, vertexBuffer );
+	reconnectKernel->SetArgument( 10, virtualTexture.tileBuffer );
+	reconnectKernel->SetArgument( 11, virtualTexture.pageTableBuffer );
+	reconnectKernel->SetArgument( 12, virtualTexture.feedbackBuffer );
+	reconnectKernel->SetArgument( 13, blasPool.rootBuffer );
+	reconnectKernel->SetArgument( 14, blasPool.feedbackBuffer );
+	reconnectKernel->SetArgument( 15, shadowDefer1Buffer );
+	reconnectKernel->SetArgument( 16, shadowDeferCount1Buffer );
+	reconnectKernel->SetArgument( 17, triAccelBuffer );
 
 	resetKernel->SetArgument( 0, accumBuffer );
 
@@ -260,30 +687,83 @@ void Renderer::InitWavefrontKernels()
 	focusKernel->SetArgument( 5, bvhIdxBuffer );
 	focusKernel->SetArgument( 6, primBuffer );
 	focusKernel->SetArgument( 7, settingsBuffer );
+	focusKernel->SetArgument( 9, vertexBuffer );
+	focusKernel->SetArgument( 10, blasPool.rootBuffer );
+	focusKernel->SetArgument( 11, blasPool.feedbackBuffer );
+	focusKernel->SetArgument( 12, triAccelBuffer );
+
+	megaKernel->SetArgument( 0, primBuffer );
+	megaKernel->SetArgument( 1, virtualTexture.tileBuffer );
+	megaKernel->SetArgument( 2, matBuffer );
+	megaKernel->SetArgument( 3, lightBuffer );
+	megaKernel->SetArgument( 4, tlasNodeBuffer );
+	megaKernel->SetArgument( 5, blasNodeBuffer );
+	megaKernel->SetArgument( 6, bvhNodeBuffer );
+	megaKernel->SetArgument( 7, bvhIdxBuffer );
+	megaKernel->SetArgument( 8, settingsBuffer );
+	megaKernel->SetArgument( 9, pathBuffer );
+	megaKernel->SetArgument( 10, seedBuffer );
+	megaKernel->SetArgument( 12, vertexBuffer );
+	megaKernel->SetArgument( 13, skyCdfBuffer );
+	megaKernel->SetArgument( 14, activePixelBuffer );
+	megaKernel->SetArgument( 15, texcoordBuffer );
+	megaKernel->SetArgument( 16, virtualTexture.pageTableBuffer );
+	megaKernel->SetArgument( 17, virtualTexture.feedbackBuffer );
+	megaKernel->SetArgument( 18, blasPool.rootBuffer );
+	megaKernel->SetArgument( 19, blasPool.feedbackBuffer );
+	megaKernel->SetArgument( 20, momentsBuffer );
+	megaKernel->SetArgument( 21, triAccelBuffer );
+
+	compactKernel->SetArguments( momentsBuffer, activePixelBuffer, settingsBuffer );
+	resolveKernel->SetArguments( accumBuffer, momentsBuffer, albedoBuffer, normalDepthBuffer, positionBuffer, pathBuffer );
+	reprojectKernel->SetArgument( 0, accumBuffer );
+	reprojectKernel->SetArgument( 1, momentsBuffer );
+	reprojectKernel->SetArgument( 2, albedoBuffer );
+	reprojectKernel->SetArgument( 3, normalDepthBuffer );
+	reprojectKernel->SetArgument( 4, positionBuffer );
+	reprojectKernel->SetArgument( 5, historyAccumBuffer );
+	reprojectKernel->SetArgument( 6, historyMomentsBuffer );
+	reprojectKernel->SetArgument( 7, historyAlbedoBuffer );
+	reprojectKernel->SetArgument( 8, historyNormalDepthBuffer );
+
+	// keep the previous variant around when prewarming, otherwise release its program
+	if ( !old ) return;
+	if ( imgui.prewarm_kernels ) compiler.Store( oldKey, old );
+	else KernelCompiler::Release( old );
 }
 
 void Renderer::InitPostProcKernels()
 {
-	// post
-	post_prepKernel = new Kernel( "src/cl/postproc.cl", "prep" );
-	post_vignetKernel = new Kernel( "src/cl/postproc.cl", "vignetting" );
-	post_gammaKernel = new Kernel( "src/cl/postproc.cl", "gammaCorr" );
-	post_chromaticKernel = new Kernel( "src/cl/postproc.cl", "chromatic" );
-	displayKernel = new Kernel( "src/cl/postproc.cl", "display" );
+	// post: the fused pass without effects right away, for either source; the other combinations
+	// are built on the worker, toggling an effect never waits for the compiler
+	for ( int flags = 0; flags < POST_VARIANTS; flags++ )
+		if ( flags & ~POST_DENOISED ) compiler.Request( "src/cl/postproc.cl", "post", PostDefines( flags ) );
+		else postKernels[flags] = compiler.Build( "src/cl/postproc.cl", "post", PostDefines( flags ) );
+	post_demodulateKernel = compiler.Build( "src/cl/postproc.cl", "demodulate", {} );
+	post_atrousKernel = compiler.Build( "src/cl/postproc.cl", "atrous", {} );
+	post_remodulateKernel = compiler.Build( "src/cl/postproc.cl", "remodulate", {} );
 	// screenshot
-	saveImageKernel = new Kernel( "src/cl/postproc.cl", "saveImage" );
+	saveImageKernel = compiler.Build( "src/cl/postproc.cl", "saveImage", {} );
+	linearKernel = compiler.Build( "src/cl/postproc.cl", "linear", {} );
+	// statistics
+	statsKernel = compiler.Build( "src/cl/postproc.cl", "stats", {} );
+	statsFinalKernel = compiler.Build( "src/cl/postproc.cl", "statsFinal", {} );
 
 	// buffers
 	swap1Buffer = new Buffer( 4 * 4 * PIXELS );
 	swap2Buffer = new Buffer( 4 * 4 * PIXELS );
+	statsPartialBuffer = new Buffer( 4 * 4 * PIXELS / STATS_GROUP );
+	statsBuffer = new Buffer( sizeof( FrameStats ) );
 
 	// change screen so we write to opengl texture directly
 	screenBuffer = new Buffer( GetRenderTarget()->ID, 0, Buffer::TARGET );
 	screen = 0;
 
 	resetKernel->SetArguments( accumBuffer );
-	displayKernel->SetArguments( accumBuffer, screenBuffer );
 	saveImageKernel->SetArguments( screenBuffer, swap1Buffer );
+	linearKernel->SetArguments( accumBuffer, settingsBuffer, momentsBuffer, swap1Buffer );
+	statsKernel->SetArguments( accumBuffer, settingsBuffer, momentsBuffer, statsPartialBuffer, statsBuffer );
+	statsFinalKernel->SetArguments( statsPartialBuffer, PIXELS / STATS_GROUP, statsBuffer );
 }
 
 void Renderer::FocusCamera( int x, int y )
@@ -300,11 +780,13 @@ void Renderer::FocusCamera( int x, int y )
 	}
 }
 
-void Renderer::SaveFrame( const char* file )
+void Renderer::SaveFrame( const string& file, ExportFormat format )
 {
-	saveImageKernel->Run( PIXELS );
-	swap1Buffer->CopyFromDevice();
-	SaveImageF( file, SCRWIDTH, SCRHEIGHT, (float4*)swap1Buffer->hostBuffer );
+	// png gets the frame as displayed, the float formats the linear radiance; the readback of
+	// swap1 is queued before the next frame's kernels can overwrite it
+	if ( format == ExportFormat::PNG ) saveImageKernel->Run( PIXELS );
+	else linearKernel->Run( PIXELS );
+	exporter.Export( swap1Buffer, file, format );
 }
 
 void Renderer::MouseMove( int x, int y, bool mouse_active )
@@ -351,6 +833,8 @@ void Renderer::Gui()
 	if ( ImGui::CollapsingHeader( "General" ) )
 	{
 		if ( ImGui::Checkbox( "Performance", &(imgui.print_performance) ) );
+		ImGui::Text( "Texture pages: %i of %i resident, %i loaded", virtualTexture.resident, virtualTexture.pages, virtualTexture.loaded );
+		ImGui::Text( "BLASes: %i of %i resident, %i loaded", blasPool.resident, blasPool.blases, blasPool.loaded );
 	}
 	if ( ImGui::CollapsingHeader( "Camera" ) )
 	{
@@ -366,13 +850,24 @@ void Renderer::Gui()
 	{
 		if ( ImGui::Checkbox( "Anti-Aliasing", (bool*)(&(settings->antiAliasing)) ) ) camera.moved = true;
 		ImGui::Checkbox( "Reset every frame", &(imgui.reset_every_frame) );
+		if ( ImGui::Checkbox( "Megakernel", &(imgui.use_megakernel) ) ) camera.moved = true;
+		if ( ImGui::Checkbox( "Adaptive sampling", &(imgui.adaptive_sampling) ) ) camera.moved = true;
+		if ( imgui.adaptive_sampling )
+		{
+			ImGui::SliderFloat( "Error threshold", &(settings->adaptiveThreshold), .001f, .1f, "%.3f" );
+			ImGui::Text( "Active pixels: %i (%.1f%%)", imgui.active_pixels, imgui.active_pixels * 100.f / PIXELS );
+		}
+		if ( ImGui::Checkbox( "Temporal reprojection", &(imgui.temporal) ) ) camera.moved = true;
+		if ( imgui.temporal ) ImGui::SliderFloat( "History length", &(imgui.max_history), 1, 256, "%.0f" );
 		if ( ImGui::TreeNodeEx( "Recompile options", ImGuiTreeNodeFlags_DefaultOpen ) )
 		{
 			ImGui::Checkbox( "Russian Roulette", &(imgui.dummy_russian_roulette) );
 			ImGui::Checkbox( "Filter fireflies (don't use with kajiya)", &(imgui.filter_fireflies) );
+			ImGui::Checkbox( "Skydome lighting", &(imgui.use_skydome) );
 			if ( ImGui::TreeNodeEx( "Shading Type", ImGuiTreeNodeFlags_DefaultOpen ) ) {
 				ImGui::RadioButton( "Kajiya", &( imgui.dummy_shading_type ), 0 );
 				ImGui::RadioButton( "NEE", &( imgui.dummy_shading_type ), 1 );
+				ImGui::RadioButton( "NEE + MIS", &( imgui.dummy_shading_type ), 2 );
 				ImGui::TreePop( );
 			}
 			if ( ImGui::TreeNodeEx( "Sampling Type", ImGuiTreeNodeFlags_DefaultOpen ) ) {
@@ -380,34 +875,71 @@ void Renderer::Gui()
 					imgui.sampling_type = SAMPLING_HEMISPHERE;
 				if ( ImGui::RadioButton( "Cosine-weighted", &( imgui.dummy_sampling_type ), 1 ) )
 					imgui.sampling_type = SAMPLING_COSINE;
+				ImGui::Checkbox( "Scrambled Sobol sampler", &(imgui.use_sobol) );
 				ImGui::TreePop( );
 			}
-			if ( ImGui::Button( "Recompile OpenCL" ) )
-			{
-				switch ( imgui.dummy_shading_type )
-				{
-				case 0: imgui.shading_type = SHADING_SIMPLE;
-					break;
-				case 1: imgui.shading_type = SHADING_NEE;
-					break;
-				};
-				imgui.use_russian_roulette = imgui.dummy_russian_roulette;
-				//switch (imgui.dummy_bvh_type)
-				//{
-				//case 0: imgui.bvh_type = USE_BVH2;
-				//	break;
-				//case 1: imgui.bvh_type = USE_BVH4;
-				//	break;
-				//};
-				InitWavefrontKernels();
-				camera.moved = true;
+			if ( ImGui::TreeNodeEx( "Texture Filtering", ImGuiTreeNodeFlags_DefaultOpen ) ) {
+				if ( ImGui::RadioButton( "Nearest", &( imgui.dummy_texture_filter ), 0 ) )
+					imgui.texture_filter = TEXTURE_NEAREST;
+				if ( ImGui::RadioButton( "Bilinear", &( imgui.dummy_texture_filter ), 1 ) )
+					imgui.texture_filter = TEXTURE_BILINEAR;
+				if ( ImGui::RadioButton( "Trilinear", &( imgui.dummy_texture_filter ), 2 ) )
+					imgui.texture_filter = TEXTURE_TRILINEAR;
+				ImGui::TreePop( );
 			}
+			if ( ImGui::Button( "Recompile OpenCL" ) ) RequestWavefrontKernels();
+			if ( ImGui::Checkbox( "Prewarm variants", &(imgui.prewarm_kernels) ) && imgui.prewarm_kernels )
+				PrewarmWavefrontKernels();
+			if ( compiler.Busy() ) ImGui::Text( "Compiling kernels in the background..." );
+			if ( !compileError.empty() ) ImGui::TextWrapped( "Build error, kept the current kernels:\n%s", compileError.c_str() );
 			ImGui::TreePop();
 		}
 		ImGui::Checkbox( "Show Energy Levels", &(imgui.show_energy_levels) );
-		if ( imgui.show_energy_levels ) ImGui::Text( "%f", imgui.energy_total );
+		if ( imgui.show_energy_levels )
+		{
+			ImGui::Text( "Energy: %f", frameStats.energy );
+			ImGui::Text( "Luminance: min %.4f, mean %.4f, max %.4f", frameStats.minLum, frameStats.meanLum, frameStats.maxLum );
+			ImGui::Text( "NaN: %i, Inf: %i", frameStats.nanCount, frameStats.infCount );
+			float histogram[STATS_BINS];
+			for ( int i = 0; i < STATS_BINS; i++ ) histogram[i] = (float)frameStats.histogram[i];
+			ImGui::PlotHistogram( "log2 luminance", histogram, STATS_BINS, 0, 0, 0, FLT_MAX, ImVec2( 0, 60 ) );
+		}
 		//if ( ImGui::RadioButton( "Kajiya", &( settings->tracerType ), KAJIYA ) ) camera.moved = true;
 	}
+	if ( ImGui::CollapsingHeader( "Materials" ) )
+	{
+		// an edit uploads just the material, with the next frame
+		ImGui::SliderInt( "Material", &imgui.edit_material, 0, (int)scene.materials.size() - 1 );
+		Material mat = scene.materials[imgui.edit_material];
+		bool changed = ImGui::ColorEdit3( "Color", &mat.color.x );
+		changed |= ImGui::SliderFloat( "Specular", &mat.specular, 0, 1 );
+		changed |= ImGui::DragFloat3( "Emittance", &mat.emittance.x, .1f, 0, 1000 );
+		changed |= ImGui::Checkbox( "Light", &mat.isLight );
+		if ( changed ) scene.EditMaterial( imgui.edit_material ) = mat;
+		ImGui::Text( "Last edit: %i bytes", imgui.edit_bytes );
+	}
+	if ( ImGui::CollapsingHeader( "Primitives" ) )
+	{
+		// moves a primitive in the space of its BLAS; a triangle takes the vertices it shares along
+		ImGui::InputInt( "Primitive", &imgui.edit_primitive );
+		imgui.edit_primitive = std::clamp( imgui.edit_primitive, 0, (int)scene.primitives.size() - 1 );
+		const Primitive& prim = scene.primitives[imgui.edit_primitive];
+		int matIdx = prim.matIdx;
+		if ( ImGui::SliderInt( "Material##primitive", &matIdx, 0, (int)scene.materials.size() - 1 ) )
+			scene.EditPrimitive( imgui.edit_primitive ).matIdx = matIdx;
+		float3 offset( 0 );
+		if ( ImGui::DragFloat3( "Move", &offset.x, .01f ) && ( offset.x != 0 || offset.y != 0 || offset.z != 0 ) )
+		{
+			if ( prim.objType == SPHERE ) scene.EditPrimitive( imgui.edit_primitive ).objData.sphere.pos += float4( offset, 0 );
+			if ( prim.objType == TRIANGLE )
+			{
+				const Triangle& tri = prim.objData.triangle;
+				for ( uint v : { tri.v0, tri.v1, tri.v2 } ) scene.EditVertex( v ) += float4( offset, 0 );
+			}
+		}
+		ImGui::Checkbox( "Refit edited BLASes", &(imgui.refit_edits) );
+		ImGui::Text( "Last edit: %i bytes", imgui.edit_bytes );
+	}
 	if ( ImGui::CollapsingHeader( "BVH" ) )
 	{
 		// ImGui::Text( "(S)BVH surface overlap constant" );
@@ -433,21 +965,55 @@ void Renderer::Gui()
 			ImGui::TreePop();
 		}
 	}
+	if ( ImGui::CollapsingHeader( "Benchmark" ) )
+	{
+		static int frames = 32;
+		ImGui::SliderInt( "Frames", &frames, 1, 256 );
+		if ( ImGui::Button( "Wavefront vs. megakernel" ) ) Benchmark( frames );
+		ImGui::Text( "Wavefront: %.2fms", imgui.bench_wavefront_ms );
+		ImGui::Text( "Megakernel: %.2fms", imgui.bench_megakernel_ms );
+		if ( ImGui::Button( "Triangle intersection" ) ) BenchmarkTriangles();
+		ImGui::Text( "Moller-Trumbore: %.2fms", imgui.bench_mt_ms );
+		ImGui::Text( "Watertight: %.2fms", imgui.bench_watertight_ms );
+		ImGui::Text( "Woop + watertight edges: %.2fms", imgui.bench_woop_ms );
+	}
 	if ( ImGui::CollapsingHeader( "Post Processing" ) )
 	{
 		ImGui::SliderFloat( "Vignetting", &(imgui.vignet_strength), 0.0f, 1.0f, "%.2f" );
 		ImGui::SliderFloat( "Gamma Correction", &(imgui.gamma_strength), 0.0f, 2.0f, "%.2f" );
 		ImGui::SliderFloat( "Chromatic Abberation", &(imgui.chromatic_strength), 0.0f, 1.0f, "%.2f" );
+		ImGui::Checkbox( "Denoise", &(imgui.denoise) );
+		if ( imgui.denoise )
+		{
+			ImGui::SliderInt( "Iterations", &(imgui.denoise_iterations), 1, 5 );
+			ImGui::SliderFloat( "Colour sigma", &(imgui.denoise_sigma_color), .05f, 10.0f, "%.2f" );
+			ImGui::SliderFloat( "Normal sigma", &(imgui.denoise_sigma_normal), 1.0f, 256.0f, "%.0f" );
+			ImGui::SliderFloat( "Depth sigma", &(imgui.denoise_sigma_depth), .01f, 1.0f, "%.2f" );
+		}
 	}
 	if ( ImGui::CollapsingHeader( "Screenshotting" ) )
 	{
 		static char str0[128] = "";
 		ImGui::InputTextWithHint( "Screenshot", "filename", str0, IM_ARRAYSIZE( str0 ) );
+		ImGui::RadioButton( "PNG", &(imgui.export_format), (int)ExportFormat::PNG );
+		ImGui::SameLine();
+		ImGui::RadioButton( "HDR", &(imgui.export_format), (int)ExportFormat::HDR );
+		ImGui::SameLine();
+		ImGui::RadioButton( "PFM", &(imgui.export_format), (int)ExportFormat::PFM );
+		ExportFormat format = (ExportFormat)imgui.export_format;
 		if ( ImGui::Button( "Save Image" ) )
 		{
 			std::string input( str0 );
-			SaveFrame( ("screenshots/" + input + ".png").c_str() );
+			SaveFrame( "screenshots/" + input + FrameExporter::Extension( format ), format );
+		}
+		// every displayed frame is written as <filename>_00000, <filename>_00001, ...
+		if ( ImGui::Checkbox( "Record sequence", &(imgui.recording) ) && imgui.recording )
+		{
+			sequenceName = str0[0] ? str0 : "sequence";
+			imgui.recorded_frames = 0;
 		}
+		if ( imgui.recording ) ImGui::Text( "Frames recorded: %i", imgui.recorded_frames );
+		if ( exporter.Busy() ) ImGui::Text( "Writing..." );
 	}
 
 	//ImGui::ShowDemoWindow();
@@ -11,34 +11,73 @@ namespace Tmpl8
 
 #define SAMPLING_HEMISPHERE "SAMPLING_HEMISPHERE"
 #define SAMPLING_COSINE "SAMPLING_COSINE"
+#define SAMPLER_SOBOL "SAMPLER_SOBOL"
+
+#define TEXTURE_NEAREST "TEXTURE_NEAREST"
+#define TEXTURE_BILINEAR "TEXTURE_BILINEAR"
+#define TEXTURE_TRILINEAR "TEXTURE_TRILINEAR"
 
 #define USE_BVH2 "USE_BVH2"
 #define USE_BVH4 "USE_BVH4"
 
 #define USE_RUSSIAN_ROULETTE "RUSSIAN_ROULETTE"
 #define FILTER_FIREFLIES "FILTER_FIREFLIES"
+#define USE_SKYDOME "SKYDOME"
+
+// fused post processing variants
+#define POST_VIGNETTING 1
+#define POST_GAMMA 2
+#define POST_CHROMATIC 4
+#define POST_DENOISED 8
+#define POST_VARIANTS 16
 
 typedef struct ImGuiData
 {
 	string shading_type = SHADING_NEE;
 	string bvh_type = USE_BVH2;
 	string sampling_type = SAMPLING_COSINE;
+	string texture_filter = TEXTURE_TRILINEAR;
 	bool use_russian_roulette = true;
 
 	float vignet_strength = 0;
 	float chromatic_strength = 0;
 	float gamma_strength = .9f;
-	float energy_total = 0;
 	bool print_performance = false;
 	bool show_energy_levels = false;
 	bool reset_every_frame = false;
 	bool focus_mode = true;
 	bool filter_fireflies = true;
+	bool use_skydome = true;
+	bool use_sobol = true;
 
 	int dummy_bvh_type = 1;
 	int dummy_shading_type = 1;
 	int dummy_sampling_type = 0;
+	int dummy_texture_filter = 2;
 	bool dummy_russian_roulette = true;
+	bool prewarm_kernels = false;
+	bool use_megakernel = false;
+	float bench_wavefront_ms = 0;
+	float bench_megakernel_ms = 0;
+	float bench_mt_ms = 0;
+	float bench_watertight_ms = 0;
+	float bench_woop_ms = 0;
+	bool adaptive_sampling = false;
+	int active_pixels = PIXELS;
+	bool denoise = false;
+	int denoise_iterations = 4;
+	float denoise_sigma_color = 1.f;
+	float denoise_sigma_normal = 128.f;
+	float denoise_sigma_depth = .1f;
+	bool temporal = false;
+	float max_history = 32;
+	int export_format = 0; // ExportFormat
+	bool recording = false;
+	int recorded_frames = 0;
+	int edit_material = 0;
+	int edit_primitive = 0;
+	bool refit_edits = true; // refit the BLASes whose geometry was edited
+	int edit_bytes = 0; // uploaded for the last edits
 };
 
 class Renderer : public TheApp
@@ -56,13 +95,29 @@ public:
 	void Gui( );
 
 	void InitWavefrontKernels();
+	std::vector<string> WavefrontDefines( const string& shading, const string& sampling, bool russianRoulette );
+	void RequestWavefrontKernels( );
+	void PrewarmWavefrontKernels( );
+	void SwapWavefrontKernels( );
+	void SetWavefrontKernels( WavefrontKernels* kernels, const string& key );
 	void InitPostProcKernels();
 	void InitBuffers();
 	void PostProc( );
+	Kernel* PostKernel( int flags );
+	std::vector<string> PostDefines( int flags );
 	void RayTrace( );
-	void ComputeEnergy();
+	void UploadSettings( );
+	void UploadSceneEdits( );
+	void BeginFrame( );
+	void EndFrame( );
+	void ResetAccumulation( );
+	void Reproject( );
+	void ResolveAdaptive( );
+	void Benchmark( int frames );
+	void BenchmarkTriangles( );
+	void ComputeStats();
 	void FocusCamera( int x, int y );
-	void SaveFrame( const char* file );
+	void SaveFrame( const string& file, ExportFormat format );
 
 	// data members
 	float deltaTime;
@@ -75,39 +130,90 @@ public:
 	ImGuiData imgui;
 
 	Kernel* resetKernel;
-	Kernel* post_prepKernel;
-	Kernel* post_vignetKernel;
-	Kernel* post_gammaKernel;
-	Kernel* post_chromaticKernel;
+	Kernel* postKernels[POST_VARIANTS] = {}; // fused post kernel per combination of POST_ flags, 0 until built
+	int postFlags = 0; // the variant used last
+	Kernel* post_demodulateKernel;
+	Kernel* post_atrousKernel;
+	Kernel* post_remodulateKernel;
 	Kernel* saveImageKernel;
+	Kernel* linearKernel;
+	Kernel* statsKernel;
+	Kernel* statsFinalKernel;
+	Kernel* benchTrianglesKernel = 0;
 
 	// Buffers
 	Buffer* matBuffer;
 	Buffer* primBuffer;
+	Buffer* triAccelBuffer; // per primitive: the Woop transform of its triangle
+	Buffer* vertexBuffer;
+	Buffer* texcoordBuffer; // one per vertex
 
 	// Used for post processing
 	Buffer* swap1Buffer;
 	Buffer* swap2Buffer;
 
+	// frame statistics, read back without blocking into the slot of their frame; the gui shows
+	// those of the last frame that is done
+	Buffer* statsPartialBuffer;
+	Buffer* statsBuffer;
+	FrameStats frameStats = {};
+	FrameStats statsRead[FRAMES_IN_FLIGHT] = {};
+	int activePixelsRead[FRAMES_IN_FLIGHT] = {}; // Settings::numActive, for the gui as well
+
+	// screenshots and image sequences, encoded on a worker thread
+	FrameExporter exporter;
+	string sequenceName = "sequence";
+
 	Buffer* accumBuffer;
+	Buffer* momentsBuffer; // per pixel: sum of luminance, sum of squares, sample count, last accumulated luminance
+	Buffer* activePixelBuffer;
+	Buffer* albedoBuffer; // first hit features for the denoiser, accumulated like accumBuffer
+	Buffer* normalDepthBuffer;
+	Buffer* positionBuffer; // first hit of the last sample, for temporal reprojection
+	// previous frame's accumulation, kept across a camera move to reproject from
+	Buffer* historyAccumBuffer;
+	Buffer* historyMomentsBuffer;
+	Buffer* historyAlbedoBuffer;
+	Buffer* historyNormalDepthBuffer;
+	Camera prevCam; // camera of the last rendered frame
 	Buffer* screenBuffer;
-	Buffer* texBuffer;
+	VirtualTexture virtualTexture; // the texels, paged in as the kernels ask for them
+	Buffer* skyCdfBuffer;
 
 	Buffer* camBuffer;
 	Buffer* lightBuffer;
 
-	// Wavefront kernels
+	// Wavefront kernels, compiled in the background and swapped in at a frame boundary
+	KernelCompiler compiler;
+	WavefrontKernels* wavefront = 0;
+	string wavefrontKey, requestedKey;
+	string compileError; // of the last variant that failed to build, shown in the gui
+	string requestedShading;
+	bool requestedRussianRoulette;
 	Kernel* generateKernel;
+	Kernel* resumeKernel;
 	Kernel* extendKernel;
 	Kernel* shadeKernel;
 	Kernel* connectKernel;
-	Kernel* displayKernel;
+	Kernel* reconnectKernel;
 	Kernel* focusKernel;
+	Kernel* megaKernel;
+	Kernel* compactKernel;
+	Kernel* resolveKernel;
+	Kernel* reprojectKernel;
 
 	Buffer* ray1Buffer;
 	Buffer* ray2Buffer;
 	Buffer* shadowRayBuffer;
 	Buffer* settingsBuffer;
+	// settings go up from a snapshot of their own, in order on the main queue; frameDone marks the
+	// end of each frame's work
+	Settings settingsStaging[FRAMES_IN_FLIGHT];
+	std::vector<uchar> editStaging[FRAMES_IN_FLIGHT]; // the changed ranges of scene edits, on their way up
+	cl_event settingsUploaded[FRAMES_IN_FLIGHT] = {};
+	cl_event frameDone[FRAMES_IN_FLIGHT] = {};
+	int uploadSlot = 0, frameSlot = 0;
+	bool glEventSync = false; // cl_khr_gl_event: gl waits for the release of the render target by itself
 	Buffer* seedBuffer;
 	Buffer* primIdxBuffer;
 	Buffer* bvhTreeBuffer;
@@ -117,6 +223,13 @@ public:
 	Buffer* bvhIdxBuffer;
 	Buffer* tlasNodeBuffer;
 	Buffer* blasNodeBuffer;
+	BlasPool blasPool; // the BLAS nodes and indices, bvhNodeBuffer and bvhIdxBuffer are its pools
+	Buffer* deferBuffer; // rays waiting for a BLAS to become resident
+	Buffer* deferCountBuffer;
+	// shadow rays waiting for a BLAS, retried from one queue while the next fills, swapped per frame
+	Buffer* shadowDefer1Buffer, * shadowDefer2Buffer;
+	Buffer* shadowDeferCount1Buffer, * shadowDeferCount2Buffer;
+	Buffer* pathBuffer; // per pixel: the PathState of the sample in flight, added once all its rays are done
 };
 
 } // namespace Tmpl8
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include "precomp.h"
+
+void Residency::Init( int _elements, int _usedOffset )
+{
+	elements_ = _elements, usedOffset_ = _usedOffset;
+	prev_.assign( _elements, -1 ), next_.assign( _elements, -1 ), lastUsed_.assign( _elements, 0 );
+	feedbackBuffer = new Buffer( sizeof( uint ) * ( _usedOffset + _elements ) );
+	feedbackBuffer->Clear( );
+	for ( int i = 0; i < FRAMES_IN_FLIGHT; i++ ) feedback_[i].assign( _usedOffset + _elements, 0 );
+}
+void Residency::Readback( int _slot )
+{
+	clEnqueueReadBuffer( Kernel::GetQueue( ), feedbackBuffer->deviceBuffer, CL_FALSE, 0, feedbackBuffer->size, feedback_[_slot].data( ), 0, 0, 0 );
+	feedbackBuffer->Clear( );
+}
+const uint* Residency::BeginFrame( int _slot )
+{
+	frame_++;
+	entries_[_slot].clear( );
+	const uint* feedback = feedback_[_slot].data( );
+	// elements out of the order are pinned, or were evicted since the frame read them
+	for ( int element = 0; element < elements_; element++ )
+		if ( feedback[usedOffset_ + element] && Listed( element ) ) Touch( element );
+	return feedback;
+}
+void Residency::Touch( int _element )
+{
+	lastUsed_[_element] = frame_;
+	if ( head_ == _element ) return;
+	if ( prev_[_element] >= 0 ) Unlink( _element );
+	prev_[_element] = -1, next_[_element] = head_;
+	if ( head_ >= 0 ) prev_[head_] = _element;
+	else tail_ = _element;
+	head_ = _element;
+}
+void Residency::Unlink( int _element )
+{
+	if ( !Listed( _element ) ) return;
+	if ( prev_[_element] >= 0 ) next_[prev_[_element]] = next_[_element];
+	else head_ = next_[_element];
+	if ( next_[_element] >= 0 ) prev_[next_[_element]] = prev_[_element];
+	else tail_ = prev_[_element];
+	prev_[_element] = next_[_element] = -1;
+}
+int Residency::Victim( ) const
+{
+	return tail_ >= 0 && lastUsed_[tail_] != frame_ ? tail_ : -1;
+}
+void Residency::SetEntry( int _slot, int _idx, int _value )
+{
+	entries_[_slot].push_back( _idx ), entries_[_slot].push_back( _value );
+}
+void Residency::WriteEntries( int _slot, Buffer* _table )
+{
+	const std::vector<int>& entries = entries_[_slot];
+	for ( size_t i = 0; i < entries.size( ); i += 2 )
+		clEnqueueWriteBuffer( Kernel::GetQueue( ), _table->deviceBuffer, CL_FALSE, sizeof( int ) * entries[i], sizeof( int ), &entries[i + 1], 0, 0, 0 );
+}
@@ -0,0 +1,30 @@
+#pragma once
+// what the virtual texture and the BLAS pool share: the elements of a device pool in least recently
+// used order, the feedback the kernels write every frame, read back into a frame slot, and the
+// entries of a device table, written from staging in that slot
+class Residency
+{
+public:
+	// feedback: a request count, requests up to usedOffset, then a used flag per element
+	void Init( int elements, int usedOffset );
+	// reads this frame's feedback back into the slot without blocking, then clears it for the next
+	void Readback( int slot );
+	// starts a frame with the feedback of the slot; the elements it used that are in the order
+	// become the most recent, so they are the last to go
+	const uint* BeginFrame( int slot );
+	void Touch( int element );
+	void Unlink( int element );
+	// the least recently used element, -1 when there is none the frame did not use
+	int Victim( ) const;
+	// a table entry, kept in the slot until the frame is done as the host copy may change again
+	void SetEntry( int slot, int idx, int value );
+	void WriteEntries( int slot, Buffer* table );
+	Buffer* feedbackBuffer = 0;
+private:
+	bool Listed( int element ) const { return head_ == element || prev_[element] >= 0; }
+	int elements_ = 0, usedOffset_ = 0;
+	std::vector<int> prev_, next_, lastUsed_; // most recent first
+	int head_ = -1, tail_ = -1, frame_ = 0;
+	std::vector<uint> feedback_[FRAMES_IN_FLIGHT];
+	std::vector<int> entries_[FRAMES_IN_FLIGHT]; // index, value
+};
@@ -1,15 +1,12 @@
 #include "precomp.h"
-#define TINYOBJLOADER_IMPLEMENTATION
-//Optional. define TINYOBJLOADER_USE_MAPBOX_EARCUT gives robust triangulation. Requires C++11
-//#define TINYOBJLOADER_USE_MAPBOX_EARCUT
-#include "tiny_obj_loader.h"
 namespace Tmpl8
 {
-	Scene::Scene( )
+	Scene::Scene( ) : textureManager( textures )
 	{
-		bvh2 = new BVH2( primitives, blasNodes );
-		// load skydome first
-		LoadTexture( "assets/office.hdr", "skydome" );
+		bvh2 = new BVH2( primitives, vertices, blasNodes );
+		// skydome first, its texture is read with the models
+		const std::string skydome = "assets/office.hdr";
+		AddMaterial( "skydome" );
 		// materials
 		auto& grey = AddMaterial( "grey" );
 		grey.color = float4( 0.231f, 0.266f, 0.294f, 0 );
@@ -42,33 +39,72 @@ namespace Tmpl8
 		blueLight.color = float4( 1.f, .1f, .1f, 0 );
 		blueLight.emittance = float4( 1.f, .1f, .1f, 0 ) * 100;
 
+		// models, one BLAS per group; glTF files get a BLAS per mesh, instanced by their nodes
 #if 1
-		int startPrims = primitives.size( );
-		//LoadModel( "assets/robo-orb/robo.obj", "white" );
-		//LoadModel( "assets/robo-orb/robo-lights.obj", "yellow-light" );
-		//bvh2->BuildBLAS( true, startPrims );
-		
-		startPrims = primitives.size( );
-		LoadModel( "assets/terrarium_bot/bot.obj", "white" );
-		LoadModel( "assets/terrarium_bot/bot-glass.obj", "white-glass" );
-		bvh2->BuildBLAS( true, startPrims );
-		startPrims = primitives.size( );
-		LoadModel( "assets/hallway/hallway.obj", "grey", {}, true );
-		LoadModel( "assets/hallway/hallway_lights_top.obj", "green-light" );
-		LoadModel( "assets/hallway/hallway_lights_top_left.obj", "red-light" );
-		LoadModel( "assets/hallway/hallway_lights_top_right.obj", "red-light" );
-		LoadModel( "assets/hallway/hallway_lights_back.obj", "red-light" );
-		LoadModel( "assets/hallway/hallway_lights_front.obj", "white-light" );
-		bvh2->BuildBLAS( true, startPrims );
+		std::vector<ModelDesc> gltfs = { { "assets/terrarium_bot/scene.gltf", "", { 0, 0, 0 }, false, .01f } };
+		std::vector<std::vector<ModelDesc>> blases = {
+			{ { "assets/hallway/hallway.obj", "grey", {}, true },
+				{ "assets/hallway/hallway_lights_top.obj", "green-light" },
+				{ "assets/hallway/hallway_lights_top_left.obj", "red-light" },
+				{ "assets/hallway/hallway_lights_top_right.obj", "red-light" },
+				{ "assets/hallway/hallway_lights_back.obj", "red-light" },
+				{ "assets/hallway/hallway_lights_front.obj", "white-light" } } };
 #else
-		LoadModel( "assets/sponza/sponza.obj", "white" );
-		// start of separate prims
-		int startPrims = primitives.size( );
-		AddQuad( float3( -2, 0, -7.5f ), float3( 2, 0, -7.5f ), float3( 2, 4, -7.5f ), float3( -2, 4, -7.5f ), 0, 0, 0, 0, "yellow-light" );
-		bvh2->BuildBLAS( true, startPrims );
+		std::vector<ModelDesc> gltfs = { { "assets/robo-orb/scene.gltf" } };
+		std::vector<std::vector<ModelDesc>> blases = { { { "assets/sponza/sponza.obj", "white" } } };
 #endif
-		// bvh4 as last
-		bvh4 = new BVH4( *bvh2 );
+		// parsing, decoding and building take long; the cache skips all of it when nothing changed
+		SceneCache cache( "assets/scene.cache" );
+		cache.AddKey( skydome );
+		for ( const auto& models : blases ) {
+			for ( const ModelDesc& model : models ) {
+				cache.AddKey( model.file );
+				cache.AddKey( model.material );
+				cache.AddKey( model.pos );
+				cache.AddKey( model.forceMaterial );
+			}
+			cache.AddKey( std::string( "BLAS" ) );
+		}
+		for ( const ModelDesc& model : gltfs ) {
+			cache.AddKey( model.file );
+			cache.AddKey( model.material );
+			cache.AddKey( model.pos );
+			cache.AddKey( model.forceMaterial );
+			cache.AddKey( model.scale );
+		}
+		for ( const auto& pair : matMap_ ) {
+			const Material& mat = materials[pair.second];
+			cache.AddKey( pair.first );
+			cache.AddKey( mat.color ), cache.AddKey( mat.absorption ), cache.AddKey( mat.emittance );
+			cache.AddKey( mat.specular ), cache.AddKey( mat.n1 ), cache.AddKey( mat.n2 );
+			cache.AddKey( mat.isDieletric ), cache.AddKey( mat.isLight );
+		}
+		cache.AddKey( bvh2->alpha );
+		cache.AddKey( BVH_BINS );
+		cache.AddKey( MIN_LEAF_PRIMS );
+		if ( !cache.Load( *this ) ) {
+			ReadTexture( skydome, materials[0], false ); // looked up per texel, without a level of detail
+			for ( const auto& models : blases ) {
+				int startPrims = primitives.size( );
+				for ( const ModelDesc& model : models )
+					LoadModel( model.file, model.material, model.pos, model.forceMaterial );
+				bvh2->BuildBLAS( true, startPrims );
+			}
+			for ( const ModelDesc& model : gltfs ) LoadGltfModel( model );
+			// bvh4 as last
+			bvh4 = new BVH4( *bvh2 );
+			BuildLightTable( );
+			BuildSkydomeCdf( );
+			std::vector<std::string> images = textureManager.Files( );
+			sources.insert( sources.end( ), images.begin( ), images.end( ) );
+			textureManager.Report( );
+			cache.Save( *this );
+		}
+		// the cache could not be written: the texels stay in memory
+		if ( !texels ) texels = textures.data( );
+		// not cached: derived from the primitives and vertices, and quick to build
+		triAccels.resize( primitives.size( ) );
+		util::ParallelFor( (int)primitives.size( ), [&]( int i ) { BuildTriAccel( i ); } );
 		SetTime( 0 );
 	}
 	Scene::~Scene( )
@@ -92,13 +128,23 @@ namespace Tmpl8
 		default.texIdx = -1;
 		default.texH = 0;
 		default.texW = 0;
+		default.texFormat = TEX_SRGB8;
+		default.texLevels = 0;
+		default.texPage = 0;
 		default.isLight = false;
+		default.emittance = float4( 0 );
+		default.metalRough = default.normalMap = default.emissiveMap = { -1, 0, 0, TEX_RGBA8, 0 };
 		materials.push_back( default );
 		matMap_[name] = matIdx_;
 		matIdx_++;
 		return materials[matIdx_ - 1];
 	}
 
+	static float Luminance( float4 c )
+	{
+		return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+	}
+
 	static float SphereArea( float r2 )
 	{
 		return 4 * PI * r2;
@@ -131,6 +177,7 @@ namespace Tmpl8
 		prim.objData.sphere.r2 = radius * radius;
 		prim.objData.sphere.invr = 1 / radius;
 		prim.matIdx = matMap_[material];
+		prim.lightPdf = 0;
 		prim.area = SphereArea( prim.objData.sphere.r2 );
 		primitives.push_back( prim );
 		if ( materials[matMap_[material]].isLight )
@@ -144,6 +191,7 @@ namespace Tmpl8
 		prim.objData.plane.N = N;
 		prim.objData.plane.d = d;
 		prim.matIdx = matMap_[material];
+		prim.lightPdf = 0;
 		primitives.push_back( prim );
 		if ( materials[matMap_[material]].isLight )
 			lights.push_back( primitives.size( ) - 1 );
@@ -155,104 +203,416 @@ namespace Tmpl8
 		AddTriangle( v2, v3, v0, uv2, uv3, uv1, material, _flipNormal );
 	}
 
-	void Scene::AddTriangle( float3 v0, float3 v1, float3 v2, float2 uv0, float2 uv1, float2 uv2, const std::string material, bool _flipNormal )
+	// fills a triangle primitive from vertices that are already in place; shared by AddTriangle and the parallel model loaders
+	static void InitTriangle( Primitive& prim, const std::vector<float4>& vertices, uint v0, uint v1, uint v2, int matIdx )
 	{
-		Primitive prim;
 		prim.objType = TRIANGLE;
 		prim.objData.triangle.v0 = v0;
 		prim.objData.triangle.v1 = v1;
 		prim.objData.triangle.v2 = v2;
-		prim.objData.triangle.uv0 = uv0;
-		prim.objData.triangle.uv1 = uv1;
-		prim.objData.triangle.uv2 = uv2;
-		prim.objData.triangle.N = normalize( cross( v1 - v0, v2 - v0 ) );
-		if ( _flipNormal ) prim.objData.triangle.N *= -1;
-		prim.objData.triangle.centroid = ( v0 + v1 + v2 ) * ( 1 / 3.f );
-		prim.matIdx = matMap_[material];
-		prim.area = TriangleArea( v0, v1, v2 );
+		prim.matIdx = matIdx;
+		prim.lightPdf = 0;
+		prim.area = TriangleArea( vertices[v0], vertices[v1], vertices[v2] );
+	}
+	void Scene::AddTriangle( float3 v0, float3 v1, float3 v2, float2 uv0, float2 uv1, float2 uv2, const std::string material, bool _flipNormal )
+	{
+		uint first = (uint)vertices.size( );
+		vertices.push_back( float4( v0, 0 ) );
+		vertices.push_back( float4( v1, 0 ) );
+		vertices.push_back( float4( v2, 0 ) );
+		// uv0 goes with v2 and uv2 with v0, as it always did
+		texcoords.push_back( uv2 );
+		texcoords.push_back( uv1 );
+		texcoords.push_back( uv0 );
+		// the normal follows the winding, flipping it swaps two vertices
+		Primitive prim;
+		InitTriangle( prim, vertices, first, _flipNormal ? first + 2 : first + 1, _flipNormal ? first + 1 : first + 2, matMap_[material] );
 		primitives.push_back( prim );
-		if ( materials[matMap_[material]].isLight )
+		if ( materials[prim.matIdx].isLight )
 			lights.push_back( primitives.size( ) - 1 );
 	}
-	//https://pastebin.com/PZYVnJCd
 	void Scene::LoadModel( std::string _filename, const std::string _defaultMat, float3 _pos, bool _forceDefaultMat )
 	{
 		cout << "Loading model: " << _filename << "..." << endl;
-		tinyobj::ObjReaderConfig readerConfig;
-		tinyobj::ObjReader reader;
-		if ( !reader.ParseFromFile( _filename, readerConfig ) ) {
-			if ( !reader.Error( ).empty( ) ) std::cerr << "E/TinyObjReader: " << reader.Error( ) << std::endl;
+		Timer t;
+		ObjMesh mesh;
+		if ( !LoadObj( _filename, mesh ) ) {
+			std::cerr << "E/LoadObj: could not load " << _filename << std::endl;
 			return;
 		}
-		if ( !reader.Warning( ).empty( ) ) std::cout << "W/TinyObjReader: " << reader.Warning( ) << std::endl;
-		auto& attrib = reader.GetAttrib( );
-		auto& shapes = reader.GetShapes( );
-		// load textures
-		auto& materials = reader.GetMaterials( );
-		for ( const auto& mat : materials ) {
-			if ( !mat.diffuse_texname.empty( ) )
-				LoadTexture( util::GetBaseDir( _filename ) + mat.diffuse_texname, mat.diffuse_texname );
+		sources.push_back( _filename );
+		sources.insert( sources.end( ), mesh.libraries.begin( ), mesh.libraries.end( ) );
+		// decode the textures together, then resolve every obj material to a scene material once, not per face;
+		// a texture gets one material, named after it, however many obj materials and files use it
+		std::vector<int> texHandle( mesh.materials.size( ), -1 );
+		for ( size_t i = 0; i < mesh.materials.size( ); i++ ) {
+			const std::string& tex = mesh.materials[i].diffuseTexture;
+			if ( !tex.empty( ) && !_forceDefaultMat && !matMap_.count( tex ) )
+				texHandle[i] = textureManager.Request( util::GetBaseDir( _filename ) + tex, true );
 		}
-		for ( size_t s = 0; s < shapes.size( ); s++ ) {
-			// start primitive index for bvh
-			// loop over faces(polygon)
-			size_t index_offset = 0;
-			for ( size_t f = 0; f < shapes[s].mesh.num_face_vertices.size( ); f++ ) {
-				size_t fv = size_t( shapes[s].mesh.num_face_vertices[f] );
-				// loop over vertices, texcoords of the face.
-				std::vector<float3> vertices;
-				std::vector<float2> texcoords;
-				std::vector<float4> colors;
-				for ( size_t v = 0; v < fv; v++ ) {
-					// access to vertex
-					tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-					tinyobj::real_t vx = attrib.vertices[3 * size_t( idx.vertex_index ) + 0];
-					tinyobj::real_t vy = attrib.vertices[3 * size_t( idx.vertex_index ) + 1];
-					tinyobj::real_t vz = attrib.vertices[3 * size_t( idx.vertex_index ) + 2];
-					// add vertex
-					vertices.push_back( float3( vx, vy, vz ) + _pos );
-					// add texcoords
-					tinyobj::real_t tx = 0, ty = 0;
-					if ( idx.texcoord_index >= 0 ) {
-						tx = attrib.texcoords[2 * size_t( idx.texcoord_index ) + 0];
-						ty = 1.0 - attrib.texcoords[2 * size_t( idx.texcoord_index ) + 1];
-					}
-					texcoords.push_back( float2( tx, ty ) );
-					// colors
-					tinyobj::real_t r = attrib.colors[3 * idx.vertex_index + 0];
-					tinyobj::real_t g = attrib.colors[3 * idx.vertex_index + 1];
-					tinyobj::real_t b = attrib.colors[3 * idx.vertex_index + 2];
-					colors.push_back( float4( r, g, b, 1 ) );
-				}
-				// reverse the vector to get the correct vertex order
-				std::reverse( vertices.begin( ), vertices.end( ) );
-				// get material
-				int matIdx = shapes[s].mesh.material_ids[f];
-				auto tex = _defaultMat; ;
-				if ( matIdx >= 0 ) tex = materials[matIdx].diffuse_texname;
-				if ( tex.empty( ) || _forceDefaultMat ) tex = _defaultMat;
-				// add triangle
-				for ( size_t v = 0, t = 0; v < vertices.size( ); )
-					AddTriangle( vertices[v++], vertices[v++], vertices[v++],
-						texcoords[t++], texcoords[t++], texcoords[t++], tex );
-				index_offset += fv;
+		textureManager.Flush( );
+		std::vector<int> matIdx( mesh.materials.size( ) );
+		for ( size_t i = 0; i < mesh.materials.size( ); i++ ) {
+			const std::string& tex = mesh.materials[i].diffuseTexture;
+			if ( texHandle[i] >= 0 && !matMap_.count( tex ) ) SetAlbedoMap( AddMaterial( tex ), textureManager.Get( texHandle[i] ) );
+			matIdx[i] = matMap_[tex.empty( ) || _forceDefaultMat ? _defaultMat : tex];
+		}
+		int defaultIdx = matMap_[_defaultMat];
+		// a scene vertex per distinct position and texcoord pair the faces use
+		int start = (int)primitives.size( ), count = (int)mesh.faces.size( );
+		std::vector<uint> corners( 3 * (size_t)count );
+		std::unordered_map<uint64_t, uint> vertexIdx;
+		vertexIdx.reserve( mesh.vertices.size( ) );
+		for ( size_t i = 0; i < corners.size( ); i++ ) {
+			const ObjFace& face = mesh.faces[i / 3];
+			int v = face.v[i % 3], t = face.t[i % 3];
+			auto it = vertexIdx.insert( { (uint64_t)v << 32 | (uint)( t + 1 ), (uint)vertices.size( ) } );
+			corners[i] = it.first->second;
+			if ( !it.second ) continue;
+			vertices.push_back( float4( mesh.vertices[v] + _pos, 0 ) );
+			texcoords.push_back( t < 0 ? float2( 0, 0 ) : float2( mesh.texcoords[t].x, 1 - mesh.texcoords[t].y ) );
+		}
+		// reserve once and fill the triangles in parallel
+		primitives.resize( start + count );
+		util::ParallelFor( count, [&]( int i ) {
+			const ObjFace& face = mesh.faces[i];
+			int mat = face.material < 0 ? defaultIdx : matIdx[face.material];
+			// reversed, as the scenes have always loaded obj faces; the normal follows this winding
+			InitTriangle( primitives[start + i], vertices, corners[3 * i + 2], corners[3 * i + 1], corners[3 * i], mat );
+		} );
+		for ( int i = start; i < start + count; i++ )
+			if ( materials[primitives[i].matIdx].isLight ) lights.push_back( i );
+		printf( "...Finished loading model, %i triangles, %i vertices in %.2fs\n", count, (int)vertexIdx.size( ), t.elapsed( ) );
+	}
+	void Scene::LoadGltfModel( const ModelDesc& _model )
+	{
+		cout << "Loading model: " << _model.file << "..." << endl;
+		Timer t;
+		GltfModel gltf;
+		if ( !LoadGltf( _model.file, gltf ) ) {
+			std::cerr << "E/LoadGltf: could not load " << _model.file << std::endl;
+			return;
+		}
+		sources.push_back( _model.file );
+		sources.insert( sources.end( ), gltf.files.begin( ), gltf.files.end( ) );
+		// materials; every map is requested first so they all decode at once
+		struct MapHandles { int baseColor, emissive, metalRough, normal; };
+		std::vector<MapHandles> maps;
+		auto request = [&]( const std::string& file, bool srgb ) { return file.empty( ) ? -1 : textureManager.Request( file, srgb ); };
+		if ( !_model.forceMaterial ) for ( const GltfMaterial& m : gltf.materials )
+			maps.push_back( { request( m.baseColorMap, true ), request( m.emissiveMap, true ), request( m.metalRoughMap, false ), request( m.normalMap, false ) } );
+		textureManager.Flush( );
+		auto map = [&]( int handle ) { return handle < 0 ? TexRef{ -1, 0, 0, TEX_RGBA8, 0 } : textureManager.Get( handle ); };
+		int defaultMat = _model.material.empty( ) ? -1 : matMap_[_model.material];
+		if ( defaultMat == -1 ) {
+			// the glTF default: white, fully rough
+			defaultMat = matIdx_;
+			AddMaterial( _model.file + ":default" ).color = float4( 1, 1, 1, 0 );
+		}
+		std::vector<int> matIdx;
+		for ( size_t i = 0; i < gltf.materials.size( ); i++ ) {
+			if ( _model.forceMaterial ) {
+				matIdx.push_back( defaultMat );
+				continue;
+			}
+			const GltfMaterial& m = gltf.materials[i];
+			TexRef baseColor = map( maps[i].baseColor ), emissive = map( maps[i].emissive );
+			TexRef metalRough = map( maps[i].metalRough ), normal = map( maps[i].normal );
+			matIdx.push_back( matIdx_ );
+			Material& mat = AddMaterial( _model.file + ":" + m.name );
+			mat.color = float4( m.baseColor.x, m.baseColor.y, m.baseColor.z, 0 );
+			mat.texIdx = baseColor.idx, mat.texW = baseColor.w, mat.texH = baseColor.h;
+			mat.texFormat = baseColor.format, mat.texLevels = baseColor.levels;
+			// a mirror bounce for smooth metal; the map varies it per texel
+			mat.specular = metalRough.idx == -1 ? m.metallic * ( 1 - m.roughness ) : m.metallic;
+			mat.metalRough = metalRough;
+			mat.normalMap = normal;
+			if ( m.transmission > 0 ) {
+				mat.isDieletric = true;
+				mat.n1 = 1, mat.n2 = 1.5f; // the glTF default ior
+			}
+			// uniform emission makes an area light, a map only adds what it shows when hit
+			if ( m.emissive.x + m.emissive.y + m.emissive.z > 0 ) {
+				mat.emittance = float4( m.emissive.x, m.emissive.y, m.emissive.z, 0 );
+				if ( emissive.idx == -1 ) mat.isLight = true;
+				else mat.emissiveMap = emissive;
+			}
+		}
+		auto materialOf = [&]( const GltfPrimitive& prim ) {
+			return prim.material >= 0 && prim.material < (int)matIdx.size( ) ? matIdx[prim.material] : defaultMat;
+		};
+		// the vertices of a primitive, in object space or transformed by T, and triangles indexing them
+		auto addTriangles = [&]( const GltfPrimitive& prim, const mat4* T ) {
+			int mat = materialOf( prim );
+			uint first = (uint)vertices.size( );
+			vertices.resize( first + prim.positions.count );
+			texcoords.resize( first + prim.positions.count );
+			util::ParallelFor( prim.positions.count, [&]( int i ) {
+				vertices[first + i] = float4( T ? TransformPosition( prim.positions.Float3( i ), *T ) : prim.positions.Float3( i ), 0 );
+				texcoords[first + i] = prim.texcoords.data ? prim.texcoords.Float2( i ) : float2( 0, 0 );
+			} );
+			int start = (int)primitives.size( );
+			int count = ( prim.indices.data ? prim.indices.count : prim.positions.count ) / 3;
+			primitives.resize( start + count );
+			util::ParallelFor( count, [&]( int i ) {
+				uint v[3];
+				for ( int j = 0; j < 3; j++ ) v[j] = first + ( prim.indices.data ? prim.indices.Index( 3 * i + j ) : 3 * i + j );
+				InitTriangle( primitives[start + i], vertices, v[0], v[1], v[2], mat );
+			} );
+			if ( materials[mat].isLight )
+				for ( int i = start; i < start + count; i++ ) lights.push_back( i );
+		};
+		// a BLAS per mesh in object space, and an instance per node that uses it
+		mat4 model = mat4::Translate( _model.pos ) * mat4::Scale( _model.scale );
+		std::vector<std::vector<mat4>> instances( gltf.meshes.size( ) );
+		for ( const GltfInstance& instance : gltf.instances ) instances[instance.mesh].push_back( model * instance.transform );
+		for ( size_t m = 0; m < gltf.meshes.size( ); m++ ) {
+			if ( instances[m].empty( ) ) continue;
+			int start = (int)primitives.size( );
+			for ( const GltfPrimitive& prim : gltf.meshes[m].primitives )
+				if ( !materials[materialOf( prim )].isLight ) addTriangles( prim, 0 );
+			if ( (int)primitives.size( ) == start ) continue;
+			bvh2->BuildBLAS( true, start );
+			// BuildBLAS added an identity instance
+			BVHInstance blas = blasNodes.back( );
+			blasNodes.pop_back( );
+			for ( const mat4& T : instances[m] ) {
+				memcpy( blas.invT, T.Inverted( ).cell, sizeof( float ) * 16 );
+				blasNodes.push_back( blas );
 			}
-			// build BLAS for this shape
 		}
-		printf( "...Finished loading model\n" );
+		// NEE samples lights straight from their primitives, so emitters go into one BLAS in world space
+		int start = (int)primitives.size( );
+		for ( size_t m = 0; m < gltf.meshes.size( ); m++ )
+			for ( const mat4& T : instances[m] )
+				for ( const GltfPrimitive& prim : gltf.meshes[m].primitives )
+					if ( materials[materialOf( prim )].isLight ) addTriangles( prim, &T );
+		if ( (int)primitives.size( ) > start ) bvh2->BuildBLAS( true, start );
+		printf( "...Finished loading model, %i meshes, %i instances in %.2fs\n", (int)gltf.meshes.size( ), (int)gltf.instances.size( ), t.elapsed( ) );
 	}
-	void Scene::LoadTexture( std::string filename, std::string name )
+	void Scene::SetAlbedoMap( Material& mat, const TexRef& tex )
 	{
-		int width, height, n;
-		float3* data = LoadImageF( filename.c_str( ), width, height, n );
-		int size = width * height;
-		int texIdx = textures.size( );
-		textures.insert( textures.end( ), &data[0], &data[size] );
-		auto& mat = AddMaterial( name );
-		mat.texIdx = texIdx;
+		mat.texIdx = tex.idx;
 		mat.isDieletric = false;
-		mat.texW = width;
-		mat.texH = height;
+		mat.texW = tex.w;
+		mat.texH = tex.h;
+		mat.texFormat = tex.format;
+		mat.texLevels = tex.levels;
+	}
+	void Scene::ReadTexture( std::string filename, Material& mat, bool _mips )
+	{
+		SetAlbedoMap( mat, ReadTexture( filename, true, _mips ) );
+	}
+	TexRef Scene::ReadTexture( std::string filename, bool _srgb, bool _mips )
+	{
+		int handle = textureManager.Request( filename, _srgb, _mips );
+		textureManager.Flush( );
+		return textureManager.Get( handle );
+	}
+	void Scene::BuildTriAccel( uint primIdx )
+	{
+		TriAccel& acc = triAccels[primIdx];
+		acc = {};
+		const Primitive& prim = primitives[primIdx];
+		if ( prim.objType != TRIANGLE ) return;
+		// the inverse of [v1 - v0, v2 - v0, N], in double precision: the rows of a thin triangle are large
+		const Triangle& tri = prim.objData.triangle;
+		auto load = [&]( uint v, double* d ) { d[0] = vertices[v].x, d[1] = vertices[v].y, d[2] = vertices[v].z; };
+		auto cross = []( const double* a, const double* b, double* c ) {
+			c[0] = a[1] * b[2] - a[2] * b[1], c[1] = a[2] * b[0] - a[0] * b[2], c[2] = a[0] * b[1] - a[1] * b[0];
+		};
+		auto dot = []( const double* a, const double* b ) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; };
+		double v0[3], v1[3], v2[3], e1[3], e2[3], N[3], rows[3][3];
+		load( tri.v0, v0 ), load( tri.v1, v1 ), load( tri.v2, v2 );
+		for ( int i = 0; i < 3; i++ ) e1[i] = v1[i] - v0[i], e2[i] = v2[i] - v0[i];
+		cross( e1, e2, N );
+		double det = dot( N, N );
+		if ( det == 0 ) return;
+		cross( e2, N, rows[0] ), cross( N, e1, rows[1] );
+		for ( int i = 0; i < 3; i++ ) rows[2][i] = N[i];
+		float4* m[3] = { &acc.m0, &acc.m1, &acc.m2 };
+		for ( int r = 0; r < 3; r++ )
+			*m[r] = float4( (float)( rows[r][0] / det ), (float)( rows[r][1] / det ), (float)( rows[r][2] / det ), (float)( -dot( rows[r], v0 ) / det ) );
+	}
+	void Scene::BuildLightTable( )
+	{
+		// lights are picked proportional to their emitted power: luminance of the emittance times area
+		int n = lights.size( );
+		lightTable.resize( n );
+		if ( n == 0 ) return;
+		std::vector<float> weights( n );
+		float total = 0;
+		for ( int i = 0; i < n; i++ ) {
+			Primitive& prim = primitives[lights[i]];
+			float w = prim.objType == PLANE ? 0 : Luminance( materials[prim.matIdx].emittance ) * prim.area;
+			weights[i] = w > 0 && std::isfinite( w ) ? w : 0;
+			total += weights[i];
+		}
+		if ( total == 0 ) std::fill( weights.begin( ), weights.end( ), 1.f ), total = n;
+		// Vose's alias method: pair every under-full slot with an over-full one
+		std::vector<float> scaled( n );
+		std::vector<int> small, large;
+		for ( int i = 0; i < n; i++ ) {
+			lightTable[i].primIdx = lights[i];
+			lightTable[i].pdf = weights[i] / total;
+			primitives[lights[i]].lightPdf = lightTable[i].pdf;
+			scaled[i] = weights[i] * n / total;
+			if ( scaled[i] < 1 ) small.push_back( i ); else large.push_back( i );
+		}
+		while ( !small.empty( ) && !large.empty( ) ) {
+			int s = small.back( ), l = large.back( );
+			small.pop_back( );
+			lightTable[s].q = scaled[s];
+			lightTable[s].alias = l;
+			scaled[l] -= 1 - scaled[s];
+			if ( scaled[l] < 1 ) large.pop_back( ), small.push_back( l );
+		}
+		// leftovers are full up to rounding
+		for ( int i : small ) lightTable[i].q = 1, lightTable[i].alias = i;
+		for ( int i : large ) lightTable[i].q = 1, lightTable[i].alias = i;
+	}
+	Material& Scene::EditMaterial( int idx )
+	{
+		dirtyMaterials.Add( idx );
+		wasLightMaterial_.emplace( idx, materials[idx].isLight ); // as before the first edit
+		return materials[idx];
+	}
+	Primitive& Scene::EditPrimitive( int idx )
+	{
+		dirtyPrimitives.Add( idx );
+		wasLightPrimitive_.emplace( idx, materials[primitives[idx].matIdx].isLight );
+		return primitives[idx];
+	}
+	float4& Scene::EditVertex( int idx )
+	{
+		dirtyVertices.Add( idx );
+		return vertices[idx];
+	}
+	std::vector<uint> Scene::ApplyEdits( bool refit )
+	{
+		// a vertex edit reshapes every triangle that uses the vertex: its area and transform change
+		if ( !dirtyVertices.Empty( ) ) {
+			FindVertexTriangles( );
+			for ( const auto& range : dirtyVertices.Ranges( ) )
+				for ( uint v = range.first; v < range.second; v++ )
+					for ( uint j = vertexTriFirst_[v]; j < vertexTriFirst_[v + 1]; j++ ) dirtyPrimitives.Add( vertexTris_[j] );
+		}
+		// geometry first, the light pdfs written below are not edits of their own
+		std::set<uint> moved;
+		if ( refit && ( !dirtyPrimitives.Empty( ) || !dirtyVertices.Empty( ) ) ) {
+			FindBlasRanges( );
+			auto find = [&]( const std::map<uint, uint>& firsts, const DirtyRanges& dirty ) {
+				// every BLAS from the one holding the first element of a range to the one holding its last
+				for ( const auto& range : dirty.Ranges( ) ) {
+					auto it = firsts.upper_bound( range.first );
+					if ( it != firsts.begin( ) ) it--;
+					for ( ; it != firsts.end( ) && it->first < range.second; it++ ) moved.insert( it->second );
+				}
+			};
+			find( blasOfPrim_, dirtyPrimitives );
+			find( blasOfVertex_, dirtyVertices );
+			for ( uint root : moved ) {
+				bvh2->Refit( root, blasEnd_[root] );
+				if ( bvh4 ) bvh4->Refit( root, blasEnd_[root] );
+			}
+		}
+		// a material that starts or stops emitting, or a primitive that moves to a material that does,
+		// changes which primitives are lights
+		bool lightsMoved = false;
+		for ( const auto& edit : wasLightMaterial_ ) lightsMoved |= materials[edit.first].isLight != edit.second;
+		for ( const auto& edit : wasLightPrimitive_ ) lightsMoved |= materials[primitives[edit.first].matIdx].isLight != edit.second;
+		wasLightMaterial_.clear( ), wasLightPrimitive_.clear( );
+		if ( lightsMoved ) {
+			for ( uint light : lights ) primitives[light].lightPdf = 0, dirtyPrimitives.Add( light );
+			lights.clear( );
+			for ( uint i = 0; i < primitives.size( ); i++ ) if ( materials[primitives[i].matIdx].isLight ) lights.push_back( i );
+		}
+		// lights are weighted by the emittance of their material and their area
+		bool lightsChanged = lightsMoved;
+		for ( const auto& range : dirtyMaterials.Ranges( ) )
+			for ( uint i = range.first; i < range.second; i++ ) lightsChanged |= materials[i].isLight;
+		for ( const auto& range : dirtyPrimitives.Ranges( ) )
+			for ( uint i = range.first; i < range.second; i++ ) {
+				Primitive& prim = primitives[i];
+				if ( prim.objType == SPHERE ) prim.area = SphereArea( prim.objData.sphere.r2 );
+				if ( prim.objType == TRIANGLE ) {
+					const Triangle& tri = prim.objData.triangle;
+					prim.area = TriangleArea( vertices[tri.v0], vertices[tri.v1], vertices[tri.v2] );
+				}
+				BuildTriAccel( i );
+				lightsChanged |= materials[prim.matIdx].isLight;
+			}
+		if ( lightsChanged ) {
+			BuildLightTable( );
+			for ( uint light : lights ) dirtyPrimitives.Add( light );
+			dirtyLights = true;
+		}
+		return std::vector<uint>( moved.begin( ), moved.end( ) );
+	}
+	void Scene::FindVertexTriangles( )
+	{
+		if ( !vertexTriFirst_.empty( ) ) return;
+		// the triangles of each vertex, one after another: counts first, then offsets
+		vertexTriFirst_.assign( vertices.size( ) + 1, 0 );
+		for ( const Primitive& prim : primitives )
+			if ( prim.objType == TRIANGLE )
+				for ( uint v : { prim.objData.triangle.v0, prim.objData.triangle.v1, prim.objData.triangle.v2 } ) vertexTriFirst_[v + 1]++;
+		for ( size_t v = 0; v < vertices.size( ); v++ ) vertexTriFirst_[v + 1] += vertexTriFirst_[v];
+		vertexTris_.resize( vertexTriFirst_.back( ) );
+		std::vector<uint> fill( vertexTriFirst_.begin( ), vertexTriFirst_.end( ) - 1 );
+		for ( uint i = 0; i < primitives.size( ); i++ )
+			if ( primitives[i].objType == TRIANGLE ) {
+				const Triangle& tri = primitives[i].objData.triangle;
+				for ( uint v : { tri.v0, tri.v1, tri.v2 } ) vertexTris_[fill[v]++] = i;
+			}
+	}
+	void Scene::FindBlasRanges( )
+	{
+		if ( !blasEnd_.empty( ) ) return;
+		// BuildBLAS appends: the nodes of a BLAS run up to the next root, and it holds the primitives
+		// and vertices added since the previous one
+		std::set<uint> roots;
+		for ( const BVHInstance& instance : blasNodes ) roots.insert( instance.bvhIdx );
+		for ( auto it = roots.begin( ); it != roots.end( ); it++ ) {
+			uint root = *it, end = std::next( it ) == roots.end( ) ? (uint)bvh2->bvhNodes.size( ) : *std::next( it );
+			uint firstPrim = UINT_MAX, firstVertex = UINT_MAX;
+			for ( uint n = root; n < end; n++ ) {
+				const BVHNode2& node = bvh2->bvhNodes[n];
+				for ( uint j = 0; j < node.count; j++ ) {
+					uint primIdx = bvh2->primIdx[node.first + j];
+					firstPrim = std::min( firstPrim, primIdx );
+					const Primitive& prim = primitives[primIdx];
+					if ( prim.objType == TRIANGLE )
+						firstVertex = std::min( { firstVertex, prim.objData.triangle.v0, prim.objData.triangle.v1, prim.objData.triangle.v2 } );
+				}
+			}
+			blasEnd_[root] = end;
+			if ( firstPrim != UINT_MAX ) blasOfPrim_[firstPrim] = root;
+			if ( firstVertex != UINT_MAX ) blasOfVertex_[firstVertex] = root;
+		}
+	}
+	void Scene::BuildSkydomeCdf( )
+	{
+		// texels are weighted by luminance times sin(theta), rows near the poles cover less solid angle
+		Material& sky = materials[0];
+		int w = sky.texW, h = sky.texH;
+		if ( sky.texIdx < 0 || w == 0 || h == 0 ) return;
+		skyCdf.resize( w * h + h );
+		float* marginal = skyCdf.data( ) + w * h;
+		float total = 0;
+		for ( int y = 0; y < h; y++ ) {
+			float sinTheta = sinf( PI * ( y + .5f ) / h );
+			float* row = skyCdf.data( ) + y * w;
+			float rowSum = 0;
+			for ( int x = 0; x < w; x++ ) {
+				rowSum += Luminance( UnpackTexel( textures[sky.texIdx + x + y * w], sky.texFormat ) ) * sinTheta;
+				row[x] = rowSum;
+			}
+			for ( int x = 0; x < w; x++ ) row[x] = rowSum > 0 ? row[x] / rowSum : ( x + 1 ) / (float)w;
+			total += rowSum;
+			marginal[y] = total;
+		}
+		for ( int y = 0; y < h; y++ ) marginal[y] = total > 0 ? marginal[y] / total : ( y + 1 ) / (float)h;
 	}
 
 }; // namespace Tmpl8
@@ -2,8 +2,45 @@
 #include "common.h"
 namespace Tmpl8
 {
+	// a model file and how to load it
+	struct ModelDesc
+	{
+		std::string file, material;
+		float3 pos = { 0, 0, 0 };
+		bool forceMaterial = false;
+		float scale = 1; // glTF only, like pos it is applied on top of the node transforms
+	};
+	// the elements of an array that changed since its last upload, as merged [first, end) ranges
+	class DirtyRanges
+	{
+	public:
+		void Add( uint first, uint count = 1 )
+		{
+			uint end = first + count;
+			// swallow every range that overlaps or touches the new one
+			auto it = ranges_.upper_bound( first );
+			if ( it != ranges_.begin( ) && std::prev( it )->second >= first ) it--;
+			while ( it != ranges_.end( ) && it->first <= end ) {
+				first = std::min( first, it->first ), end = std::max( end, it->second );
+				it = ranges_.erase( it );
+			}
+			ranges_[first] = end;
+		}
+		size_t Count( ) const
+		{
+			size_t count = 0;
+			for ( const auto& range : ranges_ ) count += range.second - range.first;
+			return count;
+		}
+		bool Empty( ) const { return ranges_.empty( ); }
+		void Clear( ) { ranges_.clear( ); }
+		const std::map<uint, uint>& Ranges( ) const { return ranges_; }
+	private:
+		std::map<uint, uint> ranges_; // first, end
+	};
 	class Scene
 	{
+		friend class SceneCache;
 	public:
 		Scene( );
 		~Scene( );
@@ -14,22 +51,56 @@ namespace Tmpl8
 		void AddQuad( float3 v0, float3 v1, float3 v2, float3 v3, const std::string material, bool flipNormal = false, float2 uv0 = { 0, 0 }, float2 uv1 = { 1,0 }, float2 uv2 = { 0, 1 }, float2 uv3 = { 1, 1 } );
 		void AddTriangle( float3 v0, float3 v1, float3 v2, float2 uv0, float2 uv1, float2 uv2, const std::string material, bool flipNormal = false );
 		void LoadModel( std::string filename, const std::string defaultMaterial, float3 pos = {0, 0, 0}, bool _forceDefaultMat = false );
-		void LoadTexture( std::string filename, std::string name );
+		void LoadGltfModel( const ModelDesc& model );
+		void SetAlbedoMap( Material& mat, const TexRef& tex );
+		// a single image, decoded right away; loaders batch theirs through textureManager
+		void ReadTexture( std::string filename, Material& mat, bool mips = true );
+		TexRef ReadTexture( std::string filename, bool srgb, bool mips = true );
+		void BuildTriAccel( uint primIdx );
+		void BuildLightTable( );
+		void BuildSkydomeCdf( );
+		// edits: change the element through the reference, the renderer uploads what changed with the
+		// next frame instead of the whole arrays
+		Material& EditMaterial( int idx );
+		Primitive& EditPrimitive( int idx );
+		float4& EditVertex( int idx );
+		// brings the derived data up to date with the edits: the lights and their table when a light changed, and
+		// with refit, the bounds of the BLASes whose geometry moved. Returns the roots of those BLASes
+		std::vector<uint> ApplyEdits( bool refit );
 
 	public:
 		__declspec( align( 64 ) ) // start a new cacheline here
 			float animTime = 0;
 
 		std::vector<Primitive> primitives;
+		std::vector<float4> vertices; // shared by the triangles, which index them
+		std::vector<TriAccel> triAccels; // per primitive, for the intersection test
+		std::vector<float2> texcoords; // one per vertex
 		std::vector<Material> materials;
 		std::vector<uint> lights;
-		std::vector<float4> textures;
+		std::vector<LightAlias> lightTable; // built from lights, sampled for NEE
+		std::vector<uint> textures; // one word per texel, in the format of the TexRef or material using it
+		const uint* texels = 0; // textures, or the same texels mapped from the scene cache, which empties textures
+		TextureManager textureManager; // decodes and dedupes the images that fill textures
+		std::vector<float> skyCdf; // skydome importance sampling: cdf per texel row, then the marginal over rows
 		std::vector<BVHInstance> blasNodes;
+		std::vector<std::string> sources; // every file read while building, checked by the scene cache
 		BVH2* bvh2;
 		BVH4* bvh4;
+		// what the edits changed since the last upload, in elements
+		DirtyRanges dirtyPrimitives, dirtyVertices, dirtyMaterials;
+		bool dirtyLights = false;
 
 	private:
+		void FindBlasRanges( );
+		void FindVertexTriangles( );
 		std::map<std::string, int> matMap_;
 		int matIdx_ = 0;
+		// per BLAS root: the end of its nodes; and the BLAS of an edit, by first primitive and first vertex
+		std::map<uint, uint> blasEnd_, blasOfPrim_, blasOfVertex_;
+		std::vector<uint> vertexTriFirst_, vertexTris_; // per vertex, the triangles that use it
+		std::unique_ptr<MappedFile> cacheFile_; // holds the mapped texels
+		// whether the edited materials and primitives emitted before their first edit since ApplyEdits
+		std::map<uint, bool> wasLightMaterial_, wasLightPrimitive_;
 	};
 } // namespace Tmpl8
\ No newline at end of file
@@ -0,0 +1,226 @@
+#include "precomp.h"
+namespace Tmpl8
+{
+	enum CacheSection
+	{
+		DEPENDENCIES, PRIMITIVES, VERTICES, TEXCOORDS, MATERIALS, MATERIAL_NAMES, LIGHTS, LIGHT_TABLE,
+		TEXTURES, SKY_CDF, BLAS_NODES, BVH_NODES, BVH_IDX, BVH_STATE, BVH4_NODES, SECTION_COUNT
+	};
+	struct CacheHeader { uint magic, version; uint64_t key; }; // 16 bytes, like SectionHeader
+	struct SectionHeader { uint id, elementSize; uint64_t count; };
+	// BVH2 members that are not in its arrays
+	struct BVHState
+	{
+		uint rootNodeIdx, nodesUsed;
+		uint depth, nodeCount, spatialSplits, primsClipped, primCount;
+		float sahCost, buildTime;
+	};
+	static const uint CACHE_MAGIC = 0x4353474d; // "MGSC"
+
+	SceneCache::SceneCache( const std::string& _file ) : file_( _file )
+	{
+		key_ = Hash( 0, 0, 14695981039346656037ull );
+		AddKey( SCENE_CACHE_VERSION );
+	}
+	uint64_t SceneCache::Hash( const void* _data, size_t _size, uint64_t _hash )
+	{
+		// FNV-1a on 8 byte words, then on the tail bytes
+		const uchar* bytes = (const uchar*)_data;
+		size_t words = _size / 8;
+		for ( size_t i = 0; i < words; i++ )
+		{
+			uint64_t w;
+			memcpy( &w, bytes + i * 8, 8 );
+			_hash = ( _hash ^ w ) * 1099511628211ull;
+		}
+		for ( size_t i = words * 8; i < _size; i++ ) _hash = ( _hash ^ bytes[i] ) * 1099511628211ull;
+		return _hash;
+	}
+	uint64_t SceneCache::HashFile( const std::string& _file )
+	{
+		MappedFile file( _file );
+		if ( !file.data && file.size > 0 ) return 0;
+		return Hash( file.data, file.size, 14695981039346656037ull ^ file.size );
+	}
+	void SceneCache::AddKey( const void* _data, size_t _size )
+	{
+		key_ = Hash( _data, _size, key_ );
+	}
+
+	// sections start 16 byte aligned
+	static size_t Padded( size_t _bytes ) { return ( _bytes + 15 ) & ~(size_t)15; }
+
+	static void WriteSection( FILE* _f, uint _id, const void* _data, uint _elementSize, size_t _count )
+	{
+		SectionHeader header = { _id, _elementSize, _count };
+		fwrite( &header, sizeof( header ), 1, _f );
+		if ( _count > 0 ) fwrite( _data, _elementSize, _count, _f );
+		static const uchar zeros[16] = {};
+		size_t bytes = _elementSize * _count;
+		fwrite( zeros, 1, Padded( bytes ) - bytes, _f );
+	}
+	template<class T> static void WriteSection( FILE* _f, uint _id, const std::vector<T>& _data )
+	{
+		WriteSection( _f, _id, _data.data( ), sizeof( T ), _data.size( ) );
+	}
+
+	// finds the sections of a mapped cache, and checks that they hold the structs this build expects
+	static bool FindSections( const MappedFile& _file, const SectionHeader** _sections )
+	{
+		const uint elementSizes[SECTION_COUNT] = { 1, sizeof( Primitive ), sizeof( float4 ), sizeof( float2 ), sizeof( Material ), 1, sizeof( uint ),
+			sizeof( LightAlias ), sizeof( uint ), sizeof( float ), sizeof( BVHInstance ), sizeof( BVHNode2 ), sizeof( uint ),
+			sizeof( BVHState ), sizeof( BVHNode4 ) };
+		for ( int i = 0; i < SECTION_COUNT; i++ ) _sections[i] = 0;
+		size_t offset = sizeof( CacheHeader );
+		while ( offset + sizeof( SectionHeader ) <= _file.size )
+		{
+			const SectionHeader* section = (const SectionHeader*)( _file.data + offset );
+			size_t bytes = Padded( section->elementSize * section->count );
+			if ( section->id >= SECTION_COUNT || section->elementSize != elementSizes[section->id] ||
+				offset + sizeof( SectionHeader ) + bytes > _file.size ) return false;
+			_sections[section->id] = section;
+			offset += sizeof( SectionHeader ) + bytes;
+		}
+		for ( int i = 0; i < SECTION_COUNT; i++ ) if ( !_sections[i] ) return false;
+		return _sections[BVH_STATE]->count == 1;
+	}
+
+	void SceneCache::Save( Scene& _scene )
+	{
+		Timer t;
+		FILE* f = fopen( file_.c_str( ), "wb" );
+		if ( !f )
+		{
+			printf( "W/SceneCache: could not write %s\n", file_.c_str( ) );
+			return;
+		}
+		CacheHeader header = { CACHE_MAGIC, SCENE_CACHE_VERSION, key_ };
+		fwrite( &header, sizeof( header ), 1, f );
+		// every file the build read: zero terminated path, then the hash of its contents
+		std::vector<uchar> blob;
+		for ( const std::string& source : _scene.sources )
+		{
+			uint64_t hash = HashFile( source );
+			blob.insert( blob.end( ), source.c_str( ), source.c_str( ) + source.size( ) + 1 );
+			blob.insert( blob.end( ), (uchar*)&hash, (uchar*)&hash + sizeof( hash ) );
+		}
+		WriteSection( f, DEPENDENCIES, blob );
+		blob.clear( );
+		for ( const auto& pair : _scene.matMap_ )
+		{
+			blob.insert( blob.end( ), pair.first.c_str( ), pair.first.c_str( ) + pair.first.size( ) + 1 );
+			blob.insert( blob.end( ), (uchar*)&pair.second, (uchar*)&pair.second + sizeof( int ) );
+		}
+		WriteSection( f, MATERIAL_NAMES, blob );
+		WriteSection( f, PRIMITIVES, _scene.primitives );
+		WriteSection( f, VERTICES, _scene.vertices );
+		WriteSection( f, TEXCOORDS, _scene.texcoords );
+		WriteSection( f, MATERIALS, _scene.materials );
+		WriteSection( f, LIGHTS, _scene.lights );
+		WriteSection( f, LIGHT_TABLE, _scene.lightTable );
+		WriteSection( f, TEXTURES, _scene.textures );
+		WriteSection( f, SKY_CDF, _scene.skyCdf );
+		WriteSection( f, BLAS_NODES, _scene.blasNodes );
+		BVH2& bvh2 = *_scene.bvh2;
+		WriteSection( f, BVH_NODES, bvh2.bvhNodes );
+		WriteSection( f, BVH_IDX, bvh2.primIdx );
+		BVHState state = { bvh2.rootNodeIdx_, bvh2.nodesUsed_, bvh2.stat_depth, bvh2.stat_node_count, bvh2.stat_spatial_splits,
+			bvh2.stat_prims_clipped, bvh2.stat_prim_count, bvh2.stat_sah_cost, bvh2.stat_build_time };
+		WriteSection( f, BVH_STATE, &state, sizeof( state ), 1 );
+		WriteSection( f, BVH4_NODES, _scene.bvh4->Nodes( ) );
+		bool written = !ferror( f );
+		fclose( f );
+		printf( "Wrote scene cache %s in %.2fs\n", file_.c_str( ), t.elapsed( ) );
+		// the texels in memory go, they are read from the file like after a load
+		auto file = std::make_unique<MappedFile>( file_ );
+		const SectionHeader* sections[SECTION_COUNT];
+		if ( !written || !file->data || !FindSections( *file, sections ) ) return;
+		MapTextures( _scene, std::move( file ), (const uint*)( sections[TEXTURES] + 1 ) );
+	}
+
+	template<class T> static void ReadSection( std::vector<T>& _dest, const SectionHeader* _section )
+	{
+		_dest.resize( _section->count );
+		if ( _section->count > 0 ) memcpy( _dest.data( ), _section + 1, sizeof( T ) * _section->count );
+	}
+
+	void SceneCache::MapTextures( Scene& _scene, std::unique_ptr<MappedFile> _file, const uint* _texels )
+	{
+		// the virtual texture copies the pages it loads out of the mapping; the rest of the texels
+		// stay on disk, and the system drops the pages that were read again when it needs the memory
+		_scene.texels = _texels;
+		std::vector<uint>( ).swap( _scene.textures );
+		_scene.cacheFile_ = std::move( _file );
+	}
+
+	bool SceneCache::Load( Scene& _scene )
+	{
+		Timer t;
+		auto file = std::make_unique<MappedFile>( file_ );
+		if ( !file->data || file->size < sizeof( CacheHeader ) ) return false;
+		const CacheHeader* header = (const CacheHeader*)file->data;
+		if ( header->magic != CACHE_MAGIC || header->version != SCENE_CACHE_VERSION || header->key != key_ )
+		{
+			printf( "Scene cache %s is out of date\n", file_.c_str( ) );
+			return false;
+		}
+		const SectionHeader* sections[SECTION_COUNT];
+		if ( !FindSections( *file, sections ) ) return false;
+		// the sources the cache was built from must be unchanged
+		const char* blob = (const char*)( sections[DEPENDENCIES] + 1 );
+		const char* end = blob + sections[DEPENDENCIES]->count;
+		while ( blob < end )
+		{
+			std::string source( blob );
+			uint64_t hash;
+			memcpy( &hash, blob + source.size( ) + 1, sizeof( hash ) );
+			if ( HashFile( source ) != hash )
+			{
+				printf( "Scene cache %s is out of date: %s changed\n", file_.c_str( ), source.c_str( ) );
+				return false;
+			}
+			blob += source.size( ) + 1 + sizeof( hash );
+		}
+		// everything checks out, fill the scene
+		_scene.sources.clear( );
+		blob = (const char*)( sections[DEPENDENCIES] + 1 );
+		while ( blob < end )
+		{
+			_scene.sources.push_back( blob );
+			blob += _scene.sources.back( ).size( ) + 1 + sizeof( uint64_t );
+		}
+		_scene.matMap_.clear( );
+		blob = (const char*)( sections[MATERIAL_NAMES] + 1 );
+		end = blob + sections[MATERIAL_NAMES]->count;
+		while ( blob < end )
+		{
+			std::string name( blob );
+			memcpy( &_scene.matMap_[name], blob + name.size( ) + 1, sizeof( int ) );
+			blob += name.size( ) + 1 + sizeof( int );
+		}
+		ReadSection( _scene.primitives, sections[PRIMITIVES] );
+		ReadSection( _scene.vertices, sections[VERTICES] );
+		ReadSection( _scene.texcoords, sections[TEXCOORDS] );
+		ReadSection( _scene.materials, sections[MATERIALS] );
+		_scene.matIdx_ = (int)_scene.materials.size( );
+		ReadSection( _scene.lights, sections[LIGHTS] );
+		ReadSection( _scene.lightTable, sections[LIGHT_TABLE] );
+		ReadSection( _scene.skyCdf, sections[SKY_CDF] );
+		ReadSection( _scene.blasNodes, sections[BLAS_NODES] );
+		BVH2& bvh2 = *_scene.bvh2;
+		ReadSection( bvh2.bvhNodes, sections[BVH_NODES] );
+		ReadSection( bvh2.primIdx, sections[BVH_IDX] );
+		BVHState state;
+		memcpy( &state, sections[BVH_STATE] + 1, sizeof( state ) );
+		bvh2.rootNodeIdx_ = state.rootNodeIdx, bvh2.nodesUsed_ = state.nodesUsed;
+		bvh2.stat_depth = state.depth, bvh2.stat_node_count = state.nodeCount, bvh2.stat_spatial_splits = state.spatialSplits;
+		bvh2.stat_prims_clipped = state.primsClipped, bvh2.stat_prim_count = state.primCount;
+		bvh2.stat_sah_cost = state.sahCost, bvh2.stat_build_time = state.buildTime;
+		std::vector<BVHNode4> nodes4;
+		ReadSection( nodes4, sections[BVH4_NODES] );
+		_scene.bvh4 = new BVH4( bvh2, nodes4 );
+		MapTextures( _scene, std::move( file ), (const uint*)( sections[TEXTURES] + 1 ) );
+		printf( "Loaded scene cache %s in %.2fs\n", file_.c_str( ), t.elapsed( ) );
+		return true;
+	}
+} // namespace Tmpl8
@@ -0,0 +1,26 @@
+#pragma once
+#define SCENE_CACHE_VERSION 5 // bump when the file layout changes; struct sizes are checked per section
+namespace Tmpl8
+{
+class Scene;
+// binary snapshot of everything the Scene constructor loads and builds: primitives, materials,
+// textures, lights and the BVHs. It is keyed by the scene description and build parameters, and
+// only used while every file the build read still hashes the same
+class SceneCache
+{
+public:
+	SceneCache( const std::string& file );
+	void AddKey( const void* data, size_t size );
+	void AddKey( const std::string& value ) { AddKey( value.data( ), value.size( ) + 1 ); }
+	template<class T> void AddKey( const T& value ) { AddKey( &value, sizeof( T ) ); }
+	bool Load( Scene& scene );
+	void Save( Scene& scene );
+	static uint64_t Hash( const void* data, size_t size, uint64_t hash );
+	static uint64_t HashFile( const std::string& file );
+private:
+	// points the scene's texels into the mapped file and frees its copy
+	void MapTextures( Scene& scene, std::unique_ptr<MappedFile> file, const uint* texels );
+	std::string file_;
+	uint64_t key_;
+};
+} // namespace Tmpl8
@@ -0,0 +1,131 @@
+#include "precomp.h"
+namespace Tmpl8
+{
+	// shared exponent encoding of EXT_texture_shared_exponent: 9-bit mantissas, 5-bit exponent with bias 15
+	static uint PackRGB9E5( float3 c )
+	{
+		const float maxValue = 511 / 512.f * 65536;
+		float r = std::clamp( c.x, 0.f, maxValue ), g = std::clamp( c.y, 0.f, maxValue ), b = std::clamp( c.z, 0.f, maxValue );
+		int exponent;
+		frexpf( std::max( r, std::max( g, b ) ), &exponent );
+		int e = std::max( 0, exponent + 15 );
+		float scale = exp2f( (float)( 24 - e ) );
+		if ( (uint)( std::max( r, std::max( g, b ) ) * scale + .5f ) == 512 ) e++, scale *= .5f;
+		return (uint)( r * scale + .5f ) | (uint)( g * scale + .5f ) << 9 | (uint)( b * scale + .5f ) << 18 | (uint)e << 27;
+	}
+	float4 UnpackTexel( uint t, int format )
+	{
+		if ( format == TEX_RGB9E5 ) {
+			float scale = exp2f( (float)( (int)( t >> 27 ) - 24 ) );
+			return float4( ( t & 511 ) * scale, ( ( t >> 9 ) & 511 ) * scale, ( ( t >> 18 ) & 511 ) * scale, 0 );
+		}
+		float4 c( ( t & 255 ) / 255.f, ( ( t >> 8 ) & 255 ) / 255.f, ( ( t >> 16 ) & 255 ) / 255.f, ( t >> 24 ) / 255.f );
+		if ( format == TEX_SRGB8 ) c = float4( powf( c.x, 2.2f ), powf( c.y, 2.2f ), powf( c.z, 2.2f ), c.w );
+		return c;
+	}
+	static uint PackTexel( float4 c, int format )
+	{
+		if ( format == TEX_RGB9E5 ) return PackRGB9E5( c );
+		if ( format == TEX_SRGB8 ) c = float4( powf( c.x, 1 / 2.2f ), powf( c.y, 1 / 2.2f ), powf( c.z, 1 / 2.2f ), c.w );
+		auto byte = []( float v ) { return (uint)( std::clamp( v, 0.f, 1.f ) * 255 + .5f ); };
+		return byte( c.x ) | byte( c.y ) << 8 | byte( c.z ) << 16 | byte( c.w ) << 24;
+	}
+	// box filtered levels down to 1x1, appended after level 0; returns the level count
+	static int BuildMips( std::vector<uint>& texels, int w, int h, int format )
+	{
+		int levels = 1, idx = 0;
+		while ( w > 1 || h > 1 ) {
+			int nw = std::max( 1, w >> 1 ), nh = std::max( 1, h >> 1 ), next = (int)texels.size( );
+			texels.resize( next + nw * nh );
+			for ( int y = 0; y < nh; y++ ) {
+				const uint* row0 = texels.data( ) + idx + std::min( 2 * y, h - 1 ) * w;
+				const uint* row1 = texels.data( ) + idx + std::min( 2 * y + 1, h - 1 ) * w;
+				for ( int x = 0; x < nw; x++ ) {
+					int x0 = std::min( 2 * x, w - 1 ), x1 = std::min( 2 * x + 1, w - 1 );
+					float4 sum = UnpackTexel( row0[x0], format ) + UnpackTexel( row0[x1], format ) +
+						UnpackTexel( row1[x0], format ) + UnpackTexel( row1[x1], format );
+					texels[next + x + y * nw] = PackTexel( sum * .25f, format );
+				}
+			}
+			idx = next, w = nw, h = nh, levels++;
+		}
+		return levels;
+	}
+	static const char* FormatName( int format )
+	{
+		return format == TEX_RGB9E5 ? "RGB9E5" : format == TEX_SRGB8 ? "SRGB8" : "RGBA8";
+	}
+
+	int TextureManager::Request( const std::string& _file, bool _srgb, bool _mips )
+	{
+		// paths that differ only in spelling, such as dir/../dir/a.png, are the same file
+		std::string file = std::filesystem::path( _file ).lexically_normal( ).generic_string( );
+		std::string key = file + ( _srgb ? "|srgb" : "|linear" ) + ( _mips ? "|mips" : "" );
+		auto it = handles_.find( key );
+		if ( it != handles_.end( ) ) return it->second;
+		Entry entry;
+		entry.file = file, entry.srgb = _srgb, entry.mips = _mips;
+		entry.tex = { -1, 0, 0, TEX_RGBA8, 0 };
+		entries_.push_back( entry );
+		return handles_[key] = (int)entries_.size( ) - 1;
+	}
+	void TextureManager::Flush( )
+	{
+		int count = (int)entries_.size( ) - flushed_;
+		if ( count == 0 ) return;
+		Timer t;
+		// 8-bit images keep their bytes and are decoded on lookup, HDR images are packed to RGB9E5
+		util::ParallelFor( count, [&]( int i ) {
+			Entry& entry = entries_[flushed_ + i];
+			int w, h, n;
+			if ( uint* data = LoadImage8( entry.file.c_str( ), w, h ) ) {
+				entry.texels.assign( data, data + w * h );
+				delete[] data;
+				entry.tex.format = entry.srgb ? TEX_SRGB8 : TEX_RGBA8;
+			}
+			else if ( float3* data = LoadImageF( entry.file.c_str( ), w, h, n ) ) {
+				entry.texels.resize( w * h );
+				for ( int j = 0; j < w * h; j++ ) entry.texels[j] = PackRGB9E5( data[j] );
+				delete[] data;
+				entry.tex.format = TEX_RGB9E5;
+			}
+			else return;
+			entry.tex.w = w, entry.tex.h = h;
+			entry.tex.levels = entry.mips ? BuildMips( entry.texels, w, h, entry.tex.format ) : 1;
+		} );
+		for ( ; flushed_ < (int)entries_.size( ); flushed_++ ) {
+			Entry& entry = entries_[flushed_];
+			if ( entry.texels.empty( ) ) {
+				printf( "W/TextureManager: could not read %s\n", entry.file.c_str( ) );
+				continue;
+			}
+			// logged here rather than by the loaders, whose threads would interleave the lines
+			printf( "I/TextureManager: %s\n", entry.file.c_str( ) );
+			entry.tex.idx = (int)texels_.size( );
+			entry.bytes = entry.texels.size( ) * sizeof( uint );
+			texels_.insert( texels_.end( ), entry.texels.begin( ), entry.texels.end( ) );
+			std::vector<uint>( ).swap( entry.texels );
+		}
+		printf( "Decoded %i textures in %.2fs\n", count, t.elapsed( ) );
+	}
+	std::vector<std::string> TextureManager::Files( ) const
+	{
+		std::vector<std::string> files;
+		for ( int i = 0; i < flushed_; i++ ) files.push_back( entries_[i].file );
+		return files;
+	}
+	void TextureManager::Report( ) const
+	{
+		std::vector<std::pair<size_t, int>> sizes;
+		for ( int i = 0; i < flushed_; i++ ) if ( entries_[i].tex.idx >= 0 ) sizes.push_back( { entries_[i].bytes, i } );
+		std::sort( sizes.rbegin( ), sizes.rend( ) );
+		size_t total = 0;
+		for ( const auto& size : sizes ) {
+			const TexRef& tex = entries_[size.second].tex;
+			printf( "  %8.2fMB %5ix%-5i %-6s %2i levels  %s\n", size.first / ( 1024.f * 1024 ), tex.w, tex.h, FormatName( tex.format ), tex.levels,
+				entries_[size.second].file.c_str( ) );
+			total += size.first;
+		}
+		printf( "Textures: %i files, %.2fMB\n", (int)sizes.size( ), total / ( 1024.f * 1024 ) );
+	}
+} // namespace Tmpl8
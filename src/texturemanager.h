@@ -0,0 +1,37 @@
+#pragma once
+namespace Tmpl8
+{
+	// linear rgb as the kernels read a texel, with the alpha of the 8-bit formats in w
+	float4 UnpackTexel( uint texel, int format );
+
+	// loads images into the shared texel array: every file is decoded once, however many
+	// materials use it, and everything requested since the last Flush decodes in parallel
+	class TextureManager
+	{
+	public:
+		TextureManager( std::vector<uint>& texels ) : texels_( texels ) {}
+		// queues a file and returns its handle; the same file with the same options gets the same handle
+		int Request( const std::string& file, bool srgb, bool mips = true );
+		// decodes the queued files and appends their texels, in the order they were requested
+		void Flush( );
+		// valid once the handle has been flushed; idx is -1 when the file could not be read
+		TexRef Get( int handle ) const { return entries_[handle].tex; }
+		// files read so far, for the dependencies of the scene cache
+		std::vector<std::string> Files( ) const;
+		// memory per texture, largest first, and the total
+		void Report( ) const;
+	private:
+		struct Entry
+		{
+			std::string file;
+			bool srgb, mips;
+			TexRef tex;
+			size_t bytes = 0; // all levels
+			std::vector<uint> texels; // decoded, until Flush appends them
+		};
+		std::vector<uint>& texels_;
+		std::vector<Entry> entries_;
+		std::map<std::string, int> handles_;
+		int flushed_ = 0;
+	};
+} // namespace Tmpl8
@@ -7,32 +7,42 @@ TLAS::TLAS( BVH2& _bvh2 ) : bvh2_( _bvh2 )
 }
 void TLAS::Build( )
 {
-	// assign a TLASleaf node to each BLAS
-	int nodeIdx[256], nodeIndices = bvh2_.blasNodes.size();
+	// assign a TLASleaf node to each BLAS instance
+	int nodeIndices = bvh2_.blasNodes.size();
+	std::vector<int> nodeIdx( nodeIndices );
 	nodesUsed_ = 1;
 	for ( uint i = 0; i < nodeIndices; i++ ) {
 		nodeIdx[i] = nodesUsed_;
 		BVHNode2 bvhNode = bvh2_.bvhNodes[bvh2_.blasNodes[i].bvhIdx];
-		tlasNodes[nodesUsed_].aabbMin = bvhNode.aabbMin;
-		tlasNodes[nodesUsed_].aabbMax = bvhNode.aabbMax;
+		// world space bounds of the transformed root bounds
+		mat4 T;
+		memcpy( T.cell, bvh2_.blasNodes[i].invT, sizeof( float ) * 16 );
+		T = T.Inverted( );
+		aabb bounds;
+		for ( int c = 0; c < 8; c++ ) bounds.Grow( TransformPosition( float3(
+			c & 1 ? bvhNode.aabbMax.x : bvhNode.aabbMin.x,
+			c & 2 ? bvhNode.aabbMax.y : bvhNode.aabbMin.y,
+			c & 4 ? bvhNode.aabbMax.z : bvhNode.aabbMin.z ), T ) );
+		tlasNodes[nodesUsed_].aabbMin = bounds.bmin3;
+		tlasNodes[nodesUsed_].aabbMax = bounds.bmax3;
 		tlasNodes[nodesUsed_].BLASidx = i;
-		tlasNodes[nodesUsed_++].leftRight = 0; // makes it a leaf
+		tlasNodes[nodesUsed_++].left = 0; // makes it a leaf
 	}
 	// use agglomerative clustering to build the TLAS
-	int A = 0, B = FindBestMatch( nodeIdx, nodeIndices, A );
+	int A = 0, B = FindBestMatch( nodeIdx.data( ), nodeIndices, A );
 	while ( nodeIndices > 1 ) {
-		int C = FindBestMatch( nodeIdx, nodeIndices, B );
+		int C = FindBestMatch( nodeIdx.data( ), nodeIndices, B );
 		if ( A == C ) {
 			int nodeIdxA = nodeIdx[A], nodeIdxB = nodeIdx[B];
 			TLASNode& nodeA = tlasNodes[nodeIdxA];
 			TLASNode& nodeB = tlasNodes[nodeIdxB];
 			TLASNode& newNode = tlasNodes[nodesUsed_];
-			newNode.leftRight = nodeIdxA + ( nodeIdxB << 16 );
+			newNode.left = nodeIdxA, newNode.right = nodeIdxB;
 			newNode.aabbMin = fminf( nodeA.aabbMin, nodeB.aabbMin );
 			newNode.aabbMax = fmaxf( nodeA.aabbMax, nodeB.aabbMax );
 			nodeIdx[A] = nodesUsed_++;
 			nodeIdx[B] = nodeIdx[nodeIndices - 1];
-			B = FindBestMatch( nodeIdx, --nodeIndices, A );
+			B = FindBestMatch( nodeIdx.data( ), --nodeIndices, A );
 		} else A = B, B = C;
 	}
 	tlasNodes[0] = tlasNodes[nodeIdx[A]];
@@ -8,4 +8,17 @@ namespace util
 		path p( filename );
 		return p.parent_path( ).string( ) + '/';
 	}
-}
\ No newline at end of file
+	// calls f( i ) for every i in [0, count), spread over the hardware threads
+	template<class F> void ParallelFor( int count, F f )
+	{
+		int threads = std::max( 1, std::min( count, (int)std::thread::hardware_concurrency( ) ) );
+		if ( threads <= 1 ) {
+			for ( int i = 0; i < count; i++ ) f( i );
+			return;
+		}
+		std::vector<std::thread> workers;
+		for ( int t = 0; t < threads; t++ )
+			workers.emplace_back( [&f, t, threads, count] { for ( int i = t; i < count; i += threads ) f( i ); } );
+		for ( auto& worker : workers ) worker.join( );
+	}
+}
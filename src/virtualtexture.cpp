@@ -0,0 +1,135 @@
+#include "precomp.h"
+
+static const int TILE_TEXELS = VT_TILE * VT_TILE;
+
+void VirtualTexture::Init( Scene& _scene )
+{
+	texels_ = _scene.texels;
+	// a range of pages per texture, shared by the materials that use it
+	std::map<int, int> firstPage;
+	auto assign = [&]( TexRef& tex ) {
+		if ( tex.idx < 0 ) return;
+		auto it = firstPage.find( tex.idx );
+		if ( it == firstPage.end( ) )
+		{
+			it = firstPage.insert( { tex.idx, (int)pages_.size( ) } ).first;
+			AddPages( tex );
+		}
+		tex.page = it->second;
+	};
+	for ( Material& mat : _scene.materials )
+	{
+		TexRef albedo = { mat.texIdx, mat.texW, mat.texH, mat.texFormat, mat.texLevels, 0 };
+		assign( albedo );
+		mat.texPage = albedo.page;
+		assign( mat.metalRough ), assign( mat.normalMap ), assign( mat.emissiveMap );
+	}
+	// the pool is as large as the textures, within what the device can allocate at once
+	cl_ulong maxAlloc = 0;
+	clGetDeviceInfo( Kernel::GetDevice( ), CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof( maxAlloc ), &maxAlloc, 0 );
+	size_t tileBytes = sizeof( uint ) * TILE_TEXELS;
+	pages = (int)pages_.size( );
+	tiles = std::max( 1, (int)std::min( { (size_t)pages, (size_t)VT_POOL_TILES, (size_t)( maxAlloc / tileBytes ) } ) );
+	allResident_ = tiles >= pages;
+	pageTable_.assign( std::max( pages, 1 ), VT_ABSENT );
+	tilePage_.assign( tiles, -1 );
+	lru_.Init( tiles, VT_FEEDBACK_USED );
+	feedbackBuffer = lru_.feedbackBuffer;
+	// pinned pages first, the others only when everything fits
+	std::vector<uint> pool( (size_t)tiles * TILE_TEXELS );
+	for ( int pass = 0; pass < 2; pass++ )
+		for ( int page = 0; page < pages && resident < tiles; page++ )
+		{
+			if ( pinned_[page] != ( pass == 0 ) || ( pass == 1 && !allResident_ ) ) continue;
+			LoadPage( page, pool.data( ) + (size_t)resident * TILE_TEXELS );
+			pageTable_[page] = resident, tilePage_[resident] = page;
+			resident++;
+		}
+	int pinned = (int)std::count( pinned_.begin( ), pinned_.end( ), true );
+	if ( pinned > tiles ) printf( "W/VirtualTexture: %i pinned pages do not fit in %i tiles, textures will be missing\n", pinned, tiles );
+	// free tiles at the back of the list, so they go before any resident page; pinned pages stay out
+	// of it, they are never evicted
+	for ( int tile = tiles - 1; tile >= 0; tile-- ) if ( tilePage_[tile] < 0 || !pinned_[tilePage_[tile]] ) lru_.Touch( tile );
+	tileBuffer = new Buffer( (uint)( tiles * tileBytes ), pool.data( ) );
+	tileBuffer->CopyToDevice( );
+	tileBuffer->hostBuffer = 0;
+	pageTableBuffer = new Buffer( sizeof( int ) * (uint)pageTable_.size( ), pageTable_.data( ) );
+	pageTableBuffer->CopyToDevice( );
+	for ( int i = 0; i < FRAMES_IN_FLIGHT; i++ ) staging_[i].resize( (size_t)VT_MAX_REQUESTS * TILE_TEXELS );
+	printf( "Virtual textures: %i pages, %i tiles (%.0fMB), %i resident\n", pages, tiles, tiles * tileBytes / ( 1024.f * 1024 ), resident );
+}
+void VirtualTexture::AddPages( const TexRef& _tex )
+{
+	int texture = (int)textures_.size( ), first = (int)pages_.size( );
+	textures_.push_back( _tex );
+	int w = _tex.w, h = _tex.h;
+	for ( int level = 0; level < _tex.levels; level++ )
+	{
+		if ( std::max( w, h ) <= VT_TILE / 2 )
+		{
+			// the rest of the chain goes into a single page
+			pages_.push_back( { texture, level, -1, -1 } );
+			break;
+		}
+		for ( int y = 0; y < ( h + VT_TILE - 1 ) / VT_TILE; y++ )
+			for ( int x = 0; x < ( w + VT_TILE - 1 ) / VT_TILE; x++ ) pages_.push_back( { texture, level, x, y } );
+		w = std::max( 1, w >> 1 ), h = std::max( 1, h >> 1 );
+	}
+	// misses fall back to the last page; without mips there is nothing to fall back to
+	pinned_.resize( pages_.size( ), false );
+	for ( int page = _tex.levels == 1 ? first : (int)pages_.size( ) - 1; page < (int)pages_.size( ); page++ ) pinned_[page] = true;
+}
+void VirtualTexture::LoadPage( int _page, uint* _tile ) const
+{
+	const Page& page = pages_[_page];
+	const TexRef& tex = textures_[page.texture];
+	size_t idx = tex.idx;
+	int w = tex.w, h = tex.h;
+	for ( int i = 0; i < page.level; i++ ) idx += (size_t)w * h, w = std::max( 1, w >> 1 ), h = std::max( 1, h >> 1 );
+	if ( page.x < 0 )
+	{
+		// the tail: this level and every smaller one, one after another
+		for ( int level = page.level; level < tex.levels; level++ )
+		{
+			memcpy( _tile, texels_ + idx, sizeof( uint ) * w * h );
+			_tile += w * h, idx += (size_t)w * h;
+			w = std::max( 1, w >> 1 ), h = std::max( 1, h >> 1 );
+		}
+		return;
+	}
+	int x0 = page.x * VT_TILE, y0 = page.y * VT_TILE;
+	int columns = std::min( VT_TILE, w - x0 ), rows = std::min( VT_TILE, h - y0 );
+	for ( int y = 0; y < rows; y++ ) memcpy( _tile + y * VT_TILE, texels_ + idx + x0 + (size_t)( y0 + y ) * w, sizeof( uint ) * columns );
+}
+void VirtualTexture::Update( int _slot )
+{
+	loaded = 0;
+	if ( allResident_ ) return;
+	const uint* feedback = lru_.BeginFrame( _slot );
+	int requests = std::min( (int)feedback[0], VT_MAX_REQUESTS );
+	auto setEntry = [&]( int page, int tile ) { pageTable_[page] = tile, lru_.SetEntry( _slot, page, tile ); };
+	for ( int i = 0; i < requests; i++ )
+	{
+		int page = feedback[1 + i], tile = lru_.Victim( );
+		if ( tile < 0 )
+		{
+			// every tile holds a page the frame used: the request comes back once one is free
+			setEntry( page, VT_ABSENT );
+			continue;
+		}
+		if ( tilePage_[tile] >= 0 ) setEntry( tilePage_[tile], VT_ABSENT );
+		else resident++;
+		// the kernels queued before this write are done with the old page
+		uint* data = staging_[_slot].data( ) + (size_t)loaded++ * TILE_TEXELS;
+		LoadPage( page, data );
+		clEnqueueWriteBuffer( Kernel::GetQueue( ), tileBuffer->deviceBuffer, CL_FALSE, sizeof( uint ) * TILE_TEXELS * tile, sizeof( uint ) * TILE_TEXELS, data, 0, 0, 0 );
+		tilePage_[tile] = page;
+		setEntry( page, tile );
+		lru_.Touch( tile );
+	}
+	lru_.WriteEntries( _slot, pageTableBuffer );
+}
+void VirtualTexture::Readback( int _slot )
+{
+	if ( !allResident_ ) lru_.Readback( _slot );
+}
@@ -0,0 +1,37 @@
+#pragma once
+// keeps the pages of the scene textures the device needs in a fixed pool of tiles, so texture sets
+// larger than device memory still render. Kernels look texels up through a page table; a page that
+// is not resident is queued in the feedback buffer and the coarser levels stand in. Every frame the
+// host reads the feedback back, loads the queued pages and evicts the least recently used tiles
+class VirtualTexture
+{
+public:
+	// assigns every texture of the scene its pages, writing them into the materials, and fills the pool
+	void Init( Scene& scene );
+	// loads the pages requested in the feedback that was read back into this frame slot
+	void Update( int slot );
+	// reads this frame's feedback back into the slot without blocking, then clears it for the next
+	void Readback( int slot );
+	Buffer* tileBuffer = 0; // the pool
+	Buffer* pageTableBuffer = 0;
+	Buffer* feedbackBuffer = 0;
+	int pages = 0, tiles = 0, resident = 0, loaded = 0; // loaded by the last Update
+private:
+	// a tile of a mip level, or the tail of the chain when x is -1
+	struct Page
+	{
+		int texture, level, x, y;
+	};
+	void AddPages( const TexRef& tex );
+	void LoadPage( int page, uint* tile ) const;
+	const uint* texels_ = 0;
+	std::vector<TexRef> textures_;
+	std::vector<Page> pages_;
+	std::vector<bool> pinned_; // per page: the tail, or all pages of a texture without mips
+	std::vector<int> pageTable_; // host copy of the device page table
+	std::vector<int> tilePage_; // page held by each tile, -1 when free
+	Residency lru_; // of the tiles that can be evicted
+	bool allResident_ = false;
+	// per frame slot: page data on its way up, reused once the frame of the slot has finished
+	std::vector<uint> staging_[FRAMES_IN_FLIGHT];
+};
@@ -14,6 +14,10 @@
 #include <list>
 #include <string>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
 #include <math.h>
 #include <algorithm>
 #include <assert.h>
@@ -21,6 +25,9 @@
 #include <random>
 #include <stack>
 #include <filesystem>
+#include <charconv>
+#include <memory>
+#include <unordered_map>
 
 // header for AVX, and every technology before it.
 // if your CPU does not support this (unlikely), include the appropriate header instead.
@@ -1350,6 +1357,7 @@ public:
 	cl_mem* GetDevicePtr() { return &deviceBuffer; }
 	unsigned int* GetHostPtr() { return hostBuffer; }
 	void CopyToDevice( bool blocking = true );
+	void CopyToDevice( unsigned int offset, unsigned int bytes, const void* data = 0, bool blocking = true ); // a range, from data or the host buffer
 	void CopyToDevice2( bool blocking, cl_event* e = 0, const size_t s = 0 );
 	void CopyFromDevice( bool blocking = true );
 	void CopyTo( Buffer* buffer );
@@ -1367,7 +1375,9 @@ class Kernel
 	friend class Buffer;
 public:
 	// constructor / destructor
-	Kernel( char* file, char* entryPoint, const std::vector<std::string> defines = {} );
+	// a build error ends the application, unless buildError is given: the constructor then leaves
+	// kernel at 0 and stores what went wrong there. Builds on other threads share no state
+	Kernel( char* file, char* entryPoint, const std::vector<std::string> defines = {}, std::string* buildError = 0 );
 	Kernel( cl_program& existingProgram, char* entryPoint );
 	~Kernel();
 	// get / set
@@ -1515,10 +1525,8 @@ private:
 	inline static cl_device_id device;
 	inline static cl_context context; // simplifies some things, but limits us to one device
 	inline static cl_command_queue queue, queue2;
-	inline static char* log = 0;
 	inline static bool isNVidia = false, isAMD = false, isIntel = false, isOther = false;
 	inline static bool isAmpere = false, isTuring = false, isPascal = false;
-	inline static int vendorLines = 0;
 public:
 	inline static bool candoInterop = false, clStarted = false;
 };
@@ -1664,15 +1672,26 @@ public:
 };
 
 float3* LoadImageF( const char* file, int& width, int& height, int& channels );
+uint* LoadImage8( const char* file, int& width, int& height );
 void SaveImageF(const char* file, int width, int height, float4* data);
 
 #include "util.h"
+#include "mappedfile.h"
 #include "constants.h"
 #include "common.h"
 #include "bvh.h"
+#include "texturemanager.h"
 #include "scene.h"
+#include "scenecache.h"
+#include "objloader.h"
+#include "gltfloader.h"
 #include "camera.h"
 #include "tlas.h"
+#include "kernelcompiler.h"
+#include "exporter.h"
+#include "residency.h"
+#include "virtualtexture.h"
+#include "blaspool.h"
 #include "renderer.h"
 
 // EOF
\ No newline at end of file
@@ -1136,6 +1136,15 @@ void Buffer::CopyToDevice(bool blocking)
 	CHECKCL(error = clEnqueueWriteBuffer(Kernel::GetQueue(), deviceBuffer, blocking, 0, size, hostBuffer, 0, 0, 0));
 }
 
+// CopyToDevice method, range version
+// ----------------------------------------------------------------------------
+void Buffer::CopyToDevice(unsigned int offset, unsigned int bytes, const void* data, bool blocking)
+{
+	cl_int error;
+	if (!data) data = (unsigned char*)hostBuffer + offset;
+	CHECKCL(error = clEnqueueWriteBuffer(Kernel::GetQueue(), deviceBuffer, blocking, offset, bytes, data, 0, 0, 0));
+}
+
 // CopyToDevice2 method (uses 2nd queue)
 // ----------------------------------------------------------------------------
 void Buffer::CopyToDevice2(bool blocking, cl_event* eventToSet, const size_t s)
@@ -1181,14 +1190,14 @@ void Buffer::Clear()
 
 // Kernel constructor
 // ----------------------------------------------------------------------------
-Kernel::Kernel( char* file, char* entryPoint, const std::vector<std::string> defines )
+Kernel::Kernel( char* file, char* entryPoint, const std::vector<std::string> defines, std::string* buildError )
 {
 	if (!clStarted) InitCL();
 	// load a cl file
 	string csText = TextFileRead( file );
 	if (csText.size() == 0) FatalError( "File %s not found", file );
 	// add vendor defines
-	vendorLines = 0;
+	int vendorLines = 0;
 	if (isNVidia) csText = "#define ISNVIDIA\n" + csText, vendorLines++;
 	if (isAMD) csText = "#define ISAMD\n" + csText, vendorLines++;
 	if (isIntel) csText = "#define ISINTEL\n" + csText, vendorLines++;
@@ -1271,21 +1280,25 @@ Kernel::Kernel( char* file, char* entryPoint, const std::vector<std::string> def
 		for (uint i = 0; i < devCount; i++)
 			binaries[i] = new char[size[i] + 1];
 		CHECKCL(clGetProgramInfo(program, CL_PROGRAM_BINARIES, devCount * sizeof(size_t), binaries, NULL));
+		// another thread may be writing the dump as well
 		FILE* f = fopen("buildlog.txt", "wb");
-		for (uint i = 0; i < devCount; i++)
-			fwrite(binaries[i], 1, size[i] + 1, f);
-		fclose(f);
+		if (f)
+		{
+			for (uint i = 0; i < devCount; i++)
+				fwrite(binaries[i], 1, size[i] + 1, f);
+			fclose(f);
+		}
 	}
 	else
 	{
+		string message;
 		// obtain the error log from the cl compiler
-		if (!log) log = new char[256 * 1024]; // can be quite large
-		log[0] = 0;
+		std::vector<char> logBuffer(256 * 1024); // can be quite large
+		char* log = logBuffer.data();
 		clGetProgramBuildInfo(program, getFirstDevice(context), CL_PROGRAM_BUILD_LOG, 256 * 1024, log, &size);
 		// save error log for closer inspection
 		FILE* f = fopen("errorlog.txt", "wb");
-		fwrite(log, 1, size, f);
-		fclose(f);
+		if (f) fwrite(log, 1, size, f), fclose(f);
 		// find and display the first error. Note: platform specific sadly; code below is for NVIDIA
 		char* error = strstr(log, ": error:");
 		if (error)
@@ -1296,7 +1309,7 @@ Kernel::Kernel( char* file, char* entryPoint, const std::vector<std::string> def
 			log[errorPos + 2048] = 0;
 			int lineNr = 0, linePos = 0;
 			char* lns = strstr(log + errorPos, ">:"), * eol;
-			if (!lns) FatalError(log + errorPos); else
+			if (!lns) message = log + errorPos; else
 			{
 				lns += 2;
 				while (*lns >= '0' && *lns <= '9') lineNr = lineNr * 10 + (*lns++ - '0');
@@ -1329,15 +1342,20 @@ Kernel::Kernel( char* file, char* entryPoint, const std::vector<std::string> def
 				// present error message
 				char t[1024];
 				sprintf(t, "file %s, line %i, pos %i:\n%s", errorFile.c_str(), lineNr + 1, linePos, lns);
-				FatalError(t, "Build error");
+				message = t;
 			}
 		}
 		else
 		{
 			// error string has unknown format; just dump it to a window
 			log[2048] = 0; // truncate very long logs
-			FatalError(log, "Build error");
+			message = log;
 		}
+		if (!buildError) FatalError(message.c_str(), "Build error");
+		*buildError = message;
+		clReleaseProgram(program);
+		program = 0, kernel = 0;
+		return;
 	}
 	kernel = clCreateKernel(program, entryPoint, &error);
 	if (kernel == 0) FatalError("clCreateKernel failed: entry point not found.");
@@ -1612,8 +1630,8 @@ void Kernel::Run2D(const int2 count, const int2 lsize, cl_event* eventToWaitFor,
 
 float3* LoadImageF(const char* file, int& w, int& h, int& c)
 {
-	cout << "I/LoadImageF: " << file << endl;
 	float* data = stbi_loadf(file, &w, &h, &c, 0);
+	if (!data) return 0;
 	int s = w * h;
 	float3* result = new float3[s];
 	for (int i = 0; i < s; i++)
@@ -1626,6 +1644,19 @@ float3* LoadImageF(const char* file, int& w, int& h, int& c)
 	return result;
 }		
 
+// RGBA, 8 bits per channel as stored in the file; returns 0 for HDR files
+uint* LoadImage8(const char* file, int& w, int& h)
+{
+	if (stbi_is_hdr(file)) return 0;
+	int c;
+	uchar* data = stbi_load(file, &w, &h, &c, 4);
+	if (!data) return 0;
+	uint* result = new uint[w * h];
+	memcpy(result, data, sizeof(uint) * w * h);
+	stbi_image_free(data);
+	return result;
+}
+
 void SaveImageF(const char* file, int w, int h, float4* data)
 {
 	int s = w * h;